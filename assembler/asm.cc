@@ -1,10 +1,22 @@
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstdio>
+#include <exception>
 #include <iostream>
 #include <string>
+#include <string_view>
+#include <thread>
 #include <vector>
 #include <unordered_map>
 #include <sstream> // For std::ostringstream
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
 #include "scanner.h"
+#include "../common/parallel.h"
 
 std::string kindToString(Token::Kind kind)
 {
@@ -38,17 +50,64 @@ std::string kindToString(Token::Kind kind)
   }
 }
 
-void output_uint_to_bin(int64_t a)
+// Stores word at out[0..3], most significant byte first
+inline void store_word(unsigned char *out, uint32_t word)
+{
+  out[0] = (word >> 24) & 0xff;
+  out[1] = (word >> 16) & 0xff;
+  out[2] = (word >> 8) & 0xff;
+  out[3] = word & 0xff;
+}
+
+// Writes the program to stdout with a single fwrite
+void write_words_to_stdout(const std::vector<uint32_t> &words)
+{
+  std::vector<unsigned char> bytes(words.size() * 4);
+  for (size_t i = 0; i < words.size(); i++)
+  {
+    store_word(&bytes[i * 4], words[i]);
+  }
+  if (fwrite(bytes.data(), 1, bytes.size(), stdout) != bytes.size() || fflush(stdout) != 0)
+  {
+    throw std::runtime_error("ERROR: Failed to write output");
+  }
+}
+
+// Writes the program straight into a mapping of path.
+// The size is known once every label is resolved, so the file is sized up front
+void write_words_to_file(const std::vector<uint32_t> &words, const char *path)
 {
-  char c;
-  c = (a >> 24) & 0xff;
-  std::cout << c;
-  c = (a >> 16) & 0xff;
-  std::cout << c;
-  c = (a >> 8) & 0xff;
-  std::cout << c;
-  c = (a >> 0) & 0xff; // or c = a & 0xff
-  std::cout << c;
+  size_t size = words.size() * 4;
+  int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+  {
+    throw std::runtime_error(std::string("ERROR: Cannot open output file ") + path);
+  }
+  if (size == 0)
+  {
+    close(fd);
+    return;
+  }
+  if (ftruncate(fd, size) != 0)
+  {
+    close(fd);
+    throw std::runtime_error(std::string("ERROR: Cannot resize output file ") + path);
+  }
+  void *mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (mapping == MAP_FAILED)
+  {
+    close(fd);
+    throw std::runtime_error(std::string("ERROR: Cannot map output file ") + path);
+  }
+
+  unsigned char *out = static_cast<unsigned char *>(mapping);
+  for (size_t i = 0; i < words.size(); i++)
+  {
+    store_word(&out[i * 4], words[i]);
+  }
+
+  munmap(mapping, size);
+  close(fd);
 }
 
 // Throws if out of range
@@ -79,7 +138,7 @@ void check_itmd_range_hex(int itmd)
 }
 
 // Throws if Token is not of right kind
-void check_token_ok(Token::Kind expected, Token actual)
+void check_token_ok(Token::Kind expected, const TokenView &actual)
 {
   if (actual.getKind() != expected)
   {
@@ -94,7 +153,8 @@ void check_token_ok(Token::Kind expected, Token actual)
 
 // Returns true (1) if ok
 // Returns false if not ok
-void check_token_ok(const std::vector<Token::Kind> possibleExpected, Token actual)
+// Takes an initializer_list so checking doesn't allocate
+void check_token_ok(std::initializer_list<Token::Kind> possibleExpected, const TokenView &actual)
 {
   for (Token::Kind expected : possibleExpected)
   {
@@ -108,7 +168,7 @@ void check_token_ok(const std::vector<Token::Kind> possibleExpected, Token actua
   msg << "ERROR: Expected one of [";
   for (size_t i = 0; i < possibleExpected.size(); ++i)
   {
-    msg << kindToString(possibleExpected[i]);
+    msg << kindToString(possibleExpected.begin()[i]);
     if (i < possibleExpected.size() - 1)
     {
       msg << ", "; // Add comma between kinds except for the last one
@@ -127,885 +187,874 @@ void check_next_token_exists(int i, int n_tokens)
   }
 }
 
-/*
- * C++ Starter code for CS241 A3
- *
- * This file contains the main function of your program. By default, it just
- * prints the scanned list of tokens back to standard output.
- */
-int main()
+// An instruction or .word that refers to a label which hasn't been defined yet
+struct Fixup
+{
+  size_t index;  // Position of the word in the output
+  bool isBranch; // beq/bne take an offset relative to the next instruction, .word takes the address
+};
+
+// Returns the operand for a label used by the word at index.
+// If the label isn't defined yet, records a fixup and returns 0 so the word can be patched later
+int64_t resolve_label(std::string_view label, bool isBranch, size_t index,
+                      const std::unordered_map<std::string_view, int> &symbolTable,
+                      std::unordered_map<std::string_view, std::vector<Fixup>> &pendingFixups)
 {
-  std::string line;
-  std::unordered_map<std::string, int> symbolTable;
+  auto it = symbolTable.find(label);
+  if (it == symbolTable.end())
+  {
+    pendingFixups[label].push_back({index, isBranch});
+    return 0;
+  }
+  return isBranch ? it->second / 4 - (int64_t)(index + 1) : it->second;
+}
 
-  try
+// Fills in a label reference now that the label's address is known
+void apply_fixup(std::vector<uint32_t> &words, const Fixup &fixup, int address)
+{
+  if (fixup.isBranch)
+  {
+    int64_t offset = address / 4 - (int64_t)(fixup.index + 1);
+    words[fixup.index] = (words[fixup.index] & 0xffff0000) | (offset & 0xffff);
+  }
+  else
+  {
+    words[fixup.index] = address;
+  }
+}
+
+// What --merl keeps track of besides the code, to build the module's relocation and external symbol table
+struct Module
+{
+  std::vector<std::string_view> imports;
+  std::vector<std::string_view> exports;
+  // Every .word that holds a label's address: (position of the word, label).
+  // These become REL entries, or ESR entries for imported labels
+  std::vector<std::pair<size_t, std::string_view>> labelWords;
+};
+
+// MERL table entry formats
+const uint32_t MERL_COOKIE = 0x10000002; // beq $0, $0, 2, which skips the rest of the header
+const uint32_t MERL_REL = 0x01;
+const uint32_t MERL_ESR = 0x11;
+const uint32_t MERL_ESD = 0x05;
+
+// Operand formats. Each one has a single encoder in encode_instruction
+enum class Format
+{
+  R3,    // add $d, $s, $t
+  R2,    // mult $s, $t
+  D1,    // mfhi $d
+  S1,    // jr $s
+  MEM,   // lw $t, i($s)
+  BRANCH // beq $s, $t, i
+};
+
+struct Opcode
+{
+  std::string_view mnemonic;
+  Format format;
+  uint32_t bits; // funct for the register formats, opcode << 26 for MEM and BRANCH
+};
+
+constexpr Opcode OPCODES[] = {
+    {"add", Format::R3, 0b100000},
+    {"sub", Format::R3, 0b100010},
+    {"slt", Format::R3, 0b101010},
+    {"sltu", Format::R3, 0b101011},
+    {"mult", Format::R2, 0b011000},
+    {"multu", Format::R2, 0b011001},
+    {"div", Format::R2, 0b011010},
+    {"divu", Format::R2, 0b011011},
+    {"mfhi", Format::D1, 0b010000},
+    {"mflo", Format::D1, 0b010010},
+    {"lis", Format::D1, 0b010100},
+    {"jr", Format::S1, 0b001000},
+    {"jalr", Format::S1, 0b001001},
+    {"lw", Format::MEM, 0b100011u << 26},
+    {"sw", Format::MEM, 0b101011u << 26},
+    {"beq", Format::BRANCH, 0b000100u << 26},
+    {"bne", Format::BRANCH, 0b000101u << 26},
+};
+
+constexpr size_t OPCODE_TABLE_SIZE = 32;
+
+// Perfect hash over the mnemonics in OPCODES (checked by the static_assert below)
+constexpr size_t opcode_hash(std::string_view mnemonic)
+{
+  return (mnemonic.front() + 3 * mnemonic.back() + mnemonic.size()) % OPCODE_TABLE_SIZE;
+}
+
+// Hash slot -> index into OPCODES, or -1 if empty
+constexpr std::array<int, OPCODE_TABLE_SIZE> build_opcode_table()
+{
+  std::array<int, OPCODE_TABLE_SIZE> table{};
+  for (int &slot : table)
   {
-    // Store the Tokens into an istringstream so we can read them twice
-    std::string input;
-    std::string line;
-    while (getline(std::cin, line))
+    slot = -1;
+  }
+  for (size_t i = 0; i < std::size(OPCODES); i++)
+  {
+    table[opcode_hash(OPCODES[i].mnemonic)] = i;
+  }
+  return table;
+}
+
+constexpr std::array<int, OPCODE_TABLE_SIZE> OPCODE_TABLE = build_opcode_table();
+
+constexpr bool opcode_hash_is_perfect()
+{
+  for (size_t i = 0; i < std::size(OPCODES); i++)
+  {
+    if (OPCODE_TABLE[opcode_hash(OPCODES[i].mnemonic)] != (int)i)
     {
-      input += line + "\n"; // Preserve line breaks
+      return false;
     }
+  }
+  return true;
+}
+
+static_assert(opcode_hash_is_perfect(), "opcode_hash has a collision, change its multipliers");
+
+// Returns the table entry for a mnemonic, or nullptr if it isn't an instruction
+const Opcode *find_opcode(std::string_view mnemonic)
+{
+  if (mnemonic.empty())
+  {
+    return nullptr;
+  }
+  int index = OPCODE_TABLE[opcode_hash(mnemonic)];
+  if (index < 0 || OPCODES[index].mnemonic != mnemonic)
+  {
+    return nullptr;
+  }
+  return &OPCODES[index];
+}
+
+// Advances to the next token on the line and checks its kind
+const TokenView &next_token(const std::vector<TokenView> &tokenLine, long unsigned int &i, Token::Kind expected)
+{
+  check_next_token_exists(i, tokenLine.size());
+  const TokenView &token = tokenLine.at(++i);
+  check_token_ok(expected, token);
+  return token;
+}
 
-    // First pass: Process each line to construct the symbol table
-    // Keep track of number of non-null-lines
-    // Construct symbol table
-    // Check for duplicate label definitions
-    std::istringstream stream1(input);
-    int non_null_lines = 0;
-    while (getline(stream1, line))
+// A malformed register operand or missing comma. Reported as is, with no prefix, the way the
+// assembler always has
+class OperandError : public std::runtime_error
+{
+public:
+  using std::runtime_error::runtime_error;
+};
+
+// Reads a register operand, followed by a comma if more operands come after it.
+// Callers check the register's range once the whole instruction has been read
+int64_t next_reg(const std::vector<TokenView> &tokenLine, long unsigned int &i, bool comma)
+{
+  check_next_token_exists(i, tokenLine.size());
+  const TokenView &reg = tokenLine.at(++i);
+  if (reg.getKind() != Token::REG)
+  {
+    std::ostringstream message;
+    message << "ERROR: Expected Register " << Token(reg.getKind(), std::string(reg.getLexeme()));
+    throw OperandError(message.str());
+  }
+  if (comma)
+  {
+    check_next_token_exists(i, tokenLine.size());
+    if (tokenLine.at(++i).getKind() != Token::COMMA)
     {
-      std::vector<Token> tokenLine = scan(line);
-      for (long unsigned int i = 0; i < tokenLine.size(); i++)
-      {
+      throw OperandError("ERROR: Missing comma in add! ");
+    }
+  }
+  return reg.toNumber();
+}
 
-        if (tokenLine.at(i).getKind() == Token::ID || tokenLine.at(i).getKind() == Token::WORD)
-        {
-          non_null_lines++;
-          break;
-        }
-        else if (tokenLine.at(i).getKind() == Token::LABEL)
-        {
-          std::string label = tokenLine.at(i).getLexeme().substr(0, tokenLine.at(i).getLexeme().size() - 1); // Remove the colon before the search
-          auto it = symbolTable.find(label);
-          if (it != symbolTable.end())
-          {
-            // Found duplicate label
-            throw std::runtime_error("ERROR: Duplicate label found: " + label);
-          }
-          else
-          {
-            // Key doesn't exist yet
-            symbolTable[tokenLine.at(i).getLexeme().substr(0, tokenLine.at(i).getLexeme().size() - 1)] = (non_null_lines) * 4;
-          }
-        }
-      }
+// Checks that an INT or HEXINT immediate fits in 16 bits
+int64_t check_immediate(const TokenView &itmd)
+{
+  int64_t int_itmd = itmd.toNumber();
+  if (itmd.getKind() == Token::INT)
+  {
+    check_itmd_range_int(int_itmd);
+  }
+  else
+  {
+    check_itmd_range_hex(int_itmd);
+  }
+  return int_itmd;
+}
+
+// Reads the operands of the instruction at tokenLine[i] and returns its encoding.
+// index is the instruction's position in the output, for resolving branch labels
+uint32_t encode_instruction(const Opcode &op, const std::vector<TokenView> &tokenLine, long unsigned int &i, size_t index,
+                            const std::unordered_map<std::string_view, int> &symbolTable,
+                            std::unordered_map<std::string_view, std::vector<Fixup>> &pendingFixups)
+{
+  switch (op.format)
+  {
+  case Format::R3:
+  {
+    // 0000 00ss ssst tttt dddd d000 00ff ffff
+    int64_t int_d = next_reg(tokenLine, i, true);
+    int64_t int_s = next_reg(tokenLine, i, true);
+    int64_t int_t = next_reg(tokenLine, i, false);
+    check_reg_range(int_s);
+    check_reg_range(int_t);
+    check_reg_range(int_d);
+    return (int_s << 21) | (int_t << 16) | (int_d << 11) | op.bits;
+  }
+  case Format::R2:
+  {
+    // 0000 00ss ssst tttt 0000 0000 00ff ffff
+    int64_t int_s = next_reg(tokenLine, i, true);
+    int64_t int_t = next_reg(tokenLine, i, false);
+    check_reg_range(int_s);
+    check_reg_range(int_t);
+    return (int_s << 21) | (int_t << 16) | op.bits;
+  }
+  case Format::D1:
+  {
+    // 0000 0000 0000 0000 dddd d000 00ff ffff
+    int64_t int_d = next_reg(tokenLine, i, false);
+    check_reg_range(int_d);
+    return (int_d << 11) | op.bits;
+  }
+  case Format::S1:
+  {
+    // 0000 00ss sss0 0000 0000 0000 00ff ffff
+    int64_t int_s = next_reg(tokenLine, i, false);
+    check_reg_range(int_s);
+    return (int_s << 21) | op.bits;
+  }
+  case Format::MEM:
+  {
+    // oooo ooss ssst tttt iiii iiii iiii iiii
+    int64_t int_t = next_reg(tokenLine, i, true);
+    check_next_token_exists(i, tokenLine.size());
+    const TokenView &itmd = tokenLine.at(++i);
+    check_token_ok({Token::INT, Token::HEXINT}, itmd);
+    next_token(tokenLine, i, Token::LPAREN);
+    int64_t int_s = next_reg(tokenLine, i, false);
+    next_token(tokenLine, i, Token::RPAREN);
+    check_reg_range(int_s);
+    check_reg_range(int_t);
+    int64_t int_itmd = check_immediate(itmd);
+    return op.bits | (int_s << 21) | (int_t << 16) | (int_itmd & 0xffff);
+  }
+  case Format::BRANCH:
+  {
+    // oooo ooss ssst tttt iiii iiii iiii iiii
+    int64_t int_s = next_token(tokenLine, i, Token::REG).toNumber();
+    next_token(tokenLine, i, Token::COMMA);
+    int64_t int_t = next_token(tokenLine, i, Token::REG).toNumber();
+    next_token(tokenLine, i, Token::COMMA);
+    check_next_token_exists(i, tokenLine.size());
+    const TokenView &itmd = tokenLine.at(++i);
+    check_token_ok({Token::INT, Token::HEXINT, Token::ID}, itmd);
+    check_reg_range(int_s);
+    check_reg_range(int_t);
+
+    int64_t int_itmd;
+    if (itmd.getKind() == Token::ID)
+    { // If immediate is a label
+      // Load the label offset (patched later if the label isn't defined yet)
+      int_itmd = resolve_label(itmd.getLexeme(), true, index, symbolTable, pendingFixups);
     }
+    else
+    { // If immediate is an int or hexint
+      int_itmd = check_immediate(itmd);
+    }
+    return op.bits | (int_s << 21) | (int_t << 16) | (int_itmd & 0xffff);
+  }
+  }
+  throw std::runtime_error("ERROR: Unknown instruction format");
+}
 
-    // Printing the symbol table
-    // for (const auto &pair : symbolTable)
-    // {
-    //   std::cout << "Label: " << pair.first << ", Line Number: " << pair.second << std::endl;
-    // }
+// Splits input into lines and calls fn(line, lineNumber) for each, numbering from 0
+template <typename Fn>
+void for_each_line(std::string_view input, Fn fn)
+{
+  size_t lineNumber = 0;
+  for (size_t lineStart = 0; lineStart < input.size(); lineNumber++)
+  {
+    size_t lineEnd = input.find('\n', lineStart);
+    if (lineEnd == std::string_view::npos)
+    {
+      lineEnd = input.size();
+    }
+    fn(input.substr(lineStart, lineEnd - lineStart), lineNumber);
+    lineStart = lineEnd + 1;
+  }
+}
 
-    // Second pass: using another istringstream
-    std::istringstream stream2(input);
-    non_null_lines = 0;
-    while (getline(stream2, line))
+// Assembles one scanned line, appending its words to words.
+// base is the position of words[0] in the whole program, for label addresses and branch offsets.
+// With defineLabels, labels on the line are added to symbolTable and their pending fixups are applied;
+// otherwise they are assumed to be in symbolTable already.
+// module is null unless assembling with --merl, which is the only time .import and .export are allowed
+void assemble_line(const std::vector<TokenView> &tokenLine, std::vector<uint32_t> &words, size_t base, bool defineLabels,
+                   std::unordered_map<std::string_view, int> &symbolTable,
+                   std::unordered_map<std::string_view, std::vector<Fixup>> &pendingFixups,
+                   Module *module = nullptr)
+{
+  for (long unsigned int i = 0; i < tokenLine.size(); i++)
+  {
+    // label:
+    if (tokenLine.at(i).getKind() == Token::LABEL)
     {
-      // This example code just prints the scanned tokens on each line.
-      std::vector<Token> tokenLine = scan(line);
-
-      // This code is just an example - you don't have to use a range-based
-      // for loop in your actual assembler. You might find it easier to
-      // use an index-based loop like this:
-      // for(int i=0; i<tokenLine.size(); i++) { ... }
-      // for (auto &token : tokenLine)
-      // {
-      //   std::cout << token << ' ';
-      // }
-
-      for (long unsigned int i = 0; i < tokenLine.size(); i++)
+      if (!defineLabels)
+      {
+        continue;
+      }
+      std::string_view label = tokenLine.at(i).getLexeme().substr(0, tokenLine.at(i).getLexeme().size() - 1); // Remove the colon
+      if (symbolTable.find(label) != symbolTable.end())
       {
+        // Found duplicate label
+        throw std::runtime_error("ERROR: Duplicate label found: " + std::string(label));
+      }
+      int address = (base + words.size()) * 4;
+      symbolTable[label] = address;
 
-        // Handle non_null_lines counter
-        // If token is an ID and it's not a label (I.e. not in symbol table)
-        // WORD also works
-        auto it = symbolTable.find(tokenLine.at(i).getLexeme());
-        if (tokenLine.at(i).getKind() == Token::WORD || (tokenLine.at(i).getKind() == Token::ID && it == symbolTable.end()))
+      auto pending = pendingFixups.find(label);
+      if (pending != pendingFixups.end())
+      {
+        for (const Fixup &fixup : pending->second)
         {
-          non_null_lines++;
+          apply_fixup(words, fixup, address);
         }
-        // Used to check if an unrecognized token is a label
-        std::string string_with_colon = tokenLine.at(i).getLexeme().substr(0, tokenLine.at(i).getLexeme().size() - 1);
-        it = symbolTable.find(string_with_colon);
+        pendingFixups.erase(pending);
+      }
+      continue;
+    }
 
-        // .word
-        if (tokenLine.at(i).getLexeme() == ".word")
-        {
-          // Get the next token and convert to binary
-          check_next_token_exists(i, tokenLine.size());
-          Token token = tokenLine.at(++i);
-          check_token_ok({Token::INT, Token::HEXINT, Token::ID}, token);
-
-          if (token.getKind() == Token::ID)
-          {
-            // Check if label is not in symbol table
-            auto it = symbolTable.find(token.getLexeme());
-            if (it == symbolTable.end())
-            {
-              // Label doesn't exist
-              throw std::runtime_error("ERROR: Label used without declaration: " + token.getLexeme());
-            }
-
-            // Check if label offset is in decimal range
-            check_itmd_range_int(token.toNumber());
-            // Print the label offset
-            output_uint_to_bin(symbolTable[token.getLexeme()]);
-          }
-          else
-          { // token is an int or hex int
-            int64_t int_rep = token.toNumber();
-            if (int_rep < 0 || int_rep > 4294967295)
-            {
-              throw std::out_of_range("ERROR: Value out of range: " + token.getLexeme());
-            }
-            output_uint_to_bin(int_rep);
-          }
-        }
-        // add
-        else if (tokenLine.at(i).getLexeme() == "add")
-        {
-          // add $1, $2, $3 will look like:
-          // Token(ID, add) Token(REG, $1) Token(COMMA, ,) Token(REG, $2) Token(COMMA, ,) Token(REG, $3)
-          // Get the next token and convert to binary
-          check_next_token_exists(i, tokenLine.size());
-          Token d = tokenLine.at(++i);
-          if (d.getKind() != Token::REG)
-          {
-            std::cerr << "ERROR: Expected Register " << d << std::endl;
-            return 1;
-          }
-          check_next_token_exists(i, tokenLine.size());
-          Token comma = tokenLine.at(++i);
-          // Check if token is a comma
-          if (comma.getKind() != Token::COMMA)
-          {
-            std::cerr << "ERROR: Missing comma in add! " << std::endl;
-            return 1;
-          }
-          check_next_token_exists(i, tokenLine.size());
-          Token s = tokenLine.at(++i);
-          if (s.getKind() != Token::REG)
-          {
-            std::cerr << "ERROR: Expected Register " << s << std::endl;
-            return 1;
-          }
-          check_next_token_exists(i, tokenLine.size());
-          comma = tokenLine.at(++i);
-          // Check if token is a comma
-          if (comma.getKind() != Token::COMMA)
-          {
-            std::cerr << "ERROR: Missing comma in add! " << std::endl;
-            return 1;
-          }
-          check_next_token_exists(i, tokenLine.size());
-          Token t = tokenLine.at(++i);
-          if (t.getKind() != Token::REG)
-          {
-            std::cerr << "ERROR: Expected Register " << t << std::endl;
-            return 1;
-          }
-
-          // Check register ranges
-          int64_t int_d = d.toNumber();
-          int64_t int_s = s.toNumber();
-          int64_t int_t = t.toNumber();
-
-          check_reg_range(int_s);
-          check_reg_range(int_t);
-          check_reg_range(int_d);
-
-          // 0000 00ss ssst tttt dddd d000 0010 0000
-          unsigned int result = ((int_s << 21) | (int_t << 16) | (int_d << 11) | 0b00000100000);
-
-          output_uint_to_bin(result);
-        }
-        // sub
-        else if (tokenLine.at(i).getLexeme() == "sub")
-        {
-          // sub $1, $2, $3 will look like:
-          // Token(ID, sub) Token(REG, $1) Token(COMMA, ,) Token(REG, $2) Token(COMMA, ,) Token(REG, $3)
-          // Get the next token and convert to binary
-          check_next_token_exists(i, tokenLine.size());
-          Token d = tokenLine.at(++i);
-          if (d.getKind() != Token::REG)
-          {
-            std::cerr << "ERROR: Expected Register " << d << std::endl;
-            return 1;
-          }
-          check_next_token_exists(i, tokenLine.size());
-          Token comma = tokenLine.at(++i);
-          // Check if token is a comma
-          if (comma.getKind() != Token::COMMA)
-          {
-            std::cerr << "ERROR: Missing comma in add! " << std::endl;
-            return 1;
-          }
-          check_next_token_exists(i, tokenLine.size());
-          Token s = tokenLine.at(++i);
-          if (s.getKind() != Token::REG)
-          {
-            std::cerr << "ERROR: Expected Register " << s << std::endl;
-            return 1;
-          }
-          check_next_token_exists(i, tokenLine.size());
-          comma = tokenLine.at(++i);
-          // Check if token is a comma
-          if (comma.getKind() != Token::COMMA)
-          {
-            std::cerr << "ERROR: Missing comma in add! " << std::endl;
-            return 1;
-          }
-          check_next_token_exists(i, tokenLine.size());
-          Token t = tokenLine.at(++i);
-          if (t.getKind() != Token::REG)
-          {
-            std::cerr << "ERROR: Expected Register " << t << std::endl;
-            return 1;
-          }
-
-          // Check register ranges
-          int64_t int_d = d.toNumber();
-          int64_t int_s = s.toNumber();
-          int64_t int_t = t.toNumber();
-
-          check_reg_range(int_s);
-          check_reg_range(int_t);
-          check_reg_range(int_d);
-
-          unsigned int result = ((int_s << 21) | (int_t << 16) | (int_d << 11) | 0b00000100010);
-
-          output_uint_to_bin(result);
-        }
-        // mult
-        else if (tokenLine.at(i).getLexeme() == "mult")
-        {
-          // mult $1, $2 will look like:
-          // Token(ID, mult) Token(REG, $1) Token(COMMA, ,) Token(REG, $2)
-          // Get the next token and convert to binary
-          check_next_token_exists(i, tokenLine.size());
-          Token s = tokenLine.at(++i);
-          if (s.getKind() != Token::REG)
-          {
-            std::cerr << "ERROR: Expected Register " << s << std::endl;
-            return 1;
-          }
-          check_next_token_exists(i, tokenLine.size());
-          Token comma = tokenLine.at(++i);
-          // Check if token is a comma
-          if (comma.getKind() != Token::COMMA)
-          {
-            std::cerr << "ERROR: Missing comma in add! " << std::endl;
-            return 1;
-          }
-          check_next_token_exists(i, tokenLine.size());
-          Token t = tokenLine.at(++i);
-          if (t.getKind() != Token::REG)
-          {
-            std::cerr << "ERROR: Expected Register " << t << std::endl;
-            return 1;
-          }
-
-          // Check register ranges
-          int64_t int_s = s.toNumber();
-          int64_t int_t = t.toNumber();
-
-          check_reg_range(int_s);
-          check_reg_range(int_t);
-
-          unsigned int result = ((int_s << 21) | (int_t << 16) | 0b0000000000011000);
-
-          output_uint_to_bin(result);
-        }
-        // multu
-        else if (tokenLine.at(i).getLexeme() == "multu")
-        {
-          // Get the next token and convert to binary
-          check_next_token_exists(i, tokenLine.size());
-          Token s = tokenLine.at(++i);
-          if (s.getKind() != Token::REG)
-          {
-            std::cerr << "ERROR: Expected Register " << s << std::endl;
-            return 1;
-          }
-          check_next_token_exists(i, tokenLine.size());
-          Token comma = tokenLine.at(++i);
-          // Check if token is a comma
-          if (comma.getKind() != Token::COMMA)
-          {
-            std::cerr << "ERROR: Missing comma in add! " << std::endl;
-            return 1;
-          }
-          check_next_token_exists(i, tokenLine.size());
-          Token t = tokenLine.at(++i);
-          if (t.getKind() != Token::REG)
-          {
-            std::cerr << "ERROR: Expected Register " << t << std::endl;
-            return 1;
-          }
-
-          // Check register ranges
-          int64_t int_s = s.toNumber();
-          int64_t int_t = t.toNumber();
-
-          check_reg_range(int_s);
-          check_reg_range(int_t);
-
-          unsigned int result = ((int_s << 21) | (int_t << 16) | 0b0000000000011001);
-
-          output_uint_to_bin(result);
-        }
-        // div
-        else if (tokenLine.at(i).getLexeme() == "div")
-        {
-          // Get the next token and convert to binary
-          check_next_token_exists(i, tokenLine.size());
-          Token s = tokenLine.at(++i);
-          if (s.getKind() != Token::REG)
-          {
-            std::cerr << "ERROR: Expected Register " << s << std::endl;
-            return 1;
-          }
-          check_next_token_exists(i, tokenLine.size());
-          Token comma = tokenLine.at(++i);
-          // Check if token is a comma
-          if (comma.getKind() != Token::COMMA)
-          {
-            std::cerr << "ERROR: Missing comma in add! " << std::endl;
-            return 1;
-          }
-          check_next_token_exists(i, tokenLine.size());
-          Token t = tokenLine.at(++i);
-          if (t.getKind() != Token::REG)
-          {
-            std::cerr << "ERROR: Expected Register " << t << std::endl;
-            return 1;
-          }
-
-          // Check register ranges
-          int64_t int_s = s.toNumber();
-          int64_t int_t = t.toNumber();
-
-          check_reg_range(int_s);
-          check_reg_range(int_t);
-
-          unsigned int result = ((int_s << 21) | (int_t << 16) | 0b0000000000011010);
-          output_uint_to_bin(result);
-        }
-        // divu
-        else if (tokenLine.at(i).getLexeme() == "divu")
-        {
-          // Get the next token and convert to binary
-          check_next_token_exists(i, tokenLine.size());
-          Token s = tokenLine.at(++i);
-          if (s.getKind() != Token::REG)
-          {
-            std::cerr << "ERROR: Expected Register " << s << std::endl;
-            return 1;
-          }
-          check_next_token_exists(i, tokenLine.size());
-          Token comma = tokenLine.at(++i);
-          // Check if token is a comma
-          if (comma.getKind() != Token::COMMA)
-          {
-            std::cerr << "ERROR: Missing comma in add! " << std::endl;
-            return 1;
-          }
-          check_next_token_exists(i, tokenLine.size());
-          Token t = tokenLine.at(++i);
-          if (t.getKind() != Token::REG)
-          {
-            std::cerr << "ERROR: Expected Register " << t << std::endl;
-            return 1;
-          }
-
-          // Check register ranges
-          int64_t int_s = s.toNumber();
-          int64_t int_t = t.toNumber();
-
-          check_reg_range(int_s);
-          check_reg_range(int_t);
-
-          unsigned int result = ((int_s << 21) | (int_t << 16) | 0b0000000000011011);
-
-          output_uint_to_bin(result);
-        }
-        // mfhi
-        else if (tokenLine.at(i).getLexeme() == "mfhi")
-        {
-          // Get the next token and convert to binary
-          check_next_token_exists(i, tokenLine.size());
-          Token d = tokenLine.at(++i);
-          if (d.getKind() != Token::REG)
-          {
-            std::cerr << "ERROR: Expected Register " << d << std::endl;
-            return 1;
-          }
-          // Check register ranges
-          int64_t int_d = d.toNumber();
-
-          check_reg_range(int_d);
-
-          unsigned int result = ((int_d << 11) | 0b00000010000);
-
-          output_uint_to_bin(result);
-        }
-        // mflo
-        else if (tokenLine.at(i).getLexeme() == "mflo")
-        {
-          // Get the next token and convert to binary
-          check_next_token_exists(i, tokenLine.size());
-          Token d = tokenLine.at(++i);
-          if (d.getKind() != Token::REG)
-          {
-            std::cerr << "ERROR: Expected Register " << d << std::endl;
-            return 1;
-          }
-          // Check register ranges
-          int64_t int_d = d.toNumber();
-
-          check_reg_range(int_d);
-
-          unsigned int result = ((int_d << 11) | 0b00000010010);
-
-          output_uint_to_bin(result);
-        }
-        // lis
-        else if (tokenLine.at(i).getLexeme() == "lis")
-        {
-          // Get the next token and convert to binary
-          check_next_token_exists(i, tokenLine.size());
-          Token d = tokenLine.at(++i);
-          if (d.getKind() != Token::REG)
-          {
-            std::cerr << "ERROR: Expected Register " << d << std::endl;
-            return 1;
-          }
-          // Check register ranges
-          int64_t int_d = d.toNumber();
-
-          check_reg_range(int_d);
-
-          unsigned int result = ((int_d << 11) | 0b00000010100);
-
-          output_uint_to_bin(result);
-        }
-        // lw
-        else if (tokenLine.at(i).getLexeme() == "lw")
-        {
-          // Get the next token and convert to binary
-          check_next_token_exists(i, tokenLine.size());
-          Token t = tokenLine.at(++i);
-          if (t.getKind() != Token::REG)
-          {
-            std::cerr << "ERROR: Expected Register " << t << std::endl;
-            return 1;
-          }
-          check_next_token_exists(i, tokenLine.size());
-          Token comma = tokenLine.at(++i);
-          // Check if token is a comma
-          if (comma.getKind() != Token::COMMA)
-          {
-            std::cerr << "ERROR: Missing comma in add! " << std::endl;
-            return 1;
-          }
-          check_next_token_exists(i, tokenLine.size());
-          Token itmd = tokenLine.at(++i);
-          check_token_ok({Token::INT, Token::HEXINT}, itmd);
-
-          check_next_token_exists(i, tokenLine.size());
-          Token left_bracket = tokenLine.at(++i);
-          check_token_ok(Token::LPAREN, left_bracket);
-
-          check_next_token_exists(i, tokenLine.size());
-          Token s = tokenLine.at(++i);
-          if (s.getKind() != Token::REG)
-          {
-            std::cerr << "ERROR: Expected Register " << s << std::endl;
-            return 1;
-          }
-
-          check_next_token_exists(i, tokenLine.size());
-          Token right_bracket = tokenLine.at(++i);
-          check_token_ok(Token::RPAREN, right_bracket);
-
-          // Check register ranges
-          int64_t int_s = s.toNumber();
-          int64_t int_t = t.toNumber();
-
-          check_reg_range(int_s);
-          check_reg_range(int_t);
-
-          // Check immediate
-          int int_itmd = itmd.toNumber();
-          // Check if it's a hex itmd or int itmd
-          if (itmd.getKind() == Token::INT)
-          {
-            check_itmd_range_int(int_itmd);
-          }
-          else if (itmd.getKind() == Token::HEXINT)
-          {
-            check_itmd_range_hex(int_itmd);
-          }
-
-          unsigned int result = ((0b100011 << 26) | (int_s << 21) | (int_t << 16) | (int_itmd & 0xffff));
-          output_uint_to_bin(result);
-        }
-        // sw
-        else if (tokenLine.at(i).getLexeme() == "sw")
-        {
-          // Get the next token and convert to binary
-          check_next_token_exists(i, tokenLine.size());
-          Token t = tokenLine.at(++i);
-          if (t.getKind() != Token::REG)
-          {
-            std::cerr << "ERROR: Expected Register " << t << std::endl;
-            return 1;
-          }
-          check_next_token_exists(i, tokenLine.size());
-          Token comma = tokenLine.at(++i);
-          // Check if token is a comma
-          if (comma.getKind() != Token::COMMA)
-          {
-            std::cerr << "ERROR: Missing comma in add! " << std::endl;
-            return 1;
-          }
-          check_next_token_exists(i, tokenLine.size());
-          Token itmd = tokenLine.at(++i);
-          check_token_ok({Token::INT, Token::HEXINT}, itmd);
-
-          check_next_token_exists(i, tokenLine.size());
-          Token left_bracket = tokenLine.at(++i);
-          check_token_ok(Token::LPAREN, left_bracket);
-
-          check_next_token_exists(i, tokenLine.size());
-          Token s = tokenLine.at(++i);
-          if (s.getKind() != Token::REG)
-          {
-            std::cerr << "ERROR: Expected Register " << s << std::endl;
-            return 1;
-          }
-
-          check_next_token_exists(i, tokenLine.size());
-          Token right_bracket = tokenLine.at(++i);
-          check_token_ok(Token::RPAREN, right_bracket);
-
-          // Check register ranges
-          int64_t int_s = s.toNumber();
-          int64_t int_t = t.toNumber();
-
-          check_reg_range(int_s);
-          check_reg_range(int_t);
-
-          // Check immediate
-          int int_itmd = itmd.toNumber();
-          // Check if it's a hex itmd or int itmd
-          if (itmd.getKind() == Token::INT)
-          {
-            check_itmd_range_int(int_itmd);
-          }
-          else if (itmd.getKind() == Token::HEXINT)
-          {
-            check_itmd_range_hex(int_itmd);
-          }
-
-          unsigned int result = ((0b101011 << 26) | (int_s << 21) | (int_t << 16) | (int_itmd & 0xffff));
-          output_uint_to_bin(result);
-        }
-        // slt
-        else if (tokenLine.at(i).getLexeme() == "slt")
-        {
-          // Get the next token and convert to binary
-          check_next_token_exists(i, tokenLine.size());
-          Token d = tokenLine.at(++i);
-          if (d.getKind() != Token::REG)
-          {
-            std::cerr << "ERROR: Expected Register " << d << std::endl;
-            return 1;
-          }
-          check_next_token_exists(i, tokenLine.size());
-          Token comma = tokenLine.at(++i);
-          // Check if token is a comma
-          if (comma.getKind() != Token::COMMA)
-          {
-            std::cerr << "ERROR: Missing comma in add! " << std::endl;
-            return 1;
-          }
-          check_next_token_exists(i, tokenLine.size());
-          Token s = tokenLine.at(++i);
-          if (s.getKind() != Token::REG)
-          {
-            std::cerr << "ERROR: Expected Register " << s << std::endl;
-            return 1;
-          }
-          check_next_token_exists(i, tokenLine.size());
-          comma = tokenLine.at(++i);
-          // Check if token is a comma
-          if (comma.getKind() != Token::COMMA)
-          {
-            std::cerr << "ERROR: Missing comma in add! " << std::endl;
-            return 1;
-          }
-          check_next_token_exists(i, tokenLine.size());
-          Token t = tokenLine.at(++i);
-          if (t.getKind() != Token::REG)
-          {
-            std::cerr << "ERROR: Expected Register " << t << std::endl;
-            return 1;
-          }
-
-          // Check register ranges
-          int64_t int_d = d.toNumber();
-          int64_t int_s = s.toNumber();
-          int64_t int_t = t.toNumber();
-
-          check_reg_range(int_s);
-          check_reg_range(int_t);
-          check_reg_range(int_d);
-
-          unsigned int result = ((int_s << 21) | (int_t << 16) | (int_d << 11) | 0b00000101010);
-
-          output_uint_to_bin(result);
-        }
-        // sltu
-        else if (tokenLine.at(i).getLexeme() == "sltu")
-        {
-          // Get the next token and convert to binary
-          check_next_token_exists(i, tokenLine.size());
-          Token d = tokenLine.at(++i);
-          if (d.getKind() != Token::REG)
-          {
-            std::cerr << "ERROR: Expected Register " << d << std::endl;
-            return 1;
-          }
-          check_next_token_exists(i, tokenLine.size());
-          Token comma = tokenLine.at(++i);
-          // Check if token is a comma
-          if (comma.getKind() != Token::COMMA)
-          {
-            std::cerr << "ERROR: Missing comma in add! " << std::endl;
-            return 1;
-          }
-          check_next_token_exists(i, tokenLine.size());
-          Token s = tokenLine.at(++i);
-          if (s.getKind() != Token::REG)
-          {
-            std::cerr << "ERROR: Expected Register " << s << std::endl;
-            return 1;
-          }
-          check_next_token_exists(i, tokenLine.size());
-          comma = tokenLine.at(++i);
-          // Check if token is a comma
-          if (comma.getKind() != Token::COMMA)
-          {
-            std::cerr << "ERROR: Missing comma in add! " << std::endl;
-            return 1;
-          }
-          check_next_token_exists(i, tokenLine.size());
-          Token t = tokenLine.at(++i);
-          if (t.getKind() != Token::REG)
-          {
-            std::cerr << "ERROR: Expected Register " << t << std::endl;
-            return 1;
-          }
-
-          // Check register ranges
-          int64_t int_d = d.toNumber();
-          int64_t int_s = s.toNumber();
-          int64_t int_t = t.toNumber();
-
-          check_reg_range(int_s);
-          check_reg_range(int_t);
-          check_reg_range(int_d);
-
-          unsigned int result = ((int_s << 21) | (int_t << 16) | (int_d << 11) | 0b00000101011);
-
-          output_uint_to_bin(result);
-        }
-        // beq
-        else if (tokenLine.at(i).getLexeme() == "beq")
-        {
-          // beq $1, $2, 5 will look like:
-          // Token(ID, beq) Token(REG, $1) Token(COMMA, ,) Token(REG, $2) Token(COMMA, ,) Token(INT, 5)
-          // Get the next token and convert to binary
-          check_next_token_exists(i, tokenLine.size());
-          Token s = tokenLine.at(++i);
-          check_token_ok(Token::REG, s);
-
-          check_next_token_exists(i, tokenLine.size());
-          Token comma = tokenLine.at(++i);
-          check_token_ok(Token::COMMA, comma);
-
-          check_next_token_exists(i, tokenLine.size());
-          Token t = tokenLine.at(++i);
-          check_token_ok(Token::REG, t);
-
-          check_next_token_exists(i, tokenLine.size());
-          comma = tokenLine.at(++i);
-          check_token_ok(Token::COMMA, comma);
-
-          check_next_token_exists(i, tokenLine.size());
-          Token itmd = tokenLine.at(++i);
-          check_token_ok({Token::INT, Token::HEXINT, Token::ID}, itmd);
-
-          // Check register ranges
-          int64_t int_s = s.toNumber();
-          int64_t int_t = t.toNumber();
-
-          check_reg_range(int_s);
-          check_reg_range(int_t);
-
-          int64_t int_itmd;
-          if (itmd.getKind() == Token::ID)
-          { // If immediate is a label
-            // Check if label is not in symbol table
-            auto it = symbolTable.find(itmd.getLexeme());
-            if (it == symbolTable.end())
-            {
-              // Undeclared label
-              throw std::runtime_error("ERROR: Label used without declaration: " + itmd.getLexeme());
-            }
-
-            // Check if label offset is in decimal range
-            check_itmd_range_int(itmd.toNumber());
-
-            // std::cout << "non_null_lines: " << non_null_lines << " Label lines bfore: " << symbolTable[itmd.getLexeme()] / 4 << std::endl;
-            // Load the label offset
-            int_itmd = symbolTable[itmd.getLexeme()] / 4 - non_null_lines;
-          }
-          else
-          { // If immediate is an int or hexint
-            int_itmd = itmd.toNumber();
-            // Check if it's a hex itmd or int itmd
-            if (itmd.getKind() == Token::INT)
-            {
-              check_itmd_range_int(int_itmd);
-            }
-            else if (itmd.getKind() == Token::HEXINT)
-            {
-              check_itmd_range_hex(int_itmd);
-            }
-            // std::cout << int_d << " " << int_s << " " << int_t << std::endl;
-          }
-          // 0000 00ss ssst tttt dddd d000 0010 0000
-          unsigned int result = ((0b000100 << 26) | (int_s << 21) | (int_t << 16) | (int_itmd & 0xffff));
-
-          output_uint_to_bin(result);
-        }
-        // bne
-        else if (tokenLine.at(i).getLexeme() == "bne")
-        {
-          // Get the next token and convert to binary
-          check_next_token_exists(i, tokenLine.size());
-          Token s = tokenLine.at(++i);
-          check_token_ok(Token::REG, s);
-
-          check_next_token_exists(i, tokenLine.size());
-          Token comma = tokenLine.at(++i);
-          check_token_ok(Token::COMMA, comma);
-
-          check_next_token_exists(i, tokenLine.size());
-          Token t = tokenLine.at(++i);
-          check_token_ok(Token::REG, t);
-
-          check_next_token_exists(i, tokenLine.size());
-          comma = tokenLine.at(++i);
-          check_token_ok(Token::COMMA, comma);
-
-          check_next_token_exists(i, tokenLine.size());
-          Token itmd = tokenLine.at(++i);
-          check_token_ok({Token::INT, Token::HEXINT, Token::ID}, itmd);
-
-          // Check register ranges
-          int64_t int_s = s.toNumber();
-          int64_t int_t = t.toNumber();
-
-          check_reg_range(int_s);
-          check_reg_range(int_t);
-
-          int64_t int_itmd;
-          if (itmd.getKind() == Token::ID)
-          { // If immediate is a label
-            // Check if label is not in symbol table
-            auto it = symbolTable.find(itmd.getLexeme());
-            if (it == symbolTable.end())
-            {
-              // Undeclared label
-              throw std::runtime_error("ERROR: Label used without declaration: " + itmd.getLexeme());
-            }
-
-            // Check if label offset is in decimal range
-            check_itmd_range_int(itmd.toNumber());
-
-            // std::cout << "non_null_lines: " << non_null_lines << " Label lines bfore: " << symbolTable[itmd.getLexeme()] / 4 << std::endl;
-            // Load the label offset
-            int_itmd = symbolTable[itmd.getLexeme()] / 4 - non_null_lines;
-          }
-          else
-          { // If immediate is an int or hexint
-            int_itmd = itmd.toNumber();
-            // Check if it's a hex itmd or int itmd
-            if (itmd.getKind() == Token::INT)
-            {
-              check_itmd_range_int(int_itmd);
-            }
-            else if (itmd.getKind() == Token::HEXINT)
-            {
-              check_itmd_range_hex(int_itmd);
-            }
-            // std::cout << int_d << " " << int_s << " " << int_t << std::endl;
-          }
-          // 0000 00ss ssst tttt dddd d000 0010 0000
-          unsigned int result = ((0b000101 << 26) | (int_s << 21) | (int_t << 16) | (int_itmd & 0xffff));
-
-          output_uint_to_bin(result);
-        }
-        // jr
-        else if (tokenLine.at(i).getLexeme() == "jr")
+    // .import label / .export label
+    if (tokenLine.at(i).getLexeme() == ".import" || tokenLine.at(i).getLexeme() == ".export")
+    {
+      if (!module)
+      {
+        throw std::runtime_error("ERROR: " + std::string(tokenLine.at(i).getLexeme()) + " is only allowed with --merl");
+      }
+      check_next_token_exists(i, tokenLine.size());
+      const TokenView &token = tokenLine.at(i + 1);
+      check_token_ok(Token::ID, token);
+      (tokenLine.at(i).getLexeme() == ".import" ? module->imports : module->exports).push_back(token.getLexeme());
+      i++;
+    }
+    // .word
+    else if (tokenLine.at(i).getLexeme() == ".word")
+    {
+      // Get the next token and convert to binary
+      check_next_token_exists(i, tokenLine.size());
+      const TokenView &token = tokenLine.at(++i);
+      check_token_ok({Token::INT, Token::HEXINT, Token::ID}, token);
+
+      if (token.getKind() == Token::ID)
+      {
+        // The label's address (patched later if it isn't defined yet)
+        if (module)
         {
-          // Get the next token and convert to binary
-          check_next_token_exists(i, tokenLine.size());
-          Token s = tokenLine.at(++i);
-          if (s.getKind() != Token::REG)
-          {
-            std::cerr << "ERROR: Expected Register " << s << std::endl;
-            return 1;
-          }
-          // Check register ranges
-          int64_t int_s = s.toNumber();
-
-          check_reg_range(int_s);
-
-          unsigned int result = ((int_s << 21) | 0b1000);
-
-          output_uint_to_bin(result);
+          module->labelWords.push_back({base + words.size(), token.getLexeme()});
         }
-        // jalr
-        else if (tokenLine.at(i).getLexeme() == "jalr")
+        words.push_back(resolve_label(token.getLexeme(), false, base + words.size(), symbolTable, pendingFixups));
+      }
+      else
+      { // token is an int or hex int
+        // Negative values are stored in two's complement
+        int64_t int_rep = token.toNumber();
+        if (int_rep < -2147483648LL || int_rep > 4294967295LL)
         {
-          // Get the next token and convert to binary
-          check_next_token_exists(i, tokenLine.size());
-          Token s = tokenLine.at(++i);
-          if (s.getKind() != Token::REG)
-          {
-            std::cerr << "ERROR: Expected Register " << s << std::endl;
-            return 1;
-          }
-          // Check register ranges
-          int64_t int_s = s.toNumber();
-
-          check_reg_range(int_s);
-
-          unsigned int result = ((int_s << 21) | 0b1001);
-
-          output_uint_to_bin(result);
-        }
-        else if (it != symbolTable.end())
-        { // If it is in the symbolTable
-          continue;
-        }
-        else
-        { // Unrecognized token
-          throw std::runtime_error("ERROR: Unrecognized Token " + tokenLine.at(i).getLexeme());
+          throw std::out_of_range("ERROR: Value out of range: " + std::string(token.getLexeme()));
         }
+        words.push_back(int_rep);
+      }
+    }
+    // Everything else is an instruction
+    else if (const Opcode *op = find_opcode(tokenLine.at(i).getLexeme()))
+    {
+      words.push_back(encode_instruction(*op, tokenLine, i, base + words.size(), symbolTable, pendingFixups));
+    }
+    else
+    { // Unrecognized token
+      throw std::runtime_error("ERROR: Unrecognized Token " + std::string(tokenLine.at(i).getLexeme()));
+    }
+  }
+}
+
+// Throws for the first use of a label that was never defined
+void check_no_pending_fixups(const std::unordered_map<std::string_view, std::vector<Fixup>> &pendingFixups)
+{
+  if (pendingFixups.empty())
+  {
+    return;
+  }
+  auto first = pendingFixups.begin();
+  for (auto it = pendingFixups.begin(); it != pendingFixups.end(); ++it)
+  {
+    if (it->second.front().index < first->second.front().index)
+    {
+      first = it;
+    }
+  }
+  throw std::runtime_error("ERROR: Label used without declaration: " + std::string(first->first));
+}
+
+// Appends a MERL entry's name: its length, then one word per character
+void push_merl_name(std::vector<uint32_t> &words, std::string_view name)
+{
+  words.push_back(name.size());
+  for (char c : name)
+  {
+    words.push_back((unsigned char)c);
+  }
+}
+
+// Turns words, which start with three placeholder header words, into a MERL module.
+// Imported labels are left for the linker, so only their .word uses may still be pending
+void finish_merl(std::vector<uint32_t> &words, const Module &module,
+                 const std::unordered_map<std::string_view, int> &symbolTable,
+                 std::unordered_map<std::string_view, std::vector<Fixup>> &pendingFixups)
+{
+  for (std::string_view name : module.imports)
+  {
+    if (symbolTable.find(name) != symbolTable.end())
+    {
+      throw std::runtime_error("ERROR: Imported label is also defined: " + std::string(name));
+    }
+    auto pending = pendingFixups.find(name);
+    if (pending == pendingFixups.end())
+    {
+      continue;
+    }
+    for (const Fixup &fixup : pending->second)
+    {
+      if (fixup.isBranch)
+      {
+        // A branch offset can't be relocated
+        throw std::runtime_error("ERROR: Branch to imported label: " + std::string(name));
+      }
+    }
+    pendingFixups.erase(pending);
+  }
+  check_no_pending_fixups(pendingFixups);
+
+  size_t endCode = words.size() * 4;
+  for (const auto &[index, name] : module.labelWords)
+  {
+    if (symbolTable.find(name) != symbolTable.end())
+    {
+      words.push_back(MERL_REL);
+      words.push_back(index * 4);
+    }
+    else
+    {
+      words.push_back(MERL_ESR);
+      words.push_back(index * 4);
+      push_merl_name(words, name);
+    }
+  }
+  for (std::string_view name : module.exports)
+  {
+    auto it = symbolTable.find(name);
+    if (it == symbolTable.end())
+    {
+      throw std::runtime_error("ERROR: Exported label used without declaration: " + std::string(name));
+    }
+    words.push_back(MERL_ESD);
+    words.push_back(it->second);
+    push_merl_name(words, name);
+  }
+
+  words[0] = MERL_COOKIE;
+  words[1] = words.size() * 4; // End of module
+  words[2] = endCode;
+}
+
+// Called for each line after assemble() hits an error: drops the pending fixups of labels the line defines
+// (or imports, with merl), so only labels that are never defined are left. Lines that don't scan are skipped
+void forget_defined_labels(std::string_view line, std::vector<TokenView> &tokenLine,
+                           std::unordered_map<std::string_view, std::vector<Fixup>> &pendingFixups, bool merl)
+{
+  try
+  {
+    scanLine(line, tokenLine);
+  }
+  catch (...)
+  {
+    return;
+  }
+  for (size_t i = 0; i < tokenLine.size(); i++)
+  {
+    std::string_view lexeme = tokenLine[i].getLexeme();
+    if (tokenLine[i].getKind() == Token::LABEL)
+    {
+      pendingFixups.erase(lexeme.substr(0, lexeme.size() - 1));
+    }
+    else if (merl && lexeme == ".import" && i + 1 < tokenLine.size())
+    {
+      pendingFixups.erase(tokenLine[i + 1].getLexeme());
+    }
+  }
+}
+
+// Assembles input in a single pass. Forward references to labels are patched when the label is defined.
+// With merl, the result is a MERL module whose code starts after its three-word header.
+// symbolTable gets every label's address
+std::vector<uint32_t> assemble(std::string_view input, std::unordered_map<std::string_view, int> &symbolTable,
+                               bool merl = false)
+{
+  // Label -> words that used it before it was defined
+  std::unordered_map<std::string_view, std::vector<Fixup>> pendingFixups;
+  std::vector<uint32_t> words;
+  Module module;
+  if (merl)
+  {
+    words.assign(3, 0); // Header, filled in by finish_merl
+  }
+
+  // Reused for every line so scanning doesn't allocate once it has grown
+  static thread_local std::vector<TokenView> tokenLine;
+
+  // The first error, and the number of words before its line
+  std::exception_ptr error;
+  size_t errorWord = 0;
+
+  for_each_line(input, [&](std::string_view line, size_t)
+                {
+                  if (error)
+                  {
+                    forget_defined_labels(line, tokenLine, pendingFixups, merl);
+                    return;
+                  }
+                  size_t lineStart = words.size();
+                  try
+                  {
+                    scanLine(line, tokenLine);
+                    assemble_line(tokenLine, words, 0, true, symbolTable, pendingFixups, merl ? &module : nullptr);
+                  }
+                  catch (...)
+                  {
+                    error = std::current_exception();
+                    errorWord = lineStart;
+                  }
+                });
+
+  if (error)
+  {
+    // A label used before the error line and never defined is the earlier error
+    for (auto it = pendingFixups.begin(); it != pendingFixups.end();)
+    {
+      bool imported = std::find(module.imports.begin(), module.imports.end(), it->first) != module.imports.end();
+      it = imported || it->second.front().index >= errorWord ? pendingFixups.erase(it) : std::next(it);
+    }
+    check_no_pending_fixups(pendingFixups);
+    std::rethrow_exception(error);
+  }
+
+  if (merl)
+  {
+    finish_merl(words, module, symbolTable, pendingFixups);
+  }
+  else
+  {
+    check_no_pending_fixups(pendingFixups);
+  }
+  return words;
+}
+
+// Number of tokens after the mnemonic that each format takes
+constexpr size_t operand_tokens(Format format)
+{
+  switch (format)
+  {
+  case Format::R3:
+    return 5; // $d , $s , $t
+  case Format::R2:
+    return 3; // $s , $t
+  case Format::D1:
+  case Format::S1:
+    return 1; // $d
+  case Format::MEM:
+    return 6; // $t , i ( $s )
+  case Format::BRANCH:
+    return 5; // $s , $t , i
+  }
+  return 0;
+}
+
+// A range of whole lines assembled by one task in assemble_parallel
+struct Chunk
+{
+  struct Label
+  {
+    std::string_view name;
+    size_t word; // Position within the chunk
+    size_t line; // Line within the chunk
+  };
+
+  std::string_view text;
+  std::vector<Label> labels;
+  size_t numWords = 0;
+  size_t firstWord = 0; // Position of the chunk's first word in the program
+
+  // The chunk's first error, by line
+  size_t errorLine = SIZE_MAX;
+  std::exception_ptr error;
+
+  void record_error(size_t line, std::exception_ptr e)
+  {
+    if (line < errorLine)
+    {
+      errorLine = line;
+      error = e;
+    }
+  }
+};
+
+// Step 1 of assemble_parallel: scans the chunk to count its words and find its labels, without encoding anything.
+// For any line that assembles without errors the count matches what assemble_line produces
+void count_chunk(Chunk &chunk)
+{
+  static thread_local std::vector<TokenView> tokenLine;
+
+  for_each_line(chunk.text, [&](std::string_view line, size_t lineNumber)
+                {
+                  try
+                  {
+                    scanLine(line, tokenLine);
+                  }
+                  catch (...)
+                  {
+                    // Keep going so labels later in the chunk are still defined
+                    chunk.record_error(lineNumber, std::current_exception());
+                    return;
+                  }
+
+                  for (size_t i = 0; i < tokenLine.size(); i++)
+                  {
+                    if (tokenLine[i].getKind() == Token::LABEL)
+                    {
+                      std::string_view label = tokenLine[i].getLexeme();
+                      chunk.labels.push_back({label.substr(0, label.size() - 1), chunk.numWords, lineNumber});
+                    }
+                    else if (tokenLine[i].getKind() == Token::WORD)
+                    {
+                      if (tokenLine[i].getLexeme() == ".word")
+                      {
+                        chunk.numWords++;
+                      }
+                      i++;
+                    }
+                    else if (const Opcode *op = find_opcode(tokenLine[i].getLexeme()))
+                    {
+                      chunk.numWords++;
+                      i += operand_tokens(op->format);
+                    }
+                    // Anything else is an error that encode_chunk reports
+                  }
+                });
+}
+
+// Step 3 of assemble_parallel: encodes the chunk into words[chunk.firstWord ..] once every label is known.
+// Stops at the chunk's first error
+void encode_chunk(Chunk &chunk, std::unordered_map<std::string_view, int> &symbolTable, std::vector<uint32_t> &words)
+{
+  static thread_local std::vector<TokenView> tokenLine;
+  std::vector<uint32_t> chunkWords;
+  chunkWords.reserve(chunk.numWords);
+  // Every label is defined by now, so anything that ends up here never was
+  std::unordered_map<std::string_view, std::vector<Fixup>> undefinedLabels;
+
+  for_each_line(chunk.text, [&](std::string_view line, size_t lineNumber)
+                {
+                  if (lineNumber >= chunk.errorLine)
+                  {
+                    return;
+                  }
+                  try
+                  {
+                    scanLine(line, tokenLine);
+                    assemble_line(tokenLine, chunkWords, chunk.firstWord, false, symbolTable, undefinedLabels);
+                    check_no_pending_fixups(undefinedLabels);
+                  }
+                  catch (...)
+                  {
+                    chunk.record_error(lineNumber, std::current_exception());
+                  }
+                });
+
+  if (!chunk.error)
+  {
+    std::copy(chunkWords.begin(), chunkWords.end(), words.begin() + chunk.firstWord);
+  }
+}
+
+// Assembles input on numThreads threads and returns the same words as assemble().
+// 1. Each chunk of lines is scanned to count its words and find its labels, without encoding anything.
+// 2. Chunk start positions and label addresses are fixed in order, on one thread.
+// 3. Each chunk is scanned again and encoded into its own part of the output.
+// Every chunk keeps its first error, and the error from the earliest chunk is thrown,
+// so the error reported is always the first one by line.
+std::vector<uint32_t> assemble_parallel(std::string_view input, size_t numThreads,
+                                        std::unordered_map<std::string_view, int> &symbolTable)
+{
+  // Split on line boundaries into a few chunks per thread, so uneven chunks still balance
+  size_t numChunks = std::max<size_t>(1, std::min(numThreads * 4, input.size() / 4096));
+  std::vector<Chunk> chunks(numChunks);
+  size_t chunkStart = 0;
+  for (size_t c = 0; c < numChunks; c++)
+  {
+    size_t chunkEnd = c + 1 == numChunks ? input.size() : std::max(chunkStart, input.size() * (c + 1) / numChunks);
+    chunkEnd = std::min(input.find('\n', chunkEnd), input.size());
+    if (chunkEnd < input.size())
+    {
+      chunkEnd++; // Keep the newline with its line
+    }
+    chunks[c].text = input.substr(chunkStart, chunkEnd - chunkStart);
+    chunkStart = chunkEnd;
+  }
+
+  // 1. Count words and collect labels
+  parallelFor(numChunks, numThreads, [&](size_t c)
+               { count_chunk(chunks[c]); });
+
+  // 2. Lay out the chunks and define the labels in source order
+  size_t numWords = 0;
+  for (Chunk &chunk : chunks)
+  {
+    chunk.firstWord = numWords;
+    numWords += chunk.numWords;
+    for (const Chunk::Label &label : chunk.labels)
+    {
+      if (!symbolTable.emplace(label.name, (chunk.firstWord + label.word) * 4).second)
+      {
+        chunk.record_error(label.line, std::make_exception_ptr(std::runtime_error("ERROR: Duplicate label found: " + std::string(label.name))));
+      }
+    }
+  }
+
+  // 3. Encode each chunk into its part of the output
+  std::vector<uint32_t> words(numWords);
+  parallelFor(numChunks, numThreads, [&](size_t c)
+               { encode_chunk(chunks[c], symbolTable, words); });
+
+  for (const Chunk &chunk : chunks)
+  {
+    if (chunk.error)
+    {
+      std::rethrow_exception(chunk.error);
+    }
+  }
+  return words;
+}
+
+// Writes "address label" lines, in order of address, for tools that map addresses back to labels.
+// The addresses are the labels' values in the output, so with --merl they count the header
+void write_symbols(const std::unordered_map<std::string_view, int> &symbolTable, const char *path)
+{
+  std::vector<std::pair<int, std::string_view>> symbols;
+  for (const auto &[label, address] : symbolTable)
+  {
+    symbols.push_back({address, label});
+  }
+  std::sort(symbols.begin(), symbols.end());
+
+  FILE *out = fopen(path, "w");
+  if (!out)
+  {
+    throw std::runtime_error(std::string("ERROR: Cannot open symbol file ") + path);
+  }
+  for (const auto &[address, label] : symbols)
+  {
+    fprintf(out, "0x%08x %.*s\n", (unsigned)address, (int)label.size(), label.data());
+  }
+  if (fclose(out) != 0)
+  {
+    throw std::runtime_error(std::string("ERROR: Cannot write symbol file ") + path);
+  }
+}
+
+/*
+ * C++ Starter code for CS241 A3
+ *
+ * This file contains the main function of your program. By default, it just
+ * prints the scanned list of tokens back to standard output.
+ */
+int main(int argc, char *argv[])
+{
+  const char *outputPath = nullptr; // nullptr => stdout
+  int numJobs = 1;                  // 0 => one thread per hardware thread
+  bool merl = false;                // Output a MERL module instead of plain machine code
+  const char *symbolsPath = nullptr; // nullptr => no symbol map
+
+  for (int i = 1; i < argc; i++)
+  {
+    std::string option = argv[i];
+    if (option == "-o" && i + 1 < argc)
+    {
+      outputPath = argv[++i];
+    }
+    else if (option == "-j" && i + 1 < argc)
+    {
+      try
+      {
+        numJobs = std::stoi(argv[++i]);
+      }
+      catch (const std::logic_error &)
+      {
+        std::cerr << "ERROR: Bad option value" << std::endl;
+        return 1;
       }
+    }
+    else if (option == "--merl")
+    {
+      merl = true;
+    }
+    else if (option == "--symbols" && i + 1 < argc)
+    {
+      symbolsPath = argv[++i];
+    }
+    else
+    {
+      std::cerr << "ERROR: Unknown option " << option << std::endl;
+      return 1;
+    }
+  }
 
-      // Remove this when you're done playing with the example program!
-      // Printing a random newline character as part of your machine code
-      // output will cause you to fail the Marmoset tests.
-      // std::cout << std::endl;
+  try
+  {
+    // Read all of stdin up front so tokens can refer into it without copying.
+    // Labels point into input, which lives until the end of main
+    std::ostringstream buffer;
+    buffer << std::cin.rdbuf();
+    const std::string input = buffer.str();
+
+    // The assembled program, written out once everything is resolved
+    std::vector<uint32_t> words;
+    std::unordered_map<std::string_view, int> symbolTable;
+    if (numJobs == 1 || merl)
+    {
+      // MERL modules are assembled on one thread; they're small, and linked separately
+      words = assemble(input, symbolTable, merl);
+    }
+    else
+    {
+      words = assemble_parallel(input, numJobs > 0 ? numJobs : std::max(1u, std::thread::hardware_concurrency()),
+                                symbolTable);
+    }
+    if (symbolsPath)
+    {
+      write_symbols(symbolTable, symbolsPath);
+    }
+
+    if (outputPath)
+    {
+      write_words_to_file(words, outputPath);
+    }
+    else
+    {
+      write_words_to_stdout(words);
     }
   }
   catch (ScanningFailure &f)
@@ -1013,6 +1062,11 @@ int main()
     std::cerr << f.what() << std::endl;
     return 1;
   }
+  catch (OperandError &e)
+  {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
   catch (std::runtime_error &e)
   {
     std::cerr << "Runtime error: " << e.what() << std::endl;
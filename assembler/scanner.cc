@@ -5,6 +5,7 @@
 #include <utility>
 #include <set>
 #include <array>
+#include <cstdint>
 #include "scanner.h"
 
 /*
@@ -64,6 +65,49 @@ int64_t Token::toNumber() const {
   return result;
 }
 
+TokenView::TokenView(Token::Kind kind, std::string_view lexeme):
+  kind(kind), lexeme(lexeme) {}
+
+Token::Kind TokenView::getKind() const { return kind; }
+std::string_view TokenView::getLexeme() const { return lexeme; }
+
+int64_t TokenView::toNumber() const {
+  std::string_view digits = lexeme;
+  int64_t base = 10;
+  bool negative = false;
+
+  if (kind == Token::INT) {
+    if (digits[0] == '-') {
+      negative = true;
+      digits.remove_prefix(1);
+    }
+  } else if (kind == Token::HEXINT) {
+    digits.remove_prefix(2);
+    base = 16;
+  } else if (kind == Token::REG) {
+    digits.remove_prefix(1);
+  } else {
+    // This should never happen if the user calls this function correctly
+    return 0;
+  }
+
+  // Accumulate as a negative number so that INT64_MIN fits, and saturate
+  // on overflow the way operator>> does
+  int64_t result = 0;
+  for (char c : digits) {
+    int64_t digit = std::isdigit(c) ? c - '0' : std::tolower(c) - 'a' + 10;
+    if (result < (INT64_MIN + digit) / base) {
+      return negative ? INT64_MIN : INT64_MAX;
+    }
+    result = result * base - digit;
+  }
+
+  if (negative) {
+    return result;
+  }
+  return result == INT64_MIN ? INT64_MAX : -result;
+}
+
 ScanningFailure::ScanningFailure(std::string message):
   message(std::move(message)) {}
 
@@ -183,6 +227,50 @@ class AsmDFA {
       return result;
     }
 
+    /* Same algorithm as simplifiedMaximalMunch, but the tokens refer into
+     * input and WHITESPACE and COMMENT tokens are dropped as they're found.
+     */
+    void simplifiedMaximalMunch(std::string_view input,
+                                std::vector<TokenView> &result) const {
+      result.clear();
+
+      State state = start();
+      size_t tokenStart = 0;
+
+      for (size_t inputPosn = 0; inputPosn < input.size();) {
+        State oldState = state;
+        state = transition(state, input[inputPosn]);
+
+        if (!failed(state)) {
+          oldState = state;
+          ++inputPosn;
+        }
+
+        if (inputPosn == input.size() || failed(state)) {
+          if (accept(oldState)) {
+            std::string_view lexeme = input.substr(tokenStart, inputPosn - tokenStart);
+            Token::Kind kind = stateToKind(oldState);
+
+            if (kind == Token::WORD && lexeme != ".word" &&
+                lexeme != ".import" && lexeme != ".export") {
+              throw ScanningFailure("ERROR: DOTID token unrecognized: " +
+                  std::string(lexeme));
+            }
+            if (kind != Token::WHITESPACE && kind != Token::COMMENT) {
+              result.emplace_back(kind, lexeme);
+            }
+
+            tokenStart = inputPosn;
+            state = start();
+          } else {
+            size_t end = failed(state) ? inputPosn + 1 : inputPosn;
+            throw ScanningFailure("ERROR: Simplified maximal munch failed on input: "
+                                 + std::string(input.substr(tokenStart, end - tokenStart)));
+          }
+        }
+      }
+    }
+
     /* Initializes the accepting states for the DFA.
      */
     AsmDFA() {
@@ -251,6 +339,9 @@ class AsmDFA {
      * or a special fail state if the transition does not exist.
      */
     State transition(State state, char nextChar) const {
+      if (static_cast<unsigned char>(nextChar) >= 128) {
+        return FAIL;
+      }
       return transitionFunction[state][nextChar];
     }
 
@@ -277,14 +368,16 @@ std::vector<Token> scan(const std::string &input) {
   std::vector<Token> tokens = theDFA.simplifiedMaximalMunch(input);
 
   // We need to:
-  // * Throw exceptions for WORD tokens whose lexemes aren't ".word".
+  // * Throw exceptions for WORD tokens whose lexemes aren't ".word",
+  //   ".import" or ".export".
   // * Remove WHITESPACE and COMMENT tokens entirely.
 
   std::vector<Token> newTokens;
 
   for (auto &token : tokens) {
     if (token.getKind() == Token::WORD) {
-      if (token.getLexeme() == ".word") {
+      if (token.getLexeme() == ".word" || token.getLexeme() == ".import" ||
+          token.getLexeme() == ".export") {
         newTokens.push_back(token);
       } else {
         throw ScanningFailure("ERROR: DOTID token unrecognized: " +
@@ -298,3 +391,8 @@ std::vector<Token> scan(const std::string &input) {
 
   return newTokens;
 }
+
+void scanLine(std::string_view input, std::vector<TokenView> &tokens) {
+  static AsmDFA theDFA;
+  theDFA.simplifiedMaximalMunch(input, tokens);
+}
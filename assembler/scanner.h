@@ -1,6 +1,7 @@
 #ifndef CS241_SCANNER_H
 #define CS241_SCANNER_H
 #include <string>
+#include <string_view>
 #include <vector>
 #include <set>
 #include <cstdint>
@@ -21,7 +22,7 @@ class Token;
  * Scan returns tokens with the following kinds:
  * ID: identifiers and keywords.
  * LABEL: labels (identifiers ending in a colon).
- * WORD: the special ".word" keyword.
+ * WORD: the special ".word", ".import" and ".export" keywords.
  * COMMA: a comma.
  * LPAREN: a left parenthesis.
  * RPAREN: a right parenthesis.
@@ -101,6 +102,31 @@ class Token {
 
 };
 
+/* A token that refers to its lexeme in the scanned line instead of owning a
+ * copy. The line must outlive the token. Produced by scanLine, which the
+ * assembler uses so that assembling an instruction never allocates.
+ */
+class TokenView {
+    Token::Kind kind;
+    std::string_view lexeme;
+
+  public:
+    TokenView(Token::Kind kind, std::string_view lexeme);
+
+    Token::Kind getKind() const;
+    std::string_view getLexeme() const;
+
+    /* Same as Token::toNumber, including the saturation rules, but without
+     * going through a stream.
+     */
+    int64_t toNumber() const;
+};
+
+/* Scans a single line of input into tokens, reusing the tokens vector.
+ * Produces the same kinds as scan, with WHITESPACE and COMMENT removed.
+ */
+void scanLine(std::string_view input, std::vector<TokenView> &tokens);
+
 /* Prints a string representation of a token.
  * Mainly useful for debugging.
  */
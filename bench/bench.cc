@@ -0,0 +1,313 @@
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace std;
+namespace fs = std::filesystem;
+
+// Compiles each benchmark program at every optimization level with wlp4c, runs it in mips-sim and
+// prints one JSON record per (program, level): static size, dynamic instruction count, estimated cycles,
+// loads, stores, compile time and whether the program returned what it should.
+// Given a baseline from an earlier run, it also reports every cycle count that grew.
+// Usage: bench [--bin DIR] [--runtime DIR] [-o FILE] [--baseline FILE] [--tolerance PERCENT] PROGRAM.wlp4 ...
+//
+// A program says how to run it in comments at the top:
+//   // args: A B            wain's two ints
+//   // array: V1 V2 ...     wain's array (instead of args)
+//   // expect: N            the value wain must return
+
+const vector<string> LEVELS = {"-O0", "-O1", "-O2"};
+
+struct Benchmark {
+    string name;  // File name without .wlp4
+    string path;
+    vector<string> args;
+    bool array = false;
+    bool hasExpected = false;
+    int32_t expected = 0;
+};
+
+struct Result {
+    string program;
+    string level;
+    uint64_t bytes = 0;
+    uint64_t instructions = 0;
+    uint64_t cycles = 0;
+    uint64_t loads = 0;
+    uint64_t stores = 0;
+    double compileMs = 0;
+    int32_t result = 0;
+    bool ok = false;
+};
+
+string readFile(const string& path) {
+    ifstream file(path, ios::binary);
+    if (!file) {
+        throw runtime_error("ERROR: Cannot open " + path);
+    }
+    ostringstream contents;
+    contents << file.rdbuf();
+    return contents.str();
+}
+
+string shellQuote(const string& text) {
+    string quoted = "'";
+    for (char c : text) {
+        if (c == '\'') {
+            quoted += "'\\''";
+        } else {
+            quoted += c;
+        }
+    }
+    return quoted + "'";
+}
+
+// Runs a shell command with its stderr going to errorPath; returns whether it exited with 0
+bool run(const string& command, const string& errorPath) {
+    int status = system((command + " 2> " + shellQuote(errorPath)).c_str());
+    return status != -1 && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+// The tool's own error message, or a generic one if it printed nothing
+string failure(const string& name, const string& errorPath) {
+    string message = readFile(errorPath);
+    while (!message.empty() && message.back() == '\n') {
+        message.pop_back();
+    }
+    return message.empty() ? "ERROR: " + name + " failed" : message;
+}
+
+Benchmark readBenchmark(const string& path) {
+    Benchmark benchmark;
+    benchmark.path = path;
+    benchmark.name = fs::path(path).stem().string();
+
+    istringstream source(readFile(path));
+    for (string line; getline(source, line) && line.rfind("//", 0) == 0;) {
+        istringstream words(line.substr(2));
+        string key;
+        words >> key;
+        if (key == "args:" || key == "array:") {
+            benchmark.array = key == "array:";
+            benchmark.args.clear();
+            for (string word; words >> word;) {
+                benchmark.args.push_back(word);
+            }
+        } else if (key == "expect:") {
+            benchmark.hasExpected = bool(words >> benchmark.expected);
+        }
+    }
+    if (!benchmark.array && benchmark.args.size() != 2) {
+        throw runtime_error("ERROR: " + path + " needs an '// args: A B' or '// array: ...' line");
+    }
+    return benchmark;
+}
+
+// The count for each opcode that mips-sim --counts prints, plus "total" and "cycles"
+map<string, uint64_t> parseCounts(const string& report, int32_t& result) {
+    map<string, uint64_t> counts;
+    istringstream lines(report);
+    for (string line; getline(lines, line);) {
+        unsigned int value;
+        size_t at = line.find("$03 = ");
+        if (at != string::npos && sscanf(line.c_str() + at, "$03 = 0x%x", &value) == 1) {
+            result = (int32_t)value;
+        }
+        istringstream words(line);
+        string name;
+        uint64_t count;
+        if (!line.empty() && line[0] != '$' && words >> name >> count) {
+            counts[name] = count;
+        }
+    }
+    return counts;
+}
+
+Result measure(const Benchmark& benchmark, const string& level, const string& binDir, const string& runtimeDir,
+               const string& workDir) {
+    Result result;
+    result.program = benchmark.name;
+    result.level = level;
+
+    string program = workDir + "/" + benchmark.name + level + ".mips";
+    string errors = workDir + "/errors";
+    // A fresh object cache, so the time is that of a full compilation
+    string cacheDir = workDir + "/cache" + level + benchmark.name;
+
+    string compile = shellQuote(binDir + "/wlp4c") + " " + level + " --cache " + shellQuote(cacheDir) +
+                     " --runtime " + shellQuote(runtimeDir) + " -o " + shellQuote(program) + " < " +
+                     shellQuote(benchmark.path);
+    auto start = chrono::steady_clock::now();
+    if (!run(compile, errors)) {
+        throw runtime_error(benchmark.name + " " + level + ": " + failure("wlp4c", errors));
+    }
+    result.compileMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    result.bytes = fs::file_size(program);
+
+    string simulate = shellQuote(binDir + "/mips-sim") + " --counts" + (benchmark.array ? " --array " : " ") +
+                      shellQuote(program);
+    for (const string& arg : benchmark.args) {
+        simulate += " " + shellQuote(arg);
+    }
+    if (!run(simulate + " > /dev/null", errors)) {
+        throw runtime_error(benchmark.name + " " + level + ": " + failure("mips-sim", errors));
+    }
+    map<string, uint64_t> counts = parseCounts(readFile(errors), result.result);
+    result.instructions = counts["total"];
+    result.cycles = counts["cycles"];
+    result.loads = counts["lw"];
+    result.stores = counts["sw"];
+    result.ok = !benchmark.hasExpected || result.result == benchmark.expected;
+    return result;
+}
+
+string toJson(const Result& result) {
+    char compileMs[32];
+    snprintf(compileMs, sizeof(compileMs), "%.1f", result.compileMs);
+    return "{\"program\": \"" + result.program + "\", \"level\": \"" + result.level +
+           "\", \"bytes\": " + to_string(result.bytes) + ", \"instructions\": " + to_string(result.instructions) +
+           ", \"cycles\": " + to_string(result.cycles) + ", \"loads\": " + to_string(result.loads) + ", \"stores\": " + to_string(result.stores) +
+           ", \"compile_ms\": " + compileMs + ", \"result\": " + to_string(result.result) +
+           ", \"ok\": " + (result.ok ? "true" : "false") + "}";
+}
+
+// The value of "key": in one record written by toJson
+string jsonField(const string& record, const string& key) {
+    size_t at = record.find("\"" + key + "\": ");
+    if (at == string::npos) {
+        return "";
+    }
+    at += key.size() + 4;
+    size_t end = record.find_first_of(",}", at);
+    string value = record.substr(at, end - at);
+    if (value.size() >= 2 && value.front() == '"') {
+        value = value.substr(1, value.size() - 2);
+    }
+    return value;
+}
+
+// Cycle counts from an earlier run, by "program level". A run from before cycles were counted has only
+// instruction counts, which are compared with the new instruction counts instead
+map<string, uint64_t> readBaseline(const string& path, bool& hasCycles) {
+    map<string, uint64_t> baseline;
+    hasCycles = true;
+    istringstream lines(readFile(path));
+    for (string line; getline(lines, line);) {
+        string cycles = jsonField(line, "cycles");
+        string instructions = jsonField(line, "instructions");
+        if (!cycles.empty() || !instructions.empty()) {
+            hasCycles = hasCycles && !cycles.empty();
+            baseline[jsonField(line, "program") + " " + jsonField(line, "level")] =
+                stoull(cycles.empty() ? instructions : cycles);
+        }
+    }
+    return baseline;
+}
+
+int main(int argc, char* argv[]) {
+    string binDir = ".";
+    string runtimeDir = "runtime";
+    string outputPath;  // empty => stdout
+    string baselinePath;
+    double tolerance = 0;
+    vector<string> inputs;
+
+    string self = argv[0];
+    if (self.find('/') != string::npos) {
+        binDir = self.substr(0, self.rfind('/'));
+    }
+
+    for (int i = 1; i < argc; i++) {
+        string option = argv[i];
+        if (option == "--bin" && i + 1 < argc) {
+            binDir = argv[++i];
+        } else if (option == "--runtime" && i + 1 < argc) {
+            runtimeDir = argv[++i];
+        } else if (option == "-o" && i + 1 < argc) {
+            outputPath = argv[++i];
+        } else if (option == "--baseline" && i + 1 < argc) {
+            baselinePath = argv[++i];
+        } else if (option == "--tolerance" && i + 1 < argc) {
+            tolerance = stod(argv[++i]);
+        } else if (!option.empty() && option[0] != '-') {
+            inputs.push_back(option);
+        } else {
+            cerr << "ERROR: Unknown option " << option << endl;
+            return 1;
+        }
+    }
+
+    char workTemplate[] = "/tmp/wlp4bench.XXXXXX";
+    if (!mkdtemp(workTemplate)) {
+        cerr << "ERROR: Cannot create a work directory" << endl;
+        return 1;
+    }
+    string workDir = workTemplate;
+
+    bool passed = true;
+    try {
+        if (inputs.empty()) {
+            throw runtime_error("ERROR: No benchmark programs");
+        }
+        binDir = fs::absolute(binDir).string();
+        runtimeDir = fs::absolute(runtimeDir).string();
+        map<string, uint64_t> baseline;
+        bool baselineCycles = true;
+        if (!baselinePath.empty()) {
+            baseline = readBaseline(baselinePath, baselineCycles);
+        }
+
+        ostringstream json;
+        json << "[\n";
+        bool first = true;
+        for (const string& input : inputs) {
+            Benchmark benchmark = readBenchmark(input);
+            for (const string& level : LEVELS) {
+                Result result = measure(benchmark, level, binDir, runtimeDir, workDir);
+                json << (first ? "" : ",\n") << "  " << toJson(result);
+                first = false;
+
+                if (!result.ok) {
+                    cerr << benchmark.name << " " << level << ": returned " << result.result << ", expected "
+                         << benchmark.expected << endl;
+                    passed = false;
+                }
+                auto old = baseline.find(benchmark.name + " " + level);
+                uint64_t count = baselineCycles ? result.cycles : result.instructions;
+                if (old != baseline.end() && count > old->second * (1 + tolerance / 100)) {
+                    cerr << benchmark.name << " " << level << ": " << count
+                         << (baselineCycles ? " cycles, was " : " instructions, was ") << old->second << endl;
+                    passed = false;
+                }
+            }
+        }
+        json << "\n]\n";
+
+        if (outputPath.empty()) {
+            cout << json.str();
+        } else {
+            ofstream out(outputPath);
+            out << json.str();
+            if (!out) {
+                throw runtime_error("ERROR: Cannot write " + outputPath);
+            }
+        }
+    } catch (const exception& e) {
+        cerr << e.what() << endl;
+        passed = false;
+    }
+    fs::remove_all(workDir);
+    return passed ? 0 : 1;
+}
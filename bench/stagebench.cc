@@ -0,0 +1,235 @@
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace std;
+namespace fs = std::filesystem;
+
+// Times each compiler stage on its own over programs from wlp4rand of growing size, and prints one JSON
+// record per (size, stage): the time, how many tokens or tree nodes it got through per second, and the
+// stage's peak memory, so how each stage scales with its input can be read off the records.
+// Usage: stagebench [--bin DIR] [--sizes SIZE,SIZE,...] [--seed N] [-o FILE] [wlp4rand options]
+// Sizes are in bytes of source, with an optional K, M or G suffix (default: 1K,10K,100K,1M,10M,100M).
+
+struct Stage {
+    string tool;
+    vector<string> args;
+    string input;  // File names in the work directory
+    string output;
+    string unit;  // What the stage's throughput is counted in
+    string counted;  // The file with one line per unit
+};
+
+// Each stage reads the previous stage's output, as wlp4c runs them
+const vector<Stage> STAGES = {
+    {"wlp4scan", {}, "program.wlp4", "program.tokens", "tokens", "program.tokens"},
+    {"wlp4parse", {}, "program.tokens", "program.tree", "nodes", "program.tree"},
+    {"wlp4type", {}, "program.tree", "program.typed", "nodes", "program.tree"},
+    {"wlp4gen", {}, "program.typed", "program.asm", "nodes", "program.tree"},
+    {"asm", {"--merl"}, "program.asm", "program.merl", "lines", "program.asm"},
+};
+
+struct Measurement {
+    double seconds = 0;
+    long maxRssKb = 0;
+};
+
+string readFile(const string& path) {
+    ifstream file(path, ios::binary);
+    if (!file) {
+        throw runtime_error("ERROR: Cannot open " + path);
+    }
+    ostringstream contents;
+    contents << file.rdbuf();
+    return contents.str();
+}
+
+uint64_t countLines(const string& path) {
+    ifstream file(path, ios::binary);
+    uint64_t lines = 0;
+    char buffer[1 << 16];
+    while (file.read(buffer, sizeof(buffer)) || file.gcount() > 0) {
+        for (streamsize i = 0; i < file.gcount(); i++) {
+            lines += buffer[i] == '\n';
+        }
+    }
+    return lines;
+}
+
+uint64_t parseSize(const string& text) {
+    size_t end;
+    uint64_t size = stoull(text, &end);
+    string suffix = text.substr(end);
+    if (suffix == "K" || suffix == "k") {
+        size <<= 10;
+    } else if (suffix == "M" || suffix == "m") {
+        size <<= 20;
+    } else if (suffix == "G" || suffix == "g") {
+        size <<= 30;
+    } else if (!suffix.empty()) {
+        throw runtime_error("ERROR: Bad size " + text);
+    }
+    return size;
+}
+
+// Runs a tool with stdin, stdout and stderr redirected to files, and measures it alone.
+// The peak memory comes from wait4, so it is the tool's own and not the shell's
+Measurement runTool(const string& path, const vector<string>& args, const string& inputPath,
+                    const string& outputPath, const string& errorPath) {
+    vector<char*> argv = {const_cast<char*>(path.c_str())};
+    for (const string& arg : args) {
+        argv.push_back(const_cast<char*>(arg.c_str()));
+    }
+    argv.push_back(nullptr);
+
+    auto start = chrono::steady_clock::now();
+    pid_t pid = fork();
+    if (pid < 0) {
+        throw runtime_error("ERROR: Cannot start " + path);
+    }
+    if (pid == 0) {
+        int in = open(inputPath.c_str(), O_RDONLY);
+        int out = open(outputPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        int err = open(errorPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (in < 0 || out < 0 || err < 0 || dup2(in, 0) < 0 || dup2(out, 1) < 0 || dup2(err, 2) < 0) {
+            _exit(127);
+        }
+        execv(path.c_str(), argv.data());
+        _exit(127);
+    }
+
+    int status;
+    rusage usage;
+    if (wait4(pid, &status, 0, &usage) != pid) {
+        throw runtime_error("ERROR: Lost track of " + path);
+    }
+    Measurement measurement;
+    measurement.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    measurement.maxRssKb = usage.ru_maxrss;
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        string message = fs::exists(errorPath) ? readFile(errorPath) : "";
+        while (!message.empty() && message.back() == '\n') {
+            message.pop_back();
+        }
+        throw runtime_error(message.empty() ? "ERROR: " + path + " failed" : message);
+    }
+    return measurement;
+}
+
+string record(uint64_t size, uint64_t bytes, const Stage& stage, const Measurement& measurement, uint64_t items) {
+    char numbers[256];
+    snprintf(numbers, sizeof(numbers),
+             "\"seconds\": %.4f, \"%s\": %llu, \"%s_per_sec\": %.0f, \"max_rss_kb\": %ld", measurement.seconds,
+             stage.unit.c_str(), (unsigned long long)items, stage.unit.c_str(),
+             measurement.seconds > 0 ? items / measurement.seconds : 0.0, measurement.maxRssKb);
+    return "{\"size\": " + to_string(size) + ", \"bytes\": " + to_string(bytes) + ", \"stage\": \"" + stage.tool +
+           "\", " + numbers + "}";
+}
+
+int main(int argc, char* argv[]) {
+    string binDir = ".";
+    string outputPath;  // empty => stdout
+    string seed = "1";
+    vector<uint64_t> sizes;
+    vector<string> generatorArgs;
+
+    string self = argv[0];
+    if (self.find('/') != string::npos) {
+        binDir = self.substr(0, self.rfind('/'));
+    }
+
+    try {
+        for (int i = 1; i < argc; i++) {
+            string option = argv[i];
+            if (option == "--bin" && i + 1 < argc) {
+                binDir = argv[++i];
+            } else if (option == "--sizes" && i + 1 < argc) {
+                istringstream list(argv[++i]);
+                for (string size; getline(list, size, ',');) {
+                    sizes.push_back(parseSize(size));
+                }
+            } else if (option == "--seed" && i + 1 < argc) {
+                seed = argv[++i];
+            } else if (option == "-o" && i + 1 < argc) {
+                outputPath = argv[++i];
+            } else if ((option == "--statements" || option == "--depth" || option == "--pointers") && i + 1 < argc) {
+                generatorArgs.push_back(option);
+                generatorArgs.push_back(argv[++i]);
+            } else {
+                cerr << "ERROR: Unknown option " << option << endl;
+                return 1;
+            }
+        }
+    } catch (const logic_error&) {
+        cerr << "ERROR: Bad option value" << endl;
+        return 1;
+    } catch (const runtime_error& e) {
+        cerr << e.what() << endl;
+        return 1;
+    }
+    if (sizes.empty()) {
+        sizes = {1 << 10, 10 << 10, 100 << 10, 1 << 20, 10 << 20, 100 << 20};
+    }
+
+    char workTemplate[] = "/tmp/wlp4stages.XXXXXX";
+    if (!mkdtemp(workTemplate)) {
+        cerr << "ERROR: Cannot create a work directory" << endl;
+        return 1;
+    }
+    string workDir = workTemplate;
+    string errors = workDir + "/errors";
+
+    int status = 0;
+    try {
+        binDir = fs::absolute(binDir).string();
+        ostringstream json;
+        json << "[\n";
+        bool first = true;
+        for (uint64_t size : sizes) {
+            vector<string> args = {"--seed", seed, "--size", to_string(size)};
+            args.insert(args.end(), generatorArgs.begin(), generatorArgs.end());
+            runTool(binDir + "/wlp4rand", args, "/dev/null", workDir + "/program.wlp4", errors);
+            uint64_t bytes = fs::file_size(workDir + "/program.wlp4");
+
+            for (const Stage& stage : STAGES) {
+                Measurement measurement = runTool(binDir + "/" + stage.tool, stage.args, workDir + "/" + stage.input,
+                                                  workDir + "/" + stage.output, errors);
+                uint64_t items = countLines(workDir + "/" + stage.counted);
+                json << (first ? "" : ",\n") << "  " << record(size, bytes, stage, measurement, items);
+                first = false;
+                // Show progress, since the large sizes take a while
+                cerr << stage.tool << " " << bytes << " bytes: " << measurement.seconds << " s" << endl;
+            }
+        }
+        json << "\n]\n";
+
+        if (outputPath.empty()) {
+            cout << json.str();
+        } else {
+            ofstream out(outputPath);
+            out << json.str();
+            if (!out) {
+                throw runtime_error("ERROR: Cannot write " + outputPath);
+            }
+        }
+    } catch (const exception& e) {
+        cerr << e.what() << endl;
+        status = 1;
+    }
+    fs::remove_all(workDir);
+    return status;
+}
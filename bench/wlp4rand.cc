@@ -0,0 +1,283 @@
+#include <cstdint>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// Writes a random WLP4 program that passes wlp4type to stdout. The same options and seed always give the
+// same program, so stage timings can be compared between builds.
+// Usage: wlp4rand [--seed N] [--procedures N] [--statements N] [--depth N] [--pointers PERCENT] [--size BYTES]
+//
+// --procedures  procedures besides wain (default 10)
+// --statements  statements per procedure, counting nested ones (default 20)
+// --depth       depth of the expression trees (default 3)
+// --pointers    how often a variable, parameter or expression is an int* (default 25)
+// --size        keep adding procedures until the program is at least this many bytes (overrides --procedures)
+
+struct Options {
+    uint64_t seed = 1;
+    long procedures = 10;
+    int statements = 20;
+    int depth = 3;
+    int pointers = 25;
+    uint64_t size = 0;
+};
+
+// splitmix64, so the output doesn't depend on the standard library's distributions
+struct Random {
+    uint64_t state;
+
+    uint64_t next() {
+        uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return z ^ (z >> 31);
+    }
+
+    // 0 .. n - 1
+    int below(int n) {
+        return next() % n;
+    }
+
+    bool percent(int p) {
+        return below(100) < p;
+    }
+};
+
+struct Signature {
+    string name;
+    vector<bool> pointerParams;
+};
+
+class Generator {
+    Options options;
+    Random random;
+    vector<Signature> procedures;  // Those generated so far, which later ones may call
+    // Variables in scope in the procedure being generated
+    vector<string> ints;
+    vector<string> pointers;
+    int nextVariable = 0;
+
+    string number() {
+        return to_string(random.below(1000));
+    }
+
+    template <typename T>
+    const T& pick(const vector<T>& items) {
+        return items[random.below(items.size())];
+    }
+
+    string call(int depth) {
+        const Signature& callee = pick(procedures);
+        string text = callee.name + "(";
+        for (size_t i = 0; i < callee.pointerParams.size(); i++) {
+            text += (i > 0 ? ", " : "") + (callee.pointerParams[i] ? pointerExpr(depth - 1) : intExpr(depth - 1));
+        }
+        return text + ")";
+    }
+
+    string intExpr(int depth) {
+        if (depth <= 0) {
+            if (!pointers.empty() && random.percent(options.pointers / 2)) {
+                return "*" + pick(pointers);
+            }
+            return random.percent(30) ? number() : pick(ints);
+        }
+        switch (random.below(10)) {
+            case 0:
+                return !pointers.empty() ? "*(" + pointerExpr(depth - 1) + ")" : pick(ints);
+            case 1:
+                if (random.percent(options.pointers)) {
+                    return "(" + pointerExpr(depth - 1) + ") - (" + pointerExpr(depth - 1) + ")";
+                }
+                return "(" + intExpr(depth - 1) + ")";
+            case 2:
+                if (!procedures.empty()) {
+                    return call(depth);
+                }
+                return number();
+            default: {
+                static const char* const operators[] = {" + ", " - ", " * ", " / ", " % "};
+                int op = random.below(5);
+                // Dividing by a nonzero constant keeps constant folding from dividing by zero
+                string right = op >= 3 ? to_string(1 + random.below(999)) : intExpr(depth - 1);
+                return "(" + intExpr(depth - 1) + ")" + operators[op] + "(" + right + ")";
+            }
+        }
+    }
+
+    string pointerExpr(int depth) {
+        if (depth <= 0 || pointers.empty()) {
+            if (!pointers.empty() && random.percent(80)) {
+                return pick(pointers);
+            }
+            return random.percent(50) ? "NULL" : "&" + pick(ints);
+        }
+        switch (random.below(5)) {
+            case 0:
+                return "(" + pointerExpr(depth - 1) + ") + (" + intExpr(depth - 1) + ")";
+            case 1:
+                return "(" + intExpr(depth - 1) + ") + (" + pointerExpr(depth - 1) + ")";
+            case 2:
+                return "(" + pointerExpr(depth - 1) + ") - (" + intExpr(depth - 1) + ")";
+            case 3:
+                return "new int[" + intExpr(depth - 1) + "]";
+            default:
+                return pick(pointers);
+        }
+    }
+
+    string test() {
+        static const char* const comparisons[] = {" == ", " != ", " < ", " <= ", " > ", " >= "};
+        const char* comparison = comparisons[random.below(6)];
+        if (!pointers.empty() && random.percent(options.pointers)) {
+            return pointerExpr(options.depth - 1) + comparison + pointerExpr(options.depth - 1);
+        }
+        return intExpr(options.depth - 1) + comparison + intExpr(options.depth - 1);
+    }
+
+    // Writes statements until budget runs out, nesting at most `nesting` blocks deep
+    void statements(string& out, int& budget, int nesting, const string& indent) {
+        while (budget > 0) {
+            budget--;
+            int kind = random.below(nesting > 0 ? 10 : 7);
+            if (kind <= 2) {
+                out += indent + pick(ints) + " = " + intExpr(options.depth) + ";\n";
+            } else if (kind == 3 && !pointers.empty()) {
+                out += indent + pick(pointers) + " = " + pointerExpr(options.depth) + ";\n";
+            } else if (kind == 4 && !pointers.empty()) {
+                out += indent + "*(" + pointerExpr(options.depth - 1) + ") = " + intExpr(options.depth) + ";\n";
+            } else if (kind == 5) {
+                out += indent + "println(" + intExpr(options.depth) + ");\n";
+            } else if (kind == 6 && !pointers.empty()) {
+                out += indent + "delete [] " + pick(pointers) + ";\n";
+            } else if (kind >= 7) {
+                // Nested blocks take part of the remaining budget
+                int inner = budget > 0 ? random.below(budget + 1) / 2 : 0;
+                budget -= inner;
+                if (kind == 9) {
+                    out += indent + "while (" + test() + ") {\n";
+                    statements(out, inner, nesting - 1, indent + "  ");
+                    out += indent + "}\n";
+                } else {
+                    int elseBudget = random.below(inner + 1);
+                    inner -= elseBudget;
+                    out += indent + "if (" + test() + ") {\n";
+                    statements(out, inner, nesting - 1, indent + "  ");
+                    out += indent + "} else {\n";
+                    statements(out, elseBudget, nesting - 1, indent + "  ");
+                    out += indent + "}\n";
+                }
+            } else {
+                out += indent + pick(ints) + " = " + pick(ints) + " + 1;\n";
+            }
+        }
+    }
+
+    string variable(bool pointer) {
+        string name = string(pointer ? "p" : "v") + to_string(nextVariable++);
+        (pointer ? pointers : ints).push_back(name);
+        return name;
+    }
+
+    // Declarations and statements after the parameters; ends with the closing brace
+    string body() {
+        string out;
+        int locals = 1 + random.below(5);
+        for (int i = 0; i < locals; i++) {
+            if (random.percent(options.pointers)) {
+                out += "  int* " + variable(true) + " = NULL;\n";
+            } else {
+                out += "  int " + variable(false) + " = " + number() + ";\n";
+            }
+        }
+        // Statements need an int to assign to
+        if (ints.empty()) {
+            out += "  int " + variable(false) + " = " + number() + ";\n";
+        }
+        int budget = options.statements;
+        statements(out, budget, 2, "  ");
+        out += "  return " + intExpr(options.depth) + ";\n}\n";
+        return out;
+    }
+
+  public:
+    explicit Generator(const Options& options) : options(options), random{options.seed} {}
+
+    string procedure() {
+        Signature signature;
+        signature.name = "f" + to_string(procedures.size());
+        ints.clear();
+        pointers.clear();
+        nextVariable = 0;
+
+        string params;
+        int numParams = random.below(4);
+        for (int i = 0; i < numParams; i++) {
+            bool pointer = random.percent(options.pointers);
+            signature.pointerParams.push_back(pointer);
+            params += string(i > 0 ? ", " : "") + (pointer ? "int* " : "int ") + variable(pointer);
+        }
+
+        // It can call itself as well as the procedures before it
+        procedures.push_back(signature);
+        return "int " + signature.name + "(" + params + ") {\n" + body() + "\n";
+    }
+
+    string wain() {
+        ints.clear();
+        pointers.clear();
+        nextVariable = 0;
+        bool pointer = random.percent(options.pointers);
+        string params = string(pointer ? "int* " : "int ") + variable(pointer);
+        params += ", int " + variable(false);
+        return "int wain(" + params + ") {\n" + body();
+    }
+};
+
+int main(int argc, char* argv[]) {
+    Options options;
+
+    try {
+        for (int i = 1; i < argc; i++) {
+            string option = argv[i];
+            if (option == "--seed" && i + 1 < argc) {
+                options.seed = stoull(argv[++i]);
+            } else if (option == "--procedures" && i + 1 < argc) {
+                options.procedures = stol(argv[++i]);
+            } else if (option == "--statements" && i + 1 < argc) {
+                options.statements = stoi(argv[++i]);
+            } else if (option == "--depth" && i + 1 < argc) {
+                options.depth = stoi(argv[++i]);
+            } else if (option == "--pointers" && i + 1 < argc) {
+                options.pointers = stoi(argv[++i]);
+            } else if (option == "--size" && i + 1 < argc) {
+                options.size = stoull(argv[++i]);
+            } else {
+                cerr << "ERROR: Unknown option " << option << endl;
+                return 1;
+            }
+        }
+        if (options.depth < 1 || options.pointers < 0 || options.pointers > 100 || options.statements < 0) {
+            throw runtime_error("ERROR: --depth must be at least 1, --pointers 0 to 100 and --statements at least 0");
+        }
+    } catch (const logic_error&) {
+        cerr << "ERROR: Bad option value" << endl;
+        return 1;
+    } catch (const runtime_error& e) {
+        cerr << e.what() << endl;
+        return 1;
+    }
+
+    Generator generator(options);
+    uint64_t written = 0;
+    for (long i = 0; options.size > 0 ? written < options.size : i < options.procedures; i++) {
+        string text = generator.procedure();
+        written += text.size();
+        cout << text;
+    }
+    cout << generator.wain();
+    return cout ? 0 : 1;
+}
@@ -1,11 +1,25 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <fstream>
+#include <functional>
 #include <iostream>
+#include <set>
 #include <queue>
 #include <sstream>
 #include <stdexcept>
+#include <thread>
 #include <tuple>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
+#include <unistd.h>
+
+#include "../common/parallel.h"
+
 using namespace std;
 
 struct Token {
@@ -39,10 +53,16 @@ struct ParseTreeNode {
         return !token.kind.empty();
     }
 
-    // Destructor to clean up memory used by children
+    // Destructor to clean up memory used by children.
+    // Each child's children are taken over before it is deleted, so deep trees don't recurse
     ~ParseTreeNode() {
-        for (auto child : children) {
-            delete child;  // Delete each child
+        vector<ParseTreeNode*> pending = std::move(children);
+        while (!pending.empty()) {
+            ParseTreeNode* child = pending.back();
+            pending.pop_back();
+            pending.insert(pending.end(), child->children.begin(), child->children.end());
+            child->children.clear();
+            delete child;
         }
     }
 
@@ -71,192 +91,313 @@ ostream& operator<<(ostream& os, const ParseTreeNode& node) {
     return os;  // Return the ostream object to allow chaining
 }
 
-// GLOBAL VARIABLES
+// Code generation state for a single procedure (or wain).
+// Every procedure gets its own context, so procedures can be optimized and generated independently
+struct CodegenContext {
+    // Name of the procedure. Appended to every local label so labels are unique across procedures
+    string procedureName;
+
+    // Generated code for this procedure
+    ostringstream out;
+
+    // variable -> (type, offset from $29)
+    unordered_map<string, pair<string, string>> symbol_table;
+    // last offset in our symbol table
+    int latestOffset = 0;
+
+    // Counter used to generate unique label names
+    int labelCounter = 0;
+
+    // Counts number of deletes (and hence skipDelete labels) we have
+    int numDeletes = 0;
+
+    // varName -> [varValue, varType, dirty?]
+    // dirty = false when: on initialization (dcl), and if we can reassign
+    // dirty = true when: variable is reassigned within an if/while block
+    unordered_map<string, tuple<string, string, bool>> varTable;
+
+    // counts how many levels deep we are in an if/while statement. Used for determining if we should do constant propogation on a variable
+    int ifWhileNestLevel = 0;
+
+    // maps: varName -> register #
+    // used for Simple Register Allocation
+    unordered_map<string, string> regTable;
+    vector<string> freeRegisters = {"$28", "$27", "$26", "$25", "$24", "$23", "$22", "$21", "$20", "$19", "$18", "$17", "$16", "$15", "$14", "$13", "$9", "$8"};
+
+    // Registers a procedure took for its locals: (register, offset of the slot holding the caller's value).
+    // Procedures share registers, so the callee saves them on entry and restores them on exit
+    vector<pair<string, int>> savedRegisters;
+
+    // Stores a list of variables where we do & lvalue.
+    // If a variable is ever dereferenced, we can't put it in registers, it has to go on the stack
+    vector<string> dereferencedVariables;
+
+    string wainParam1Name, wainParam2Name;
+
+    // Profile counter of each if and while statement (--profile-generate, --profile-use).
+    // Counter 0 counts entries to the procedure. An if's then arm uses its counter and its else arm the next one
+    unordered_map<const ParseTreeNode*, int> profileCounters;
+    int numProfileCounters = 1;
+
+    // The locals that get the free registers, chosen by how often they are used
+    unordered_set<string> registerVariables;
+
+    // --instrument: this procedure's counters are instrumentBase .. instrumentBase + numInstrumentCounters - 1
+    // in the program's table. Each one is named after the label it counts, in the order they are generated
+    int instrumentBase = 0;
+    int numInstrumentCounters = 0;
+    vector<string> instrumentLabels;
+};
+
+// Number of threads used to generate procedures (-j N). 0 => one per core
+int numJobs = 0;
+
+// --inline-alloc => emit the built-in size-class allocator instead of calling new/delete for every request
+bool inlineAllocator = false;
+
+// --inline-print => println calls the printInt routine emitted into the program instead of the imported print
+bool inlinePrint = false;
+
+// -O0 => no constant folding or propagation, and every local lives on the stack.
+// -O1 (default) => both on. -O2 => also --inline-alloc and --inline-print
+int optimizationLevel = 1;
+
+// --objects DIR => write each procedure as its own assembly module in DIR instead of one program on stdout
+string objectDir;
+
+// --key-salt TEXT => also hashed into every object key, so objects from different builds of the tools don't mix
+string keySalt;
 
-// variable -> (type, offset from $29)
-unordered_map<string, pair<string, string>> symbol_table;
-// last offset in our symbol table
-int latestOffset = 0;
+// --profile-generate => count how often each procedure is entered and each if arm and loop body runs.
+// Every procedure gets a table of counters after its code, which mips-sim --profile reads back
+bool profileGenerate = false;
 
-// Counter used to generate unique label names
-int labelCounter = 0;
-// Counts number of dcls with values (NUM or NULL). Used to pop correct times in epilogue
-int numInits = 0;
+// --profile-use FILE => the counts from mips-sim --profile: procedure -> counter -> count
+unordered_map<string, vector<uint64_t>> profile;
 
-// Counts number of deletes (and hence skipDelete labels) we have
-int numDeletes = 0;
+// First word of every counter table, so a simulator can find the tables in memory
+const uint32_t PROFILE_MAGIC = 0x57345046;  // "W4PF"
 
-// varName -> [varValue, varType, dirty?]
-// dirty = false when: on initialization (dcl), and if we can reassign
-// dirty = true when: variable is reassigned within an if/while block
-unordered_map<string, tuple<string, string, bool>> varTable;
+// With a profile, calls that ran at least this percentage of the hottest counter's count are inlined
+const uint64_t PROFILE_HOT_PERCENT = 1;
 
-// counts how many levels deep we are in an if/while statement. Used for determining if we should do constant propogation on a variable
-int ifWhileNestLevel = 0;
+// Without a profile, register locals are chosen from a guess of how often each one is used:
+// uses are counted per ESTIMATE_ENTRY calls, and every loop is taken to run ESTIMATE_LOOP_TRIPS times
+const uint64_t ESTIMATE_ENTRY = 4;
+const uint64_t ESTIMATE_LOOP_TRIPS = 8;
 
-// maps: varName -> register #
-// used for Simple Register Allocation
-unordered_map<string, string> regTable;
-vector<string> freeRegisters = {"$28", "$27", "$26", "$25", "$24", "$23", "$22", "$21", "$20", "$19", "$18", "$17", "$16", "$15", "$14", "$13", "$9", "$8"};
+// --instrument => count entries to each procedure and each test of a loop header in one table of counters
+// after the epilogue. $28 holds the table's address, so an event costs one lw, add and sw.
+// The names of the counters go in a descriptor after each procedure's code, which mips-sim --instrument reads
+bool instrument = false;
 
-// Stores a list of variables where we do & lvalue.
-// If a variable is ever dereferenced, we can't put it in registers, it has to go on the stack
-vector<string> dereferencedVariables;
+// First word of each procedure's descriptor: the magic word, its first counter, the number of counters and
+// then each counter's label (length, then one word per character)
+const uint32_t INSTRUMENT_MAGIC = 0x5734494e;  // "W4IN"
+// Comes two words before the counter table, followed by the number of counters
+const uint32_t INSTRUMENT_TABLE_MAGIC = 0x57344943;  // "W4IC"
 
-string wainParam1Name, wainParam2Name;
+// Part of every object key. Bump it whenever the generated code changes, so stale objects aren't reused
+const string CODEGEN_VERSION = "wlp4gen-7";
+
+// Largest request (in words) served by the built-in allocator. Each size 1..ALLOC_SMALL_MAX has its own free list
+const int ALLOC_SMALL_MAX = 16;
+// Words taken from the library heap at startup for the built-in allocator's bump arena
+const int ALLOC_ARENA_WORDS = 4096;
 
 // indentations = true => indent each level of the tree
-void printParseTree(const ParseTreeNode* node, int level, bool indentations) {
-    if (node == nullptr) return;
+// Uses an explicit stack since statements -> statements statement makes trees as deep as the program is long
+void printParseTree(const ParseTreeNode* root, int rootLevel, bool indentations) {
+    if (root == nullptr) return;
 
-    if (indentations) {
-        // Print indentation based on the level in the tree
-        for (int i = 0; i < level; ++i) {
-            cout << "  ";
-        }
-    }
+    vector<pair<const ParseTreeNode*, int>> stack = {{root, rootLevel}};
+    while (!stack.empty()) {
+        const ParseTreeNode* node = stack.back().first;
+        int level = stack.back().second;
+        stack.pop_back();
 
-    if (node->isTerminal()) {
-        // Print token details if it's a token node, along with its type if available
-        cout << node->token.kind << " " << node->token.lexeme;
-        if (!node->type.empty()) {        // Check if type information is available and not empty
-            cout << " : " << node->type;  // Append type information
+        if (indentations) {
+            // Print indentation based on the level in the tree
+            for (int i = 0; i < level; ++i) {
+                cout << "  ";
+            }
         }
-        cout << endl;
-    } else {
-        // Print production rule
-        cout << node->prodRuleLHS;
 
-        if (indentations) {
-            cout << " -> ";
+        if (node->isTerminal()) {
+            // Print token details if it's a token node, along with its type if available
+            cout << node->token.kind << " " << node->token.lexeme;
+            if (!node->type.empty()) {        // Check if type information is available and not empty
+                cout << " : " << node->type;  // Append type information
+            }
+            cout << endl;
         } else {
-            cout << " ";
-        }
+            // Print production rule
+            cout << node->prodRuleLHS;
 
-        for (const auto& rhs : node->prodRuleRHS) {
-            cout << rhs << " ";
-        }
+            if (indentations) {
+                cout << " -> ";
+            } else {
+                cout << " ";
+            }
 
-        // Check if type information is available and not empty
-        // Don't want types for arglist
-        if (!node->type.empty() && node->prodRuleLHS != "arglist") {
-            cout << ": " << node->type;  // Append type information
-        }
+            for (const auto& rhs : node->prodRuleRHS) {
+                cout << rhs << " ";
+            }
+
+            // Check if type information is available and not empty
+            // Don't want types for arglist
+            if (!node->type.empty() && node->prodRuleLHS != "arglist") {
+                cout << ": " << node->type;  // Append type information
+            }
 
-        cout << endl;
+            cout << endl;
 
-        // Recursively print children, including their types if available
-        for (const auto& child : node->children) {
-            printParseTree(child, level + 1, indentations);
+            // Print children next, in order, including their types if available
+            for (auto it = node->children.rbegin(); it != node->children.rend(); ++it) {
+                stack.emplace_back(*it, level + 1);
+            }
         }
     }
 }
 
-void printSymbolTable() {
-    cout << "; Symbol Table:" << endl;
-    for (const auto& entry : symbol_table) {
+void printSymbolTable(CodegenContext& ctx) {
+    ctx.out << "; Symbol Table:" << endl;
+    for (const auto& entry : ctx.symbol_table) {
         const auto& variableName = entry.first;
         const auto& details = entry.second;  // This is a pair
         const auto& variableType = details.first;
         const auto& offset = details.second;
-        cout << "; Variable: " << variableName << ", Type: " << variableType << ", Offset: " << offset << endl;
+        ctx.out << "; Variable: " << variableName << ", Type: " << variableType << ", Offset: " << offset << endl;
     }
 }
 
-void code(ParseTreeNode* node);
+void code(CodegenContext& ctx, ParseTreeNode* node);
 
+// Reads a pre-order parse tree from standard input.
+// Uses an explicit stack of unfinished nodes so deep trees don't recurse
 ParseTreeNode* buildParseTree() {
+    ParseTreeNode* root = nullptr;
+    vector<ParseTreeNode*> unfinished;  // production rules still waiting on children
+
     string s;
-    getline(std::cin, s);
-    std::istringstream iss(s);  // Use istringstream to treat the string as a stream
-
-    if (isupper(s[0])) {  // Is a terminal
-        std::string kind, lexeme;
-        iss >> kind;
-        iss >> lexeme;
-
-        string colon;
-        string type = "";
-        if (iss >> colon) {  // If we have a type. Type always follows a colon
-            iss >> type;
-        }
-
-        Token t = Token(kind, lexeme);
-        return new ParseTreeNode(t, type);
-    } else {  // Is a production rule
-        vector<ParseTreeNode*> children;
-        string type = "";
-
-        std::string prodRuleLHS, prodRuleRHSToken;
-        vector<string> prodRuleRHS;
-        iss >> prodRuleLHS;
-        while (iss >> prodRuleRHSToken) {
-            if (prodRuleRHSToken == ":") {  // It's a type
-                iss >> prodRuleRHSToken;    // type
-                type = prodRuleRHSToken;
-                break;
+    do {
+        if (!getline(std::cin, s) && unfinished.empty()) {
+            return nullptr;  // empty input
+        }
+        std::istringstream iss(s);  // Use istringstream to treat the string as a stream
+        ParseTreeNode* node;
+
+        if (isupper(s[0])) {  // Is a terminal
+            std::string kind, lexeme;
+            iss >> kind;
+            iss >> lexeme;
+
+            string colon;
+            string type = "";
+            if (iss >> colon) {  // If we have a type. Type always follows a colon
+                iss >> type;
             }
 
-            if (prodRuleRHSToken == ".EMPTY") {  // Empty terminates the production rule
-                Token t = Token(prodRuleLHS, prodRuleRHSToken);
-                return new ParseTreeNode(t, type);
+            Token t = Token(kind, lexeme);
+            node = new ParseTreeNode(t, type);
+        } else {  // Is a production rule
+            string type = "";
+
+            std::string prodRuleLHS, prodRuleRHSToken;
+            vector<string> prodRuleRHS;
+            bool isEmpty = false;
+            iss >> prodRuleLHS;
+            while (iss >> prodRuleRHSToken) {
+                if (prodRuleRHSToken == ":") {  // It's a type
+                    iss >> prodRuleRHSToken;    // type
+                    type = prodRuleRHSToken;
+                    break;
+                }
+
+                if (prodRuleRHSToken == ".EMPTY") {  // Empty terminates the production rule
+                    isEmpty = true;
+                    break;
+                }
+
+                prodRuleRHS.emplace_back(prodRuleRHSToken);
             }
 
-            prodRuleRHS.emplace_back(prodRuleRHSToken);
+            if (isEmpty) {
+                Token t = Token(prodRuleLHS, ".EMPTY");
+                node = new ParseTreeNode(t, type);
+            } else {
+                node = new ParseTreeNode(prodRuleLHS, prodRuleRHS, {}, type);
+                node->children.reserve(prodRuleRHS.size());
+            }
         }
 
-        for (string prodRuleToken : prodRuleRHS) {
-            children.emplace_back(buildParseTree());
+        if (unfinished.empty()) {
+            root = node;
+        } else {
+            unfinished.back()->children.emplace_back(node);
+        }
+        if (!node->isTerminal() && !node->prodRuleRHS.empty()) {
+            unfinished.emplace_back(node);
         }
 
-        ParseTreeNode* ptn = new ParseTreeNode(prodRuleLHS, prodRuleRHS, children, type);
-        return ptn;
-    }
+        // Pop every rule whose children are all read
+        while (!unfinished.empty() && unfinished.back()->children.size() == unfinished.back()->prodRuleRHS.size()) {
+            unfinished.pop_back();
+        }
+    } while (!unfinished.empty());
+
+    return root;
 }
 
-// given a dcls node, adds it's declarations to the varTable
-void addDclsToVarTable(ParseTreeNode* node) {
-    // dcls -> .EMPTY
-    if (node->prodRuleRHS.size() != 5) {
-        return;
+// Left-recursive rules like statements -> statements statement build trees as deep as the list is long.
+// Returns the nodes of such a chain in source order (innermost first) so passes can loop instead of recursing
+vector<ParseTreeNode*> flattenLeftChain(ParseTreeNode* node) {
+    vector<ParseTreeNode*> chain;
+    while (!node->isTerminal() && node->prodRuleRHS[0] == node->prodRuleLHS) {
+        chain.emplace_back(node);
+        node = node->children[0];
     }
+    reverse(chain.begin(), chain.end());
+    return chain;
+}
 
-    // dcls -> dcls dcl BECOMES NUM SEMI
-    if (node->prodRuleRHS[3] == "NUM") {
-        string variableName = node->children[1]->children[1]->token.lexeme;
-        string variableValue = node->children[3]->token.lexeme;
-        string variableType = "int";
-        varTable[variableName] = make_tuple(variableValue, variableType, false);
-    }
-    // dcls -> dcls dcl BECOMES NULL SEMI
-    else if (node->prodRuleRHS[3] == "NULL") {
-        string variableName = node->children[1]->children[1]->token.lexeme;
-        string variableValue = node->children[3]->token.lexeme;
-        string variableType = "int*";
-        varTable[variableName] = make_tuple("1", variableType, false);
+// given a dcls node, adds it's declarations to the varTable
+void addDclsToVarTable(CodegenContext& ctx, ParseTreeNode* node) {
+    // dcls -> .EMPTY ends the chain
+    for (ParseTreeNode* dcls : flattenLeftChain(node)) {
+        string variableName = dcls->children[1]->children[1]->token.lexeme;
+
+        // dcls -> dcls dcl BECOMES NUM SEMI
+        if (dcls->prodRuleRHS[3] == "NUM") {
+            string variableValue = dcls->children[3]->token.lexeme;
+            ctx.varTable[variableName] = make_tuple(variableValue, "int", false);
+        }
+        // dcls -> dcls dcl BECOMES NULL SEMI
+        else if (dcls->prodRuleRHS[3] == "NULL") {
+            ctx.varTable[variableName] = make_tuple("1", "int*", false);
+        }
     }
-    return addDclsToVarTable(node->children[0]);
 }
 
-void printVarTable() {
-    cout << "; Variable Table:" << endl;
-    for (const auto& entry : varTable) {
+void printVarTable(CodegenContext& ctx) {
+    ctx.out << "; Variable Table:" << endl;
+    for (const auto& entry : ctx.varTable) {
         const auto& varName = entry.first;
         const auto& details = entry.second;
         const auto& varValue = std::get<0>(details);
         const auto& varType = std::get<1>(details);
         const auto& dirty = std::get<2>(details) ? "true" : "false";
 
-        cout << "; Variable: " << varName
+        ctx.out << "; Variable: " << varName
              << ", Value: " << varValue
              << ", Type: " << varType
              << ", Dirty: " << dirty << endl;
     }
 }
 
-bool inDereferencedVars(string s) {
+bool inDereferencedVars(const CodegenContext& ctx, string s) {
     // Iterate through the dereferencedVariables vector
-    for (const string& varName : dereferencedVariables) {
+    for (const string& varName : ctx.dereferencedVariables) {
         if (varName == s) {
             // If the variable name matches the input string, return true
             return true;
@@ -266,26 +407,26 @@ bool inDereferencedVars(string s) {
     return false;
 }
 
-void printRegTable() {
-    cout << "; Register Table:" << endl;
-    for (const auto& entry : regTable) {
+void printRegTable(CodegenContext& ctx) {
+    ctx.out << "; Register Table:" << endl;
+    for (const auto& entry : ctx.regTable) {
         const auto& varName = entry.first;   // Variable name
         const auto& regName = entry.second;  // Register name
-        cout << "; Variable: " << varName << ", Register: " << regName << endl;
+        ctx.out << "; Variable: " << varName << ", Register: " << regName << endl;
     }
 }
 
-void clearRegTable() {
+void clearRegTable(CodegenContext& ctx) {
     // Iterate over each entry in regTable
-    for (const auto& entry : regTable) {
+    for (const auto& entry : ctx.regTable) {
         const auto& regName = entry.second;  // Extract the register name
 
         // Add the register back to the freeRegisters list
-        freeRegisters.push_back(regName);
+        ctx.freeRegisters.push_back(regName);
     }
 
     // Clear the regTable to remove all entries
-    regTable.clear();
+    ctx.regTable.clear();
 }
 
 // Constant folding done in codegen stage
@@ -293,177 +434,330 @@ void clearRegTable() {
 // - Constant folding
 // - Constant propogation
 
-// Returns if an optimization was made
+// === Algebraic simplification of expr, term and factor nodes.
+// Arithmetic wraps around at 32 bits like it does on MIPS. Division and modulo by zero, and INT_MIN / -1, are
+// left for the program to do at run time
 
-// - a varTable maps from <var name> to <var value>
-
-bool optimizeTree(ParseTreeNode* node) {
-    // static int callCounter = 0;  // Static counter to track the number of calls to optimizeTree
-
-    // callCounter++;  // Increment the counter on each call
-
-    // cout << "optimizeTree call #" << callCounter << endl;  // Debug output
-
-    // // If callCounter exceeds a certain threshold, return false to indicate no optimization was done
-    // // This prevents infinite recursion or looping by breaking out after a certain number of calls
-    // if (callCounter > 15) {  // Example threshold
-    //     cout << "Call limit exceeded, exiting to prevent infinite loop." << endl;
-    //     return false;  // Or return false if you prefer not to terminate the entire program
-    // }
-
-    // cout << "; " << *node << endl;
+// v reduced to 32 bits, two's complement
+int32_t wrap32(int64_t v) {
+    return (int32_t)(uint32_t)v;
+}
 
-    // used to set wainParam1Name and wainParam2Name
-    // main -> INT WAIN LPAREN dcl COMMA dcl RPAREN LBRACE dcls statements RETURN expr SEMI RBRACE
-    if (node->prodRuleLHS == "main") {
-        wainParam1Name = node->children[3]->children[1]->token.lexeme;
-        wainParam2Name = node->children[5]->children[1]->token.lexeme;
+// Whether node is an expr, term or factor that is just a number, maybe in parentheses, and if so its value.
+// Constant propagation leaves NULL as a NUM typed int*, which is an address and not the integer 1
+bool constantValue(const ParseTreeNode* node, int32_t& value) {
+    while (true) {
+        if (node->prodRuleLHS == "factor" && node->prodRuleRHS[0] == "NUM" && node->type == "int") {
+            value = wrap32(stoll(node->children[0]->token.lexeme));
+            return true;
+        } else if ((node->prodRuleLHS == "expr" || node->prodRuleLHS == "term") && node->prodRuleRHS.size() == 1) {
+            node = node->children[0];
+        } else if (node->prodRuleLHS == "factor" && node->prodRuleRHS[0] == "LPAREN") {
+            node = node->children[1];
+        } else {
+            return false;
+        }
     }
+}
 
-    // === 0. Constant Folding
-    if (node->prodRuleLHS == "term") {
-        // term -> term STAR factor
-        if (node->prodRuleRHS.size() == 3 && node->prodRuleRHS[1] == "STAR") {
-            // optimize term and factor first
-            bool didOptimize = optimizeTree(node->children[0]) | optimizeTree(node->children[2]);
-
-            // if both constants
-            if (node->children[0]->children[0]->prodRuleRHS[0] == "NUM" && node->children[2]->prodRuleRHS[0] == "NUM") {
-                string newResult = to_string(stoi(node->children[0]->children[0]->children[0]->token.lexeme) * stoi(node->children[2]->children[0]->token.lexeme));
-
-                // create NUM
-                Token t = Token("kind", newResult);
-                ParseTreeNode* newNum = new ParseTreeNode(t, "int");
-
-                // create factor -> NUM
-                ParseTreeNode* newFactorNum = new ParseTreeNode("factor", {"NUM"}, {newNum}, "int");
+// A new factor -> NUM
+ParseTreeNode* numberFactor(int32_t value) {
+    ParseTreeNode* number = new ParseTreeNode(Token("NUM", to_string(value)), "int");
+    return new ParseTreeNode("factor", {"NUM"}, {number}, "int");
+}
 
-                // replace term STAR factor with factor
-                for (auto& child : node->children) {
-                    delete child;
-                }
-                node->prodRuleRHS = {"factor"};
+// Skips the expr -> term, term -> factor and parentheses around what an expr, term or factor really is
+const ParseTreeNode* stripWrappers(const ParseTreeNode* node) {
+    while ((node->prodRuleLHS == "expr" || node->prodRuleLHS == "term") && node->prodRuleRHS.size() == 1) {
+        node = node->children[0];
+        if (node->prodRuleLHS == "factor" && node->prodRuleRHS[0] == "LPAREN") {
+            node = node->children[1];
+        }
+    }
+    return node;
+}
 
-                node->children = {newFactorNum};
-                didOptimize = true;
-            }
-            return didOptimize;
+// Whether a and b are the same expression, ignoring wrappers and parentheses
+bool sameExpression(const ParseTreeNode* a, const ParseTreeNode* b) {
+    a = stripWrappers(a);
+    b = stripWrappers(b);
+    if (a->isTerminal() || b->isTerminal()) {
+        return a->isTerminal() && b->isTerminal() && a->token.kind == b->token.kind && a->token.lexeme == b->token.lexeme;
+    }
+    if (a->prodRuleLHS != b->prodRuleLHS || a->prodRuleRHS != b->prodRuleRHS) {
+        return false;
+    }
+    for (size_t i = 0; i < a->children.size(); i++) {
+        if (!sameExpression(a->children[i], b->children[i])) {
+            return false;
         }
-        // term -> term SLASH factor
-        else if (node->prodRuleRHS.size() == 3 && node->prodRuleRHS[1] == "SLASH") {
-            // optimize term and factor first
-            bool didOptimize = optimizeTree(node->children[0]) | optimizeTree(node->children[2]);
+    }
+    return true;
+}
 
-            // if both constants
-            if (node->children[0]->children[0]->prodRuleRHS[0] == "NUM" && node->children[2]->prodRuleRHS[0] == "NUM") {
-                string newResult = to_string(stoi(node->children[0]->children[0]->children[0]->token.lexeme) / stoi(node->children[2]->children[0]->token.lexeme));
+// Whether evaluating node can be skipped: no calls, no new, no loads that might fault and no division that
+// might be by zero
+bool isPure(const ParseTreeNode* node) {
+    vector<const ParseTreeNode*> stack = {node};
+    int32_t divisor;
+    while (!stack.empty()) {
+        node = stack.back();
+        stack.pop_back();
+        if (node->isTerminal()) {
+            continue;
+        }
+        if (node->prodRuleLHS == "factor" &&
+            (node->prodRuleRHS[0] == "STAR" || node->prodRuleRHS[0] == "NEW" || (node->prodRuleRHS.size() > 1 && node->prodRuleRHS[1] == "LPAREN"))) {
+            return false;
+        }
+        if (node->prodRuleLHS == "term" && node->prodRuleRHS.size() == 3 && node->prodRuleRHS[1] != "STAR" &&
+            (!constantValue(node->children[2], divisor) || divisor == 0)) {
+            return false;
+        }
+        stack.insert(stack.end(), node->children.begin(), node->children.end());
+    }
+    return true;
+}
 
-                // create NUM
-                Token t = Token("kind", newResult);
-                ParseTreeNode* newNum = new ParseTreeNode(t, "int");
+// Makes node (an expr, term or factor) into keep, which has the same left-hand side and is no longer in the tree.
+// The rest of node's children are deleted
+void takeOver(ParseTreeNode* node, ParseTreeNode* keep) {
+    for (auto& child : node->children) {
+        delete child;
+    }
+    node->prodRuleRHS = keep->prodRuleRHS;
+    node->children = std::move(keep->children);
+    node->type = keep->type;
+    keep->children.clear();
+    delete keep;
+}
 
-                // create factor -> NUM
-                ParseTreeNode* newFactorNum = new ParseTreeNode("factor", {"NUM"}, {newNum}, "int");
+// Replaces node with keep: one of its own children, or a new factor. An expr keeping a term or factor, or a term
+// keeping a factor, becomes expr -> term or term -> factor around it
+void replaceWith(ParseTreeNode* node, ParseTreeNode* keep) {
+    auto it = find(node->children.begin(), node->children.end(), keep);
+    if (it != node->children.end()) {
+        node->children.erase(it);
+    }
+    if (node->prodRuleLHS == "expr" && keep->prodRuleLHS == "factor") {
+        keep = new ParseTreeNode("term", {"factor"}, {keep}, keep->type);
+    }
+    if (keep->prodRuleLHS == node->prodRuleLHS) {
+        takeOver(node, keep);
+        return;
+    }
+    for (auto& child : node->children) {
+        delete child;
+    }
+    node->prodRuleRHS = {keep->prodRuleLHS};
+    node->children = {keep};
+    node->type = keep->type;
+}
 
-                // replace term STAR factor with factor
-                for (auto& child : node->children) {
-                    delete child;
-                }
-                node->prodRuleRHS = {"factor"};
+// An expr, term or factor that is only (E) becomes as much of E as fits in its place: all of it for an expr,
+// E's term for a term and E's factor for a factor. Returns whether it changed
+bool removeParentheses(ParseTreeNode* node) {
+    ParseTreeNode* factor = node;
+    while (factor->prodRuleLHS != "factor" && factor->prodRuleRHS.size() == 1) {
+        factor = factor->children[0];
+    }
+    if (factor->prodRuleLHS != "factor" || factor->prodRuleRHS[0] != "LPAREN") {
+        return false;
+    }
+    ParseTreeNode* parent = factor;
+    ParseTreeNode* inner = factor->children[1];
+    while (inner->prodRuleLHS != node->prodRuleLHS && inner->prodRuleLHS != "factor" && inner->prodRuleRHS.size() == 1) {
+        parent = inner;
+        inner = inner->children[0];
+    }
+    if (inner->prodRuleLHS != node->prodRuleLHS) {
+        return false;
+    }
+    parent->children.erase(find(parent->children.begin(), parent->children.end(), inner));
+    takeOver(node, inner);
+    return true;
+}
 
-                node->children = {newFactorNum};
-                didOptimize = true;
+// expr -> expr PLUS term and expr -> expr MINUS term, once both sides are simplified. Pointer arithmetic scales
+// every int operand by the same 4, so constants in it add up the same way. Returns whether it changed
+bool simplifyExpr(ParseTreeNode* node) {
+    ParseTreeNode* left = node->children[0];
+    ParseTreeNode* right = node->children[2];
+    bool plus = node->prodRuleRHS[1] == "PLUS";
+    int32_t a, b;
+    bool leftConstant = constantValue(left, a), rightConstant = constantValue(right, b);
+
+    if (leftConstant && rightConstant) {
+        replaceWith(node, numberFactor(wrap32(plus ? (int64_t)a + b : (int64_t)a - b)));
+        return true;
+    }
+    // x + 0, x - 0, 0 + x
+    if (rightConstant && b == 0) {
+        replaceWith(node, left);
+        return true;
+    }
+    if (plus && leftConstant && a == 0) {
+        replaceWith(node, right);
+        return true;
+    }
+    // x - x, for ints or for pointers
+    if (!plus && isPure(left) && isPure(right) && sameExpression(left, right)) {
+        replaceWith(node, numberFactor(0));
+        return true;
+    }
+    // (x + c1) + c2, (x - c1) + c2, (c1 + x) - c2, ... => x + c, so constants that meet across parentheses add up
+    const ParseTreeNode* inner = stripWrappers(left);
+    int32_t c;
+    if (rightConstant && inner->prodRuleLHS == "expr" && inner->prodRuleRHS.size() == 3) {
+        bool innerPlus = inner->prodRuleRHS[1] == "PLUS";
+        ParseTreeNode* rest = nullptr;
+        if (constantValue(inner->children[2], c)) {
+            rest = inner->children[0];
+        } else if (innerPlus && constantValue(inner->children[0], c)) {
+            rest = inner->children[2];
+        }
+        if (rest) {
+            int32_t sum = wrap32((int64_t)(innerPlus ? c : -(int64_t)c) + (plus ? b : -(int64_t)b));
+            // Take rest out of left before left is deleted
+            ParseTreeNode* owner = const_cast<ParseTreeNode*>(inner);
+            owner->children.erase(find(owner->children.begin(), owner->children.end(), rest));
+            if (rest->prodRuleLHS == "term") {
+                rest = new ParseTreeNode("expr", {"term"}, {rest}, rest->type);
+            }
+            delete left;
+            delete right;
+            node->children = {rest, new ParseTreeNode(Token("PLUS", "+"), ""),
+                              new ParseTreeNode("term", {"factor"}, {numberFactor(sum)}, "int")};
+            node->prodRuleRHS = {"expr", "PLUS", "term"};
+            if (sum == 0) {
+                replaceWith(node, rest);
             }
-            return didOptimize;
+            return true;
         }
-        // term -> term PCT factor
-        else if (node->prodRuleRHS.size() == 3 && node->prodRuleRHS[1] == "PCT") {
-            // optimize term and factor first
-            bool didOptimize = optimizeTree(node->children[0]) | optimizeTree(node->children[2]);
-
-            // if both constants
-            if (node->children[0]->children[0]->prodRuleRHS[0] == "NUM" && node->children[2]->prodRuleRHS[0] == "NUM") {
-                string newResult = to_string(stoi(node->children[0]->children[0]->children[0]->token.lexeme) % stoi(node->children[2]->children[0]->token.lexeme));
-
-                // create NUM
-                Token t = Token("kind", newResult);
-                ParseTreeNode* newNum = new ParseTreeNode(t, "int");
-
-                // create factor -> NUM
-                ParseTreeNode* newFactorNum = new ParseTreeNode("factor", {"NUM"}, {newNum}, "int");
-
-                // replace term STAR factor with factor
-                for (auto& child : node->children) {
-                    delete child;
-                }
-                node->prodRuleRHS = {"factor"};
+    }
+    return false;
+}
 
-                node->children = {newFactorNum};
-                didOptimize = true;
+// term -> term STAR factor, term -> term SLASH factor and term -> term PCT factor, once both sides are
+// simplified. Returns whether it changed
+bool simplifyTerm(ParseTreeNode* node) {
+    ParseTreeNode* left = node->children[0];
+    ParseTreeNode* right = node->children[2];
+    const string& op = node->prodRuleRHS[1];
+    int32_t a, b;
+    bool leftConstant = constantValue(left, a), rightConstant = constantValue(right, b);
+
+    if (leftConstant && rightConstant) {
+        if (op == "STAR") {
+            replaceWith(node, numberFactor(wrap32((int64_t)a * b)));
+            return true;
+        }
+        if (b == 0 || (a == INT32_MIN && b == -1)) {
+            return false;
+        }
+        // C++ truncates toward zero and takes the remainder's sign from the dividend, like MIPS div
+        replaceWith(node, numberFactor(op == "SLASH" ? a / b : a % b));
+        return true;
+    }
+    if (op == "STAR") {
+        // x * 1, 1 * x, x * 0, 0 * x
+        if (rightConstant && b == 1) {
+            replaceWith(node, left);
+            return true;
+        }
+        if (leftConstant && a == 1) {
+            replaceWith(node, right);
+            return true;
+        }
+        if ((rightConstant && b == 0 && isPure(left)) || (leftConstant && a == 0 && isPure(right))) {
+            replaceWith(node, numberFactor(0));
+            return true;
+        }
+    } else if (op == "SLASH" && rightConstant && b == 1) {
+        replaceWith(node, left);
+        return true;
+    } else if (op == "PCT" && rightConstant && (b == 1 || b == -1) && isPure(left)) {
+        replaceWith(node, numberFactor(0));
+        return true;
+    }
+
+    // (x * c1) * c2 and (c1 * x) * c2 => x * (c1 * c2). (x / c1) / c2 => x / (c1 * c2) when both are
+    // positive and the product fits, since truncating twice is the same as truncating once
+    const ParseTreeNode* inner = stripWrappers(left);
+    int32_t c;
+    if (rightConstant && inner->prodRuleLHS == "term" && inner->prodRuleRHS.size() == 3 && inner->prodRuleRHS[1] == op) {
+        ParseTreeNode* rest = nullptr;
+        int64_t product = 0;
+        if (op == "STAR" && constantValue(inner->children[2], c)) {
+            rest = inner->children[0];
+        } else if (op == "STAR" && constantValue(inner->children[0], c)) {
+            rest = inner->children[2];
+        } else if (op == "SLASH" && constantValue(inner->children[2], c) && c > 0 && b > 0 &&
+                   (int64_t)c * b <= INT32_MAX) {
+            rest = inner->children[0];
+        }
+        if (rest) {
+            product = wrap32((int64_t)c * b);
+            ParseTreeNode* owner = const_cast<ParseTreeNode*>(inner);
+            owner->children.erase(find(owner->children.begin(), owner->children.end(), rest));
+            if (rest->prodRuleLHS == "factor") {
+                rest = new ParseTreeNode("term", {"factor"}, {rest}, rest->type);
             }
-            return didOptimize;
+            delete left;
+            delete right;
+            node->children = {rest, new ParseTreeNode(Token(op, op == "STAR" ? "*" : "/"), ""), numberFactor(product)};
+            node->prodRuleRHS = {"term", op, "factor"};
+            return true;
         }
-    } else if (node->prodRuleLHS == "expr") {
-        // expr -> expr PLUS term
-        if (node->prodRuleRHS.size() == 3 && node->prodRuleRHS[1] == "PLUS") {
-            // optimize expr and term first
-            bool didOptimize = optimizeTree(node->children[0]) | optimizeTree(node->children[2]);
-
-            // if both constants
-            if (node->children[0]->children[0]->children[0]->prodRuleRHS[0] == "NUM" && node->children[2]->children[0]->prodRuleRHS[0] == "NUM") {
-                string newResult = to_string(stoi(node->children[0]->children[0]->children[0]->children[0]->token.lexeme) + stoi(node->children[2]->children[0]->children[0]->token.lexeme));
-
-                // create NUM
-                Token t = Token("kind", newResult);
-                ParseTreeNode* newNum = new ParseTreeNode(t, "int");
-
-                // create factor -> NUM
-                ParseTreeNode* newFactorNum = new ParseTreeNode("factor", {"NUM"}, {newNum}, "int");
+    }
+    return false;
+}
 
-                // create term -> factor
-                ParseTreeNode* newTermFactor = new ParseTreeNode("term", {"factor"}, {newFactorNum}, "int");
+// Whether a test comes out the same every time, and if so which way: both sides are constants, or both are the
+// same expression with no side effects
+bool constantTest(const ParseTreeNode* test, bool& result) {
+    const string& op = test->prodRuleRHS[1];
+    int32_t a, b;
+    if (constantValue(test->children[0], a) && constantValue(test->children[2], b)) {
+        result = op == "EQ" ? a == b : op == "NE" ? a != b : op == "LT" ? a < b : op == "LE" ? a <= b : op == "GT" ? a > b : a >= b;
+        return true;
+    }
+    if (isPure(test->children[0]) && isPure(test->children[2]) && sameExpression(test->children[0], test->children[2])) {
+        result = op == "EQ" || op == "LE" || op == "GE";
+        return true;
+    }
+    return false;
+}
 
-                // replace expr PLUS term with term
-                for (auto& child : node->children) {
-                    delete child;
-                }
-                node->prodRuleRHS = {"term"};
+// Returns if an optimization was made
 
-                node->children = {newTermFactor};
-                didOptimize = true;
-            }
-            return didOptimize;
-        }
-        // expr -> expr MINUS term
-        else if (node->prodRuleRHS.size() == 3 && node->prodRuleRHS[1] == "MINUS") {
-            // optimize expr and term first
-            bool didOptimize = optimizeTree(node->children[0]) | optimizeTree(node->children[2]);
+// - a varTable maps from <var name> to <var value>
 
-            // if both constants
-            if (node->children[0]->children[0]->children[0]->prodRuleRHS[0] == "NUM" && node->children[2]->children[0]->prodRuleRHS[0] == "NUM") {
-                string newResult = to_string(stoi(node->children[0]->children[0]->children[0]->children[0]->token.lexeme) - stoi(node->children[2]->children[0]->children[0]->token.lexeme));
+bool optimizeTree(CodegenContext& ctx, ParseTreeNode* node) {
+    // static int callCounter = 0;  // Static counter to track the number of calls to optimizeTree
 
-                // create NUM
-                Token t = Token("kind", newResult);
-                ParseTreeNode* newNum = new ParseTreeNode(t, "int");
+    // callCounter++;  // Increment the counter on each call
 
-                // create factor -> NUM
-                ParseTreeNode* newFactorNum = new ParseTreeNode("factor", {"NUM"}, {newNum}, "int");
+    // cout << "optimizeTree call #" << callCounter << endl;  // Debug output
 
-                // create term -> factor
-                ParseTreeNode* newTermFactor = new ParseTreeNode("term", {"factor"}, {newFactorNum}, "int");
+    // // If callCounter exceeds a certain threshold, return false to indicate no optimization was done
+    // // This prevents infinite recursion or looping by breaking out after a certain number of calls
+    // if (callCounter > 15) {  // Example threshold
+    //     cout << "Call limit exceeded, exiting to prevent infinite loop." << endl;
+    //     return false;  // Or return false if you prefer not to terminate the entire program
+    // }
 
-                // replace expr PLUS term with term
-                for (auto& child : node->children) {
-                    delete child;
-                }
-                node->prodRuleRHS = {"term"};
+    // cout << "; " << *node << endl;
 
-                node->children = {newTermFactor};
-                didOptimize = true;
-            }
-            return didOptimize;
-        }
+    // === 0. Constant folding and algebraic simplification, bottom up
+    if ((node->prodRuleLHS == "expr" || node->prodRuleLHS == "term") && node->prodRuleRHS.size() == 3) {
+        bool didOptimize = optimizeTree(ctx, node->children[0]) | optimizeTree(ctx, node->children[2]);
+        return (node->prodRuleLHS == "expr" ? simplifyExpr(node) : simplifyTerm(node)) | didOptimize;
+    } else if ((node->prodRuleLHS == "expr" && node->prodRuleRHS[0] == "term") ||
+               (node->prodRuleLHS == "term" && node->prodRuleRHS[0] == "factor") ||
+               (node->prodRuleLHS == "factor" && node->prodRuleRHS[0] == "LPAREN")) {
+        bool didOptimize = optimizeTree(ctx, node->children[node->prodRuleLHS == "factor" ? 1 : 0]);
+        return removeParentheses(node) | didOptimize;
     }
 
     // === 1. Constant propogation
@@ -471,33 +765,33 @@ bool optimizeTree(ParseTreeNode* node) {
     // main -> INT WAIN LPAREN dcl COMMA dcl RPAREN LBRACE dcls statements RETURN expr SEMI RBRACE
     if (node->prodRuleLHS == "main") {
         // optimize everything before LBRACE (can't optimize params, so nothing to do)
-        addDclsToVarTable(node->children[8]);
+        addDclsToVarTable(ctx, node->children[8]);
 
         // optimize statements and expr
-        bool didOptimize = optimizeTree(node->children[9]) | optimizeTree(node->children[11]);
+        bool didOptimize = optimizeTree(ctx, node->children[9]) | optimizeTree(ctx, node->children[11]);
 
-        varTable.clear();
+        ctx.varTable.clear();
         return didOptimize;
     }
     // procedure -> INT ID LPAREN params RPAREN LBRACE dcls statements RETURN expr SEMI RBRACE
     else if (node->prodRuleLHS == "procedure") {
         // optimize everything before LBRACE (can't optimize params, so nothing to do)
-        addDclsToVarTable(node->children[6]);
+        addDclsToVarTable(ctx, node->children[6]);
 
         // optimize statements and expr
-        bool didOptimize = optimizeTree(node->children[7]) | optimizeTree(node->children[9]);
+        bool didOptimize = optimizeTree(ctx, node->children[7]) | optimizeTree(ctx, node->children[9]);
 
-        varTable.clear();
+        ctx.varTable.clear();
         return didOptimize;
     }
     // statement -> lvalue BECOMES expr SEMI
     else if (node->prodRuleLHS == "statement" && node->prodRuleRHS.size() == 4) {
-        bool didOptimize = optimizeTree(node->children[2]);
+        bool didOptimize = optimizeTree(ctx, node->children[2]);
 
         // if reassignment took place inside an if/while block and lvalue is ID, mark var as dirty
-        if (ifWhileNestLevel != 0 && node->children[0]->prodRuleRHS[0] == "ID") {
+        if (ctx.ifWhileNestLevel != 0 && node->children[0]->prodRuleRHS[0] == "ID") {
             string varName = node->children[0]->children[0]->token.lexeme;
-            get<2>(varTable[varName]) = true;
+            get<2>(ctx.varTable[varName]) = true;
             // cout << "; " << varName << " marked as Dirty" << endl;
             // printVarTable();
         }
@@ -505,7 +799,7 @@ bool optimizeTree(ParseTreeNode* node) {
         // if lvalue is ID and expr can't resolve to constant, mark it as dirty
         else if (node->children[0]->prodRuleRHS[0] == "ID" && node->children[2]->children[0]->children[0]->prodRuleRHS[0] != "NUM") {
             string varName = node->children[0]->children[0]->token.lexeme;
-            get<2>(varTable[varName]) = true;
+            get<2>(ctx.varTable[varName]) = true;
             // cout << "; " << varName << " marked as Dirty" << endl;
             // printVarTable();
         }
@@ -514,7 +808,7 @@ bool optimizeTree(ParseTreeNode* node) {
         else if (node->children[0]->prodRuleRHS[0] == "ID" && node->children[2]->children[0]->children[0]->prodRuleRHS[0] == "NUM") {
             string varName = node->children[0]->children[0]->token.lexeme;
             string varValue = node->children[2]->children[0]->children[0]->children[0]->token.lexeme;
-            varTable[varName] = make_tuple(varValue, "int", false);
+            ctx.varTable[varName] = make_tuple(varValue, "int", false);
         }
 
         return didOptimize;
@@ -522,16 +816,16 @@ bool optimizeTree(ParseTreeNode* node) {
     // statement -> WHILE LPAREN test RPAREN LBRACE statements RBRACE
     else if (node->prodRuleLHS == "statement" && node->prodRuleRHS[0] == "WHILE") {
         // enter LBRACE
-        ifWhileNestLevel++;
+        ctx.ifWhileNestLevel++;
         // don't want to apply constant propogation to test.
         // E.g. int x = 3; while (x < 15) {};
 
-        bool didOptimize = optimizeTree(node->children[2]);
+        bool didOptimize = optimizeTree(ctx, node->children[2]);
 
-        didOptimize = didOptimize | optimizeTree(node->children[5]);
+        didOptimize = didOptimize | optimizeTree(ctx, node->children[5]);
 
         // exit RBRACE
-        ifWhileNestLevel--;
+        ctx.ifWhileNestLevel--;
 
         return didOptimize;
     }
@@ -539,22 +833,32 @@ bool optimizeTree(ParseTreeNode* node) {
     // statement -> IF LPAREN test RPAREN LBRACE statements RBRACE ELSE LBRACE statements
     else if (node->prodRuleLHS == "statement" && node->prodRuleRHS[0] == "IF") {
         // enter LBRACE
-        ifWhileNestLevel++;
+        ctx.ifWhileNestLevel++;
         // don't want to apply constant propogation to test.
         // E.g. int x = 3; while (x < 15) {};
 
-        bool didOptimize = optimizeTree(node->children[2]);
+        bool didOptimize = optimizeTree(ctx, node->children[2]);
 
-        didOptimize = didOptimize | optimizeTree(node->children[5]);  // stmts1
+        didOptimize = didOptimize | optimizeTree(ctx, node->children[5]);  // stmts1
 
-        didOptimize = didOptimize | optimizeTree(node->children[9]);  // stmts2
+        didOptimize = didOptimize | optimizeTree(ctx, node->children[9]);  // stmts2
 
         // exit RBRACE
-        ifWhileNestLevel--;
+        ctx.ifWhileNestLevel--;
 
         return didOptimize;
     }
 
+    // statements -> statements statement
+    else if (node->prodRuleLHS == "statements" && node->prodRuleRHS[0] == "statements") {
+        // Loop over the whole statement list instead of recursing into statements
+        bool didOptimize = false;
+        for (ParseTreeNode* statements : flattenLeftChain(node)) {
+            didOptimize = didOptimize | optimizeTree(ctx, statements->children[1]);
+        }
+        return didOptimize;
+    }
+
     // ====== 1.2  usage variables
     // factor -> ID
     else if (node->prodRuleLHS == "factor" && node->prodRuleRHS.size() == 1 && node->prodRuleRHS[0] == "ID") {
@@ -563,12 +867,12 @@ bool optimizeTree(ParseTreeNode* node) {
         string varName = node->children[0]->token.lexeme;
         bool didOptimize = false;
 
-        if (ifWhileNestLevel == 0) {                                                                    // if not in an if/while block
-            if (varTable.find(varName) != varTable.end() && !get<2>(varTable.find(varName)->second)) {  // found and not dirty
-                cout << "; " << varName << " FOUND AND NOT DIRTY" << endl;
+        if (ctx.ifWhileNestLevel == 0) {                                                                    // if not in an if/while block
+            if (ctx.varTable.find(varName) != ctx.varTable.end() && !get<2>(ctx.varTable.find(varName)->second)) {  // found and not dirty
+                ctx.out << "; " << varName << " FOUND AND NOT DIRTY" << endl;
                 // printVarTable();
                 didOptimize = true;
-                tuple<string, string, bool> result = varTable.find(varName)->second;
+                tuple<string, string, bool> result = ctx.varTable.find(varName)->second;
 
                 // Change node from factor -> ID to factor -> NUM
                 node->prodRuleRHS[0] = "NUM";
@@ -586,40 +890,44 @@ bool optimizeTree(ParseTreeNode* node) {
     for (int i = 0; i < node->children.size(); i++) {
         if (node->prodRuleRHS[i] != ".EMPTY" && !isupper((node->prodRuleRHS[i])[0])) {
             // cout << "Fallthrough call" << endl;
-            didOptimize = didOptimize | optimizeTree(node->children[i]);
+            didOptimize = didOptimize | optimizeTree(ctx, node->children[i]);
         }
     }
     return didOptimize;
 }
 
-void checkForDereferences(ParseTreeNode* node) {
-    // we want to check for factor -> AMP lvalue, and where lvalue -> ID
-    // if we have factor -> AMP lvalue and then lvalue -> LPAREN lvalue RPAREN,
-    //  we need to unwrap the lvalue as it might be an lvalue -> ID at the end
+// Uses an explicit stack since statements -> statements statement makes trees as deep as the program is long
+void checkForDereferences(CodegenContext& ctx, ParseTreeNode* root) {
+    vector<ParseTreeNode*> stack = {root};
+    while (!stack.empty()) {
+        ParseTreeNode* node = stack.back();
+        stack.pop_back();
 
-    // factor -> AMP lvalue
-    if (node->prodRuleLHS == "factor" && node->prodRuleRHS[0] == "AMP") {
-        // node = lvalue
-        node = node->children[1];
+        // we want to check for factor -> AMP lvalue, and where lvalue -> ID
+        // if we have factor -> AMP lvalue and then lvalue -> LPAREN lvalue RPAREN,
+        //  we need to unwrap the lvalue as it might be an lvalue -> ID at the end
 
-        while (true) {  // used to unwrap LPAREN lvalue RPAREN
-            if (node->prodRuleRHS.size() != 3) {
-                // lvalue -> ID
-                if (node->prodRuleRHS[0] == "ID") {
-                    string varName = node->children[0]->token.lexeme;
-                    dereferencedVariables.emplace_back(varName);
-                    cout << "; " << varName << " added to dereferenced variables list" << endl;
-                }
-                return;
-            } else {  // lvalue -> LPAREN lvalue RPAREN
+        // factor -> AMP lvalue
+        if (node->prodRuleLHS == "factor" && node->prodRuleRHS[0] == "AMP") {
+            // node = lvalue
+            node = node->children[1];
+
+            while (node->prodRuleRHS.size() == 3) {  // used to unwrap LPAREN lvalue RPAREN
                 node = node->children[1];
             }
+            // lvalue -> ID
+            if (node->prodRuleRHS[0] == "ID") {
+                string varName = node->children[0]->token.lexeme;
+                ctx.dereferencedVariables.emplace_back(varName);
+                ctx.out << "; " << varName << " added to dereferenced variables list" << endl;
+            }
+            continue;
         }
-    }
 
-    for (int i = 0; i < node->children.size(); i++) {
-        if (node->prodRuleRHS[i] != ".EMPTY" && !isupper((node->prodRuleRHS[i])[0])) {
-            checkForDereferences(node->children[i]);
+        for (int i = node->children.size() - 1; i >= 0; i--) {
+            if (node->prodRuleRHS[i] != ".EMPTY" && !isupper((node->prodRuleRHS[i])[0])) {
+                stack.emplace_back(node->children[i]);
+            }
         }
     }
 }
@@ -627,8 +935,8 @@ void checkForDereferences(ParseTreeNode* node) {
 // checks if an expr, term, or factor node is a ID.
 // Returns the register that the variable stored in
 // If variable is not an ID or not stored in regTable, then return ""
-string resolveToID(ParseTreeNode* node) {
-    cout << "; " << *node << endl;
+string resolveToID(CodegenContext& ctx, ParseTreeNode* node) {
+    ctx.out << "; " << *node << endl;
     if (node->prodRuleLHS == "expr") {
         if (node->prodRuleRHS[0] == "term") {
             node = node->children[0];
@@ -638,8 +946,8 @@ string resolveToID(ParseTreeNode* node) {
                 // factor -> ID
                 if (node->prodRuleRHS[0] == "ID") {
                     string varName = node->children[0]->token.lexeme;
-                    if (regTable.find(varName) != regTable.end()) {  // found
-                        return regTable[varName];
+                    if (ctx.regTable.find(varName) != ctx.regTable.end()) {  // found
+                        return ctx.regTable[varName];
                     }
                 }
             }
@@ -651,8 +959,8 @@ string resolveToID(ParseTreeNode* node) {
             // factor -> ID
             if (node->prodRuleRHS[0] == "ID") {
                 string varName = node->children[0]->token.lexeme;
-                if (regTable.find(varName) != regTable.end()) {  // found
-                    return regTable[varName];
+                if (ctx.regTable.find(varName) != ctx.regTable.end()) {  // found
+                    return ctx.regTable[varName];
                 }
             }
         }
@@ -660,86 +968,801 @@ string resolveToID(ParseTreeNode* node) {
         // factor -> ID
         if (node->prodRuleRHS[0] == "ID") {
             string varName = node->children[0]->token.lexeme;
-            if (regTable.find(varName) != regTable.end()) {  // found
-                return regTable[varName];
+            if (ctx.regTable.find(varName) != ctx.regTable.end()) {  // found
+                return ctx.regTable[varName];
             }
         }
     }
     return "";
 }
 
-void push(string registerX) {
+// Numbers the profile counters of the if and while statements in a procedure, in source order.
+// Statements are never added or removed by optimizeTree, so an instrumented build and a build that
+// uses its profile number them the same way
+void numberProfileCounters(CodegenContext& ctx, ParseTreeNode* root) {
+    vector<ParseTreeNode*> stack = {root};
+    while (!stack.empty()) {
+        ParseTreeNode* node = stack.back();
+        stack.pop_back();
+        if (node->prodRuleLHS == "statement" && node->prodRuleRHS[0] == "IF") {
+            ctx.profileCounters[node] = ctx.numProfileCounters;
+            ctx.numProfileCounters += 2;
+        } else if (node->prodRuleLHS == "statement" && node->prodRuleRHS[0] == "WHILE") {
+            ctx.profileCounters[node] = ctx.numProfileCounters;
+            ctx.numProfileCounters += 1;
+        }
+        for (auto it = node->children.rbegin(); it != node->children.rend(); ++it) {
+            if (!(*it)->isTerminal()) {
+                stack.push_back(*it);
+            }
+        }
+    }
+}
+
+// How many times the profile says a counter of this procedure was hit (0 without a profile)
+uint64_t profileCount(const CodegenContext& ctx, int counter) {
+    auto it = profile.find(ctx.procedureName);
+    if (it == profile.end() || counter >= (int)it->second.size()) {
+        return 0;
+    }
+    return it->second[counter];
+}
+
+// --profile-generate: adds one to a counter in the procedure's table. $5 and $6 are free between statements
+void countProfileEvent(CodegenContext& ctx, int counter) {
+    if (!profileGenerate) {
+        return;
+    }
+    // The counters follow the magic word, the number of counters, the name's length and the name
+    int offset = 4 * (3 + ctx.procedureName.size() + counter);
+    if (offset > 32767) {
+        throw runtime_error("ERROR: Too many if and while statements to profile in " + ctx.procedureName);
+    }
+    ctx.out << "lis $5" << endl;
+    ctx.out << ".word profile" << ctx.procedureName << endl;
+    ctx.out << "lw $6, " << offset << "($5)" << endl;
+    ctx.out << "add $6, $6, $11" << endl;
+    ctx.out << "sw $6, " << offset << "($5)" << endl;
+}
+
+// --profile-generate: the procedure's counter table. It names the procedure, so the counts can be read
+// back without a symbol map
+void generateProfileTable(ostream& out, const CodegenContext& ctx) {
+    if (!profileGenerate) {
+        return;
+    }
+    out << "profile" << ctx.procedureName << ":" << endl;
+    out << ".word " << PROFILE_MAGIC << endl;
+    out << ".word " << ctx.numProfileCounters << endl;
+    out << ".word " << ctx.procedureName.size() << endl;
+    for (char c : ctx.procedureName) {
+        out << ".word " << (int)c << endl;
+    }
+    for (int i = 0; i < ctx.numProfileCounters; i++) {
+        out << ".word 0" << endl;
+    }
+}
+
+// --instrument: how many counters a procedure needs, one for its entry and one per loop.
+// Like the profile counters, this doesn't change when optimizeTree runs
+int countInstrumentCounters(const ParseTreeNode* root) {
+    int counters = 1;
+    vector<const ParseTreeNode*> stack = {root};
+    while (!stack.empty()) {
+        const ParseTreeNode* node = stack.back();
+        stack.pop_back();
+        if (node->prodRuleLHS == "statement" && node->prodRuleRHS[0] == "WHILE") {
+            counters++;
+        }
+        for (const ParseTreeNode* child : node->children) {
+            if (!child->isTerminal()) {
+                stack.push_back(child);
+            }
+        }
+    }
+    return counters;
+}
+
+// --instrument: adds one to the next counter of the procedure, named after the label just emitted.
+// $5 is free at a procedure's entry and at a loop header
+void countInstrumentEvent(CodegenContext& ctx, const string& label) {
+    if (!instrument) {
+        return;
+    }
+    if ((int)ctx.instrumentLabels.size() >= ctx.numInstrumentCounters) {
+        throw runtime_error("ERROR: More instrumented labels than counters in " + ctx.procedureName);
+    }
+    int offset = 4 * (ctx.instrumentBase + ctx.instrumentLabels.size());
+    if (offset > 32767) {
+        throw runtime_error("ERROR: Too many procedures and loops to instrument");
+    }
+    ctx.instrumentLabels.push_back(label);
+    ctx.out << "lw $5, " << offset << "($28)" << endl;
+    ctx.out << "add $5, $5, $11" << endl;
+    ctx.out << "sw $5, " << offset << "($28)" << endl;
+}
+
+// --instrument: the descriptor naming the procedure's counters
+void generateInstrumentDescriptor(ostream& out, const CodegenContext& ctx) {
+    if (!instrument) {
+        return;
+    }
+    out << ".word " << INSTRUMENT_MAGIC << endl;
+    out << ".word " << ctx.instrumentBase << endl;
+    out << ".word " << ctx.instrumentLabels.size() << endl;
+    for (const string& label : ctx.instrumentLabels) {
+        out << ".word " << label.size() << endl;
+        for (char c : label) {
+            out << ".word " << (int)c << endl;
+        }
+    }
+}
+
+// --instrument: the program's counters, all zero at the start. Goes in wain's module, whose prologue loads $28
+void generateInstrumentCounters(ostream& out, int numCounters) {
+    if (!instrument) {
+        return;
+    }
+    out << ".word " << INSTRUMENT_TABLE_MAGIC << endl;
+    out << ".word " << numCounters << endl;
+    out << "instrumentCounters:" << endl;
+    for (int i = 0; i < numCounters; i++) {
+        out << ".word 0" << endl;
+    }
+}
+
+// --instrument: where each procedure's counters start in the table, in program order. The last entry is
+// the size of the table
+vector<int> assignInstrumentBases(const vector<ParseTreeNode*>& procedures) {
+    vector<int> bases = {0};
+    for (const ParseTreeNode* procedure : procedures) {
+        bases.push_back(bases.back() + (instrument ? countInstrumentCounters(procedure) : 0));
+    }
+    return bases;
+}
+
+// Reads a profile written by mips-sim --profile: one "procedure counter count" line per counter
+void readProfile(const string& path) {
+    ifstream file(path);
+    if (!file) {
+        throw runtime_error("ERROR: Cannot open " + path);
+    }
+    string name;
+    size_t counter;
+    uint64_t count;
+    while (file >> name >> counter >> count) {
+        vector<uint64_t>& counts = profile[name];
+        if (counts.size() <= counter) {
+            counts.resize(counter + 1);
+        }
+        counts[counter] += count;
+    }
+    if (!file.eof()) {
+        throw runtime_error("ERROR: " + path + " is not a profile");
+    }
+}
+
+// Calls visit on every node of a procedure with how many times the profile says it ran: the count of the
+// innermost if arm or loop body around it, or of entries to the procedure
+void walkWithCounts(const CodegenContext& ctx, ParseTreeNode* root, const function<void(ParseTreeNode*, uint64_t)>& visit) {
+    vector<pair<ParseTreeNode*, uint64_t>> stack = {{root, profileCount(ctx, 0)}};
+    while (!stack.empty()) {
+        auto [node, count] = stack.back();
+        stack.pop_back();
+        visit(node, count);
+
+        auto counter = ctx.profileCounters.find(node);
+        vector<uint64_t> childCounts(node->children.size(), count);
+        if (counter != ctx.profileCounters.end() && node->prodRuleRHS[0] == "IF") {
+            childCounts[5] = profileCount(ctx, counter->second);
+            childCounts[9] = profileCount(ctx, counter->second + 1);
+        } else if (counter != ctx.profileCounters.end()) {
+            // The test runs once more than the body each time the loop is reached
+            childCounts[2] = count + profileCount(ctx, counter->second);
+            childCounts[5] = profileCount(ctx, counter->second);
+        }
+        for (size_t i = 0; i < node->children.size(); i++) {
+            if (!node->children[i]->isTerminal()) {
+                stack.push_back({node->children[i], childCounts[i]});
+            }
+        }
+    }
+}
+
+// Without a profile: visits every node of a procedure with a guess of how many times it runs per ESTIMATE_ENTRY calls.
+// Each loop is guessed to run ESTIMATE_LOOP_TRIPS times and each arm of an if half the time
+void walkWithEstimates(ParseTreeNode* root, const function<void(ParseTreeNode*, uint64_t)>& visit) {
+    vector<pair<ParseTreeNode*, uint64_t>> stack = {{root, ESTIMATE_ENTRY}};
+    while (!stack.empty()) {
+        auto [node, count] = stack.back();
+        stack.pop_back();
+        visit(node, count);
+
+        vector<uint64_t> childCounts(node->children.size(), count);
+        // statement → IF LPAREN test RPAREN LBRACE statements RBRACE ELSE LBRACE statements RBRACE
+        if (node->prodRuleLHS == "statement" && node->prodRuleRHS[0] == "IF") {
+            childCounts[5] = childCounts[9] = count / 2;
+        }
+        // statement → WHILE LPAREN test RPAREN LBRACE statements RBRACE
+        else if (node->prodRuleLHS == "statement" && node->prodRuleRHS[0] == "WHILE") {
+            childCounts[2] = childCounts[5] = count * ESTIMATE_LOOP_TRIPS;
+        }
+        for (size_t i = 0; i < node->children.size(); i++) {
+            if (!node->children[i]->isTerminal()) {
+                stack.push_back({node->children[i], childCounts[i]});
+            }
+        }
+    }
+}
+
+// Gives the free registers to the locals used most often, counted from the profile with --profile-use
+// and guessed otherwise. A register local is saved and restored on every call, so only locals used
+// more than twice per call get one; the rest stay on the stack
+void chooseRegisterVariables(CodegenContext& ctx, ParseTreeNode* procedure) {
+    unordered_map<string, uint64_t> uses;
+    auto countUse = [&](ParseTreeNode* node, uint64_t count) {
+        if ((node->prodRuleLHS == "factor" || node->prodRuleLHS == "lvalue") && node->prodRuleRHS.size() == 1 &&
+            node->prodRuleRHS[0] == "ID") {
+            uses[node->children[0]->token.lexeme] += count;
+        }
+    };
+    uint64_t calls;
+    if (profile.count(ctx.procedureName)) {
+        walkWithCounts(ctx, procedure, countUse);
+        calls = profileCount(ctx, 0);
+    } else {
+        walkWithEstimates(procedure, countUse);
+        calls = ESTIMATE_ENTRY;
+    }
+
+    vector<string> locals;
+    ParseTreeNode* dcls = procedure->children[procedure->prodRuleLHS == "main" ? 8 : 6];
+    for (ParseTreeNode* dcl : flattenLeftChain(dcls)) {
+        string name = dcl->children[1]->children[1]->token.lexeme;
+        if (!inDereferencedVars(ctx, name) && uses[name] > 2 * calls) {
+            locals.push_back(name);
+        }
+    }
+    stable_sort(locals.begin(), locals.end(), [&](const string& a, const string& b) { return uses[a] > uses[b]; });
+    locals.resize(min(locals.size(), ctx.freeRegisters.size()));
+    ctx.registerVariables.insert(locals.begin(), locals.end());
+}
+
+ParseTreeNode* cloneTree(const ParseTreeNode* node) {
+    ParseTreeNode* copy = new ParseTreeNode(*node);
+    for (auto& child : copy->children) {
+        child = cloneTree(child);
+    }
+    return copy;
+}
+
+// factor → ID | NUM | NULL as an argument: cheap to copy and has no side effects
+const ParseTreeNode* simpleArgument(const ParseTreeNode* expr) {
+    if (expr->prodRuleRHS[0] != "term" || expr->children[0]->prodRuleRHS[0] != "factor") {
+        return nullptr;
+    }
+    const ParseTreeNode* factor = expr->children[0]->children[0];
+    bool simple = (factor->prodRuleRHS[0] == "ID" && factor->prodRuleRHS.size() == 1) ||
+                  factor->prodRuleRHS[0] == "NUM" || factor->prodRuleRHS[0] == "NULL";
+    return simple ? factor : nullptr;
+}
+
+// A procedure that only returns an expression of its parameters, and never takes their address
+bool isInlinable(const ParseTreeNode* procedure) {
+    if (!procedure->children[6]->isTerminal() || !procedure->children[7]->isTerminal()) {
+        return false;  // has declarations or statements
+    }
+    vector<const ParseTreeNode*> stack = {procedure->children[9]};
+    while (!stack.empty()) {
+        const ParseTreeNode* node = stack.back();
+        stack.pop_back();
+        if (node->prodRuleLHS == "factor" && node->prodRuleRHS[0] == "AMP") {
+            return false;
+        }
+        stack.insert(stack.end(), node->children.begin(), node->children.end());
+    }
+    return true;
+}
+
+// Replaces the call factor → ID LPAREN [arglist] RPAREN with factor → LPAREN expr RPAREN, where expr is the
+// callee's return expression with each parameter replaced by its (simple) argument
+void inlineCall(ParseTreeNode* call, const ParseTreeNode* callee) {
+    unordered_map<string, const ParseTreeNode*> arguments;
+    if (call->prodRuleRHS.size() == 4) {
+        const ParseTreeNode* paramlist = callee->children[3]->children[0];
+        const ParseTreeNode* arglist = call->children[2];
+        while (true) {
+            arguments[paramlist->children[0]->children[1]->token.lexeme] = simpleArgument(arglist->children[0]);
+            if (arglist->prodRuleRHS.size() == 1) {
+                break;
+            }
+            paramlist = paramlist->children[2];
+            arglist = arglist->children[2];
+        }
+    }
+
+    ParseTreeNode* expr = cloneTree(callee->children[9]);
+    vector<ParseTreeNode*> stack = {expr};
+    while (!stack.empty()) {
+        ParseTreeNode* node = stack.back();
+        stack.pop_back();
+        if (node->prodRuleLHS == "factor" && node->prodRuleRHS.size() == 1 && node->prodRuleRHS[0] == "ID") {
+            const ParseTreeNode* argument = arguments.at(node->children[0]->token.lexeme);
+            delete node->children[0];
+            node->prodRuleRHS = argument->prodRuleRHS;
+            node->children = {cloneTree(argument->children[0])};
+            continue;
+        }
+        stack.insert(stack.end(), node->children.begin(), node->children.end());
+    }
+
+    for (auto& child : call->children) {
+        delete child;
+    }
+    call->prodRuleRHS = {"LPAREN", "expr", "RPAREN"};
+    call->children = {new ParseTreeNode(Token("LPAREN", "("), ""), expr, new ParseTreeNode(Token("RPAREN", ")"), "")};
+}
+
+// --profile-use: inlines hot calls to procedures that only return an expression, when every argument is
+// a variable or a constant. Runs before the procedures are generated in parallel, since it reads other
+// procedures' trees
+void inlineHotCalls(const vector<ParseTreeNode*>& procedures) {
+    uint64_t hottest = 0;
+    for (const auto& entry : profile) {
+        for (uint64_t count : entry.second) {
+            hottest = max(hottest, count);
+        }
+    }
+
+    unordered_map<string, const ParseTreeNode*> inlinable;
+    for (const auto* procedure : procedures) {
+        if (procedure->prodRuleLHS == "procedure" && isInlinable(procedure)) {
+            inlinable[procedure->children[1]->token.lexeme] = procedure;
+        }
+    }
+    if (hottest == 0 || inlinable.empty()) {
+        return;
+    }
+
+    for (auto* procedure : procedures) {
+        CodegenContext ctx;
+        ctx.procedureName = procedure->prodRuleLHS == "main" ? "wain" : procedure->children[1]->token.lexeme;
+        numberProfileCounters(ctx, procedure);
+
+        vector<pair<ParseTreeNode*, const ParseTreeNode*>> calls;
+        walkWithCounts(ctx, procedure, [&](ParseTreeNode* node, uint64_t count) {
+            if (node->prodRuleLHS != "factor" || node->prodRuleRHS[0] != "ID" || node->prodRuleRHS.size() == 1 ||
+                count == 0 || count * 100 < hottest * PROFILE_HOT_PERCENT) {
+                return;
+            }
+            auto callee = inlinable.find(node->children[0]->token.lexeme);
+            if (callee == inlinable.end() || callee->second == procedure) {
+                return;
+            }
+            for (const ParseTreeNode* arglist = node->prodRuleRHS.size() == 4 ? node->children[2] : nullptr; arglist;
+                 arglist = arglist->prodRuleRHS.size() == 3 ? arglist->children[2] : nullptr) {
+                if (!simpleArgument(arglist->children[0])) {
+                    return;
+                }
+            }
+            calls.push_back({node, callee->second});
+        });
+        for (const auto& call : calls) {
+            inlineCall(call.first, call.second);
+        }
+    }
+}
+
+void push(ostream& out, string registerX) {
     // cout << "sw " << registerX << ", -4($30) ; push(" << registerX << ")" << endl;
-    cout << "sw " << registerX << ", -4($30) ; push(" << registerX << ")" << endl;
+    out << "sw " << registerX << ", -4($30) ; push(" << registerX << ")" << endl;
+
+    out << "sub $30, $30, $4" << endl;
+}
+
+void pop(ostream& out, string registerX) {
+    out << "add $30, $30, $4 ; pop(" << registerX << ")" << endl;
+    out << "lw " << registerX << ", -4($30)" << endl;
+}
+
+// The prologue and epilogue belong to wain, so they use main's context to find its dereferenced parameters
+void generatePrologue(ostream& out, CodegenContext& mainCtx) {
+    if (!inlinePrint) {
+        out << ".import print" << endl;
+    }
+    out << ".import init" << endl;
+    out << ".import new" << endl;
+    out << ".import delete" << endl;
+    out << "lis $4" << endl;
+    out << ".word 4" << endl;
+    out << "sub $29, $30, $4 ; setup frame pointer" << endl;
+
+    if (inDereferencedVars(mainCtx, mainCtx.wainParam1Name)) {
+        push(out, "$1");
+    }
+    if (inDereferencedVars(mainCtx, mainCtx.wainParam2Name)) {
+        push(out, "$2");
+    }
+
+    out << "lis $11" << endl;
+    out << ".word 1" << endl;
+    out << "lis $10" << endl;
+    if (inlinePrint) {
+        out << ".word printInt" << endl;
+    } else {
+        out << ".word print" << endl;
+    }
+    if (instrument) {
+        out << "lis $28" << endl;
+        out << ".word instrumentCounters" << endl;
+    }
+    out << "beq $0, $0, wain" << endl;
+    out << "; END OF PROLOGUE" << endl;
+}
+
+void generateEpilogue(ostream& out, CodegenContext& mainCtx) {
+    out << "; START OF EPILOGUE" << endl;
+    if (inDereferencedVars(mainCtx, mainCtx.wainParam2Name)) {
+        pop(out, "$2");
+    }
+    if (inDereferencedVars(mainCtx, mainCtx.wainParam1Name)) {
+        pop(out, "$1");
+    }
+    out << "jr $31" << endl;
+}
+
+void initHeap(CodegenContext& ctx, ParseTreeNode* dcl1) {
+    ctx.out << "; START OF INITHEAP" << endl;
+
+    push(ctx.out, "$31");
+    push(ctx.out, "$2");
+
+    // Check if we were called with mips.twoints
+    // dcl -> type ID
+    // get type of ID
+    if (dcl1->children[1]->type == "int") {  // called with mips.twoints
+        ctx.out << "add $2, $0, $0" << endl;    // $2 = 0
+    }
+
+    // Call init
+    ctx.out << "lis $3" << endl;
+    ctx.out << ".word init" << endl;
+    ctx.out << "jalr $3" << endl;
+
+    if (inlineAllocator) {
+        // Carve the bump arena for the built-in allocator out of the library heap
+        push(ctx.out, "$1");
+        ctx.out << "lis $1" << endl;
+        ctx.out << ".word " << ALLOC_ARENA_WORDS << endl;
+        ctx.out << "lis $3" << endl;
+        ctx.out << ".word new" << endl;
+        ctx.out << "jalr $3" << endl;
+        pop(ctx.out, "$1");
+        ctx.out << "lis $7" << endl;
+        ctx.out << ".word allocBumpPtr" << endl;
+        ctx.out << "sw $3, 0($7)" << endl;
+        // If the library could not give us an arena, leave allocArenaEnd at 0 so every request falls back to new
+        ctx.out << "beq $3, $0, 3" << endl;
+        ctx.out << "lis $5" << endl;
+        ctx.out << ".word " << 4 * ALLOC_ARENA_WORDS << endl;
+        ctx.out << "add $3, $3, $5" << endl;
+        ctx.out << "sw $3, 4($7)" << endl;
+    }
+
+    pop(ctx.out, "$2");
+    pop(ctx.out, "$31");
+    ctx.out << "; END OF INITHEAP" << endl;
+}
 
-    cout << "sub $30, $30, $4" << endl;
+// Built-in allocator (--inline-alloc)
+// Every block has a one word header just below the pointer we hand out.
+// A header of 1..ALLOC_SMALL_MAX is the block's size in words: the block came from the bump arena
+// and goes back on allocFreeLists[size] when deleted (the first word of a free block links to the next one).
+// A header of 0 means the block came from the library new and must be given back with the library delete.
+
+// Allocates $3 words. Result in $3 (NULL on failure). Clobbers $5, $6, $7
+void generateInlineNew(CodegenContext& ctx) {
+    int currentLabelCounterValue = ctx.labelCounter;
+    ctx.labelCounter++;
+    ctx.out << "; Inline new" << endl;
+
+    // 1 <= $3 <= ALLOC_SMALL_MAX  <=>  ($3 - 1) <u ALLOC_SMALL_MAX
+    ctx.out << "sub $6, $3, $11" << endl;
+    ctx.out << "lis $7" << endl;
+    ctx.out << ".word " << ALLOC_SMALL_MAX << endl;
+    ctx.out << "sltu $7, $6, $7" << endl;
+    ctx.out << "beq $7, $0, allocSlow" << currentLabelCounterValue << ctx.procedureName << endl;
+
+    // Pop a block off the free list for this size
+    ctx.out << "mult $3, $4" << endl;
+    ctx.out << "mflo $6" << endl;  // $6 = 4 * size
+    ctx.out << "lis $7" << endl;
+    ctx.out << ".word allocFreeLists" << endl;
+    ctx.out << "add $7, $7, $6" << endl;  // $7 = &allocFreeLists[size]
+    ctx.out << "lw $5, 0($7)" << endl;
+    ctx.out << "beq $5, $0, allocBump" << currentLabelCounterValue << ctx.procedureName << endl;
+    ctx.out << "lw $6, 0($5)" << endl;
+    ctx.out << "sw $6, 0($7)" << endl;
+    ctx.out << "add $3, $5, $0" << endl;
+    ctx.out << "beq $0, $0, allocDone" << currentLabelCounterValue << ctx.procedureName << endl;
+
+    // Free list is empty, bump allocate header + size words from the arena
+    ctx.out << "allocBump" << currentLabelCounterValue << ctx.procedureName << ":" << endl;
+    ctx.out << "lis $7" << endl;
+    ctx.out << ".word allocBumpPtr" << endl;
+    ctx.out << "lw $5, 0($7)" << endl;    // $5 = header of the new block
+    ctx.out << "add $6, $6, $4" << endl;  // $6 = 4 * size + 4
+    ctx.out << "add $6, $5, $6" << endl;  // $6 = new bump pointer
+    ctx.out << "lw $7, 4($7)" << endl;    // allocArenaEnd
+    ctx.out << "sltu $7, $7, $6" << endl;
+    ctx.out << "bne $7, $0, allocSlow" << currentLabelCounterValue << ctx.procedureName << endl;
+    ctx.out << "lis $7" << endl;
+    ctx.out << ".word allocBumpPtr" << endl;
+    ctx.out << "sw $6, 0($7)" << endl;
+    ctx.out << "sw $3, 0($5)" << endl;  // header = size
+    ctx.out << "add $3, $5, $4" << endl;
+    ctx.out << "beq $0, $0, allocDone" << currentLabelCounterValue << ctx.procedureName << endl;
+
+    // Large (or non-positive) sizes and arena exhaustion go to the library
+    ctx.out << "allocSlow" << currentLabelCounterValue << ctx.procedureName << ":" << endl;
+    ctx.out << "slt $5, $0, $3" << endl;
+    ctx.out << "beq $5, $0, allocFail" << currentLabelCounterValue << ctx.procedureName << endl;
+    push(ctx.out, "$1");
+    ctx.out << "add $1, $3, $11" << endl;  // one extra word for the header
+    push(ctx.out, "$31");
+    ctx.out << "lis $5" << endl;
+    ctx.out << ".word new" << endl;
+    ctx.out << "jalr $5" << endl;
+    pop(ctx.out, "$31");
+    pop(ctx.out, "$1");
+    ctx.out << "beq $3, $0, allocFail" << currentLabelCounterValue << ctx.procedureName << endl;
+    ctx.out << "sw $0, 0($3)" << endl;  // header = 0: library block
+    ctx.out << "add $3, $3, $4" << endl;
+    ctx.out << "beq $0, $0, allocDone" << currentLabelCounterValue << ctx.procedureName << endl;
+    ctx.out << "allocFail" << currentLabelCounterValue << ctx.procedureName << ":" << endl;
+    ctx.out << "add $3, $11, $0" << endl;
+    ctx.out << "allocDone" << currentLabelCounterValue << ctx.procedureName << ":" << endl;
 }
 
-void pop(string registerX) {
-    cout << "add $30, $30, $4 ; pop(" << registerX << ")" << endl;
-    cout << "lw " << registerX << ", -4($30)" << endl;
+// Frees the (non NULL) block in $3. Continues at skipDelete<numDeletes>. Clobbers $5, $6, $7
+void generateInlineDelete(CodegenContext& ctx) {
+    int currentLabelCounterValue = ctx.labelCounter;
+    ctx.labelCounter++;
+    ctx.out << "; Inline delete" << endl;
+    ctx.out << "lw $5, -4($3)" << endl;  // header
+    ctx.out << "beq $5, $0, allocFree" << currentLabelCounterValue << ctx.procedureName << endl;
+
+    // Push the block onto the free list for its size
+    ctx.out << "mult $5, $4" << endl;
+    ctx.out << "mflo $6" << endl;
+    ctx.out << "lis $7" << endl;
+    ctx.out << ".word allocFreeLists" << endl;
+    ctx.out << "add $7, $7, $6" << endl;
+    ctx.out << "lw $6, 0($7)" << endl;
+    ctx.out << "sw $6, 0($3)" << endl;
+    ctx.out << "sw $3, 0($7)" << endl;
+    ctx.out << "beq $0, $0, skipDelete" << ctx.numDeletes << ctx.procedureName << endl;
+
+    // Library block. Hand back the address the library gave us
+    ctx.out << "allocFree" << currentLabelCounterValue << ctx.procedureName << ":" << endl;
+    push(ctx.out, "$1");
+    ctx.out << "sub $1, $3, $4" << endl;
+    push(ctx.out, "$31");
+    ctx.out << "lis $5" << endl;
+    ctx.out << ".word delete" << endl;
+    ctx.out << "jalr $5" << endl;
+    pop(ctx.out, "$31");
+    pop(ctx.out, "$1");
 }
 
-void generatePrologue() {
-    cout << ".import print" << endl;
-    cout << ".import init" << endl;
-    cout << ".import new" << endl;
-    cout << ".import delete" << endl;
-    cout << "lis $4" << endl;
-    cout << ".word 4" << endl;
-    cout << "sub $29, $30, $4 ; setup frame pointer" << endl;
+// printInt (--inline-print)
+// Prints $3 as a signed decimal followed by a newline. Called with jalr $10.
+// Only clobbers $3, $5, $6, $7, hi and lo, so callers don't need to save anything but $31.
+// Digits are produced two at a time from printIntDigits and buffered below $30 (the stack pointer is never moved).
+void generatePrintRoutine(ostream& out) {
+    out << "; START OF PRINTINT" << endl;
+    out << "printInt:" << endl;
+    out << "slt $6, $3, $0" << endl;
+    out << "beq $6, $0, printIntAbs" << endl;
+    out << "lis $5" << endl;
+    out << ".word 0xffff000c" << endl;
+    out << "lis $6" << endl;
+    out << ".word 45" << endl;  // '-'
+    out << "sw $6, 0($5)" << endl;
+    out << "sub $3, $0, $3" << endl;  // -2^31 stays 0x80000000, which is right when treated as unsigned below
+    out << "printIntAbs:" << endl;
+    out << "add $7, $30, $0" << endl;  // $7 = digit buffer cursor, grows down
+
+    // Peel off two digits per iteration while $3 >= 100
+    out << "printIntPair:" << endl;
+    out << "lis $5" << endl;
+    out << ".word 100" << endl;
+    out << "sltu $6, $3, $5" << endl;
+    out << "bne $6, $0, printIntLast" << endl;
+    out << "divu $3, $5" << endl;
+    out << "mflo $3" << endl;
+    out << "mfhi $6" << endl;
+    out << "mult $6, $4" << endl;
+    out << "mflo $6" << endl;
+    out << "add $6, $6, $6" << endl;  // 8 bytes per table entry
+    out << "lis $5" << endl;
+    out << ".word printIntDigits" << endl;
+    out << "add $5, $5, $6" << endl;
+    out << "lw $6, 4($5)" << endl;
+    out << "sw $6, -4($7)" << endl;
+    out << "lw $6, 0($5)" << endl;
+    out << "sw $6, -8($7)" << endl;
+    out << "sub $7, $7, $4" << endl;
+    out << "sub $7, $7, $4" << endl;
+    out << "beq $0, $0, printIntPair" << endl;
+
+    // Leading one or two digits
+    out << "printIntLast:" << endl;
+    out << "mult $3, $4" << endl;
+    out << "mflo $6" << endl;
+    out << "add $6, $6, $6" << endl;
+    out << "lis $5" << endl;
+    out << ".word printIntDigits" << endl;
+    out << "add $5, $5, $6" << endl;
+    out << "lw $6, 4($5)" << endl;
+    out << "sw $6, -4($7)" << endl;
+    out << "sub $7, $7, $4" << endl;
+    out << "lis $6" << endl;
+    out << ".word 10" << endl;
+    out << "slt $6, $3, $6" << endl;
+    out << "bne $6, $0, printIntOut" << endl;
+    out << "lw $6, 0($5)" << endl;
+    out << "sw $6, -4($7)" << endl;
+    out << "sub $7, $7, $4" << endl;
+
+    // Write the buffered digits to the output word
+    out << "printIntOut:" << endl;
+    out << "lis $5" << endl;
+    out << ".word 0xffff000c" << endl;
+    out << "printIntEmit:" << endl;
+    out << "beq $7, $30, printIntEnd" << endl;
+    out << "lw $6, 0($7)" << endl;
+    out << "sw $6, 0($5)" << endl;
+    out << "add $7, $7, $4" << endl;
+    out << "beq $0, $0, printIntEmit" << endl;
+    out << "printIntEnd:" << endl;
+    out << "lis $6" << endl;
+    out << ".word 10" << endl;  // '\n'
+    out << "sw $6, 0($5)" << endl;
+    out << "jr $31" << endl;
+
+    // printIntDigits[k] = the two ASCII digits of k (tens, ones) for k = 0..99
+    out << "printIntDigits:" << endl;
+    for (int k = 0; k < 100; k++) {
+        out << ".word " << '0' + k / 10 << endl;
+        out << ".word " << '0' + k % 10 << endl;
+    }
+    out << "; END OF PRINTINT" << endl;
+}
 
-    if (inDereferencedVars(wainParam1Name)) {
-        push("$1");
+// Emitted after the epilogue so it is never executed
+void generateAllocatorData(ostream& out) {
+    out << "; BUILT-IN ALLOCATOR DATA" << endl;
+    out << "allocBumpPtr: .word 0" << endl;
+    out << "allocArenaEnd: .word 0" << endl;  // must directly follow allocBumpPtr
+    // allocFreeLists[size] for size 0..ALLOC_SMALL_MAX (slot 0 is unused)
+    out << "allocFreeLists:" << endl;
+    for (int i = 0; i <= ALLOC_SMALL_MAX; i++) {
+        out << ".word 0" << endl;
     }
-    if (inDereferencedVars(wainParam2Name)) {
-        push("$2");
-    }
-
-    cout << "lis $11" << endl;
-    cout << ".word 1" << endl;
-    cout << "lis $10" << endl;
-    cout << ".word print" << endl;
-    cout << "beq $0, $0, wain" << endl;
-    cout << "; END OF PROLOGUE" << endl;
 }
 
-void generateEpilogue() {
-    cout << "; START OF EPILOGUE" << endl;
-    if (inDereferencedVars(wainParam2Name)) {
-        pop("$2");
-    }
-    if (inDereferencedVars(wainParam1Name)) {
-        pop("$1");
+// Division by constants
+// div takes far longer than mult (see mips-sim --counts), so x / d and x % d for a constant d multiply by a
+// "magic" reciprocal instead and keep the high word of the product. There are no shift instructions, so a
+// shift right by s is one more multiplication by 2^(32 - s), keeping the high word again.
+
+// Finds M and s with x / d == ((x * M) >> (32 + s)) + (x < 0) for every 32-bit x, where d >= 2 and s is 0 or
+// at least 2 (shifting by one would need a multiplier of 2^31, which doesn't fit an int). M can be as large as
+// 2^32 - 1; the caller adds x back when M doesn't fit an int. Returns false if there are no such M and s
+bool divisionMagic(uint32_t d, uint32_t& magic, int& shift) {
+    for (shift = 0; shift < 32; shift++) {
+        if (shift == 1) {
+            continue;
+        }
+        unsigned __int128 power = (unsigned __int128)1 << (32 + shift);
+        unsigned __int128 m = power / d + 1;
+        if (m >> 32) {
+            return false;
+        }
+        // The error m * d - 2^(32 + s) is small enough that it never reaches the next multiple of d
+        if (m * d - power <= ((unsigned __int128)1 << (shift + 1))) {
+            magic = (uint32_t)m;
+            return true;
+        }
     }
-    cout << "jr $31" << endl;
+    return false;
 }
 
-void initHeap(ParseTreeNode* dcl1) {
-    cout << "; START OF INITHEAP" << endl;
+// Whether x / divisor and x % divisor are generated without div
+bool lowersDivision(int32_t divisor) {
+    if (optimizationLevel == 0 || divisor == INT32_MIN || abs(divisor) < 2) {
+        return false;
+    }
+    uint32_t d = abs(divisor);
+    uint32_t magic;
+    int shift;
+    return (d & (d - 1)) == 0 || divisionMagic(d, magic, shift);
+}
 
-    push("$31");
-    push("$2");
+// $3 = x / divisor (or x % divisor) for x in the register dividend, which is left alone.
+// Only for divisors lowersDivision accepts. Clobbers $5, $6, $7, hi and lo
+void generateConstantDivision(CodegenContext& ctx, const string& dividend, int32_t divisor, bool remainder) {
+    uint32_t d = abs(divisor);
+    // Where the quotient ends up: straight in $3, unless the remainder still needs it
+    string quotient = remainder || divisor < 0 ? "$5" : "$3";
+    ctx.out << "; " << dividend << (remainder ? " % " : " / ") << divisor << endl;
+
+    int power = 0;
+    while ((1u << power) < d) {
+        power++;
+    }
+    // 2 has a magic number with no shift, which is shorter
+    if ((1u << power) == d && power >= 2) {
+        // hi is x >> power, rounded down; lo is nonzero if anything was shifted out. A negative x that wasn't a
+        // multiple of d rounds toward zero instead, so add one for it
+        ctx.out << "lis $6" << endl;
+        ctx.out << ".word " << (1u << (32 - power)) << endl;
+        ctx.out << "mult " << dividend << ", $6" << endl;
+        ctx.out << "mfhi $5" << endl;
+        ctx.out << "mflo $6" << endl;
+        ctx.out << "sltu $6, $0, $6" << endl;  // $6 = inexact
+        ctx.out << "slt $7, " << dividend << ", $0" << endl;  // $7 = negative
+        ctx.out << "add $6, $6, $7" << endl;
+        ctx.out << "slt $6, $11, $6" << endl;  // $6 = both
+        ctx.out << "add " << quotient << ", $5, $6" << endl;
+    } else {
+        uint32_t magic;
+        int shift;
+        divisionMagic(d, magic, shift);
+        ctx.out << "lis $6" << endl;
+        ctx.out << ".word " << (int32_t)magic << endl;
+        ctx.out << "mult " << dividend << ", $6" << endl;
+        ctx.out << "mfhi $5" << endl;
+        if (magic > INT32_MAX) {
+            // mult saw M - 2^32, so the high word came out x short
+            ctx.out << "add $5, $5, " << dividend << endl;
+        }
+        if (shift > 0) {
+            ctx.out << "lis $6" << endl;
+            ctx.out << ".word " << (1u << (32 - shift)) << endl;
+            ctx.out << "mult $5, $6" << endl;
+            ctx.out << "mfhi $5" << endl;
+        }
+        ctx.out << "slt $6, " << dividend << ", $0" << endl;
+        ctx.out << "add " << quotient << ", $5, $6" << endl;
+    }
 
-    // Check if we were called with mips.twoints
-    // dcl -> type ID
-    // get type of ID
-    if (dcl1->children[1]->type == "int") {  // called with mips.twoints
-        cout << "add $2, $0, $0" << endl;    // $2 = 0
+    if (remainder) {
+        // x % d has the sign of x whatever the sign of d, so the quotient by |d| gives it: x - (x / |d|) * |d|
+        ctx.out << "lis $6" << endl;
+        ctx.out << ".word " << d << endl;
+        ctx.out << "mult $5, $6" << endl;
+        ctx.out << "mflo $5" << endl;
+        ctx.out << "sub $3, " << dividend << ", $5" << endl;
+    } else if (divisor < 0) {
+        ctx.out << "sub $3, $0, $5" << endl;
     }
+}
 
-    // Call init
-    cout << "lis $3" << endl;
-    cout << ".word init" << endl;
-    cout << "jalr $3" << endl;
-    pop("$2");
-    pop("$31");
-    cout << "; END OF INITHEAP" << endl;
+// $3 = $3 / 4, turning the byte difference of two pointers into words
+void generateWordsBetween(CodegenContext& ctx) {
+    if (lowersDivision(4)) {
+        generateConstantDivision(ctx, "$3", 4, false);
+    } else {
+        ctx.out << "div $3, $4" << endl;
+        ctx.out << "mflo $3" << endl;
+    }
 }
 
-void generateLabel(string label) {
-    cout << label << to_string(labelCounter) << ":" << endl;
-    labelCounter++;
+void generateLabel(CodegenContext& ctx, string label) {
+    ctx.out << label << to_string(ctx.labelCounter) << ctx.procedureName << ":" << endl;
+    ctx.labelCounter++;
 }
 
 string getVarNameFromLvalue(ParseTreeNode* node) {
@@ -753,26 +1776,38 @@ string getVarNameFromLvalue(ParseTreeNode* node) {
     return answer;
 }
 
-// Pushes the arguments in arglist in the rule factor -> ID LPAREN arglist RPAREN
-// Returns number of arguments pushed
-int pushArgs(ParseTreeNode* node) {
-    // arglist -> expr
-    if (node->prodRuleRHS.size() == 1) {
-        code(node->children[0]);  // code(expr)
-        push("$3");
-        return 1;
+// Lists the arguments in arglist in the rule factor -> ID LPAREN arglist RPAREN, first to last
+vector<ParseTreeNode*> getArgs(ParseTreeNode* node) {
+    vector<ParseTreeNode*> args;
+    while (true) {
+        args.push_back(node->children[0]);  // expr
+        // arglist -> expr
+        if (node->prodRuleRHS.size() == 1) {
+            return args;
+        }
+        // arglist -> expr COMMA arglist
+        node = node->children[2];
     }
-    // arglist -> expr COMMA arglist
-    else {
-        code(node->children[0]);  // code(expr)
-        push("$3");
-        return 1 + pushArgs(node->children[2]);
+}
+
+// $30 = $30 + bytes. Takes one add or sub for up to two words and a constant in scratch past that
+void moveStackPointer(CodegenContext& ctx, int bytes, string scratch) {
+    string op = bytes < 0 ? "sub" : "add";
+    int words = abs(bytes) / 4;
+    if (words <= 2) {
+        for (int i = 0; i < words; i++) {
+            ctx.out << op << " $30, $30, $4" << endl;
+        }
+        return;
     }
+    ctx.out << "lis " << scratch << endl;
+    ctx.out << ".word " << abs(bytes) << endl;
+    ctx.out << op << " $30, $30, " << scratch << endl;
 }
 
 // Increments all offets in the symbol table by value inc. Used for procedure calls
-void incrementSymbolTable(int inc) {
-    for (auto& entry : symbol_table) {
+void incrementSymbolTable(CodegenContext& ctx, int inc) {
+    for (auto& entry : ctx.symbol_table) {
         // Extract current offset as an integer
         int offset = stoi(entry.second.second);
         // Increment the offset
@@ -807,195 +1842,188 @@ int getNumParams(ParseTreeNode* node) {
     }
 }
 
-// Used to push all registers in procedures
-void pushAllRegisters() {
-    push("$5");
-    push("$6");
-    push("$7");
+// Stores reg in the next slot of the frame, at a fixed offset from $29. The slots are only claimed
+// once the whole frame is laid out, by allocateFrame
+int storeInFrame(CodegenContext& ctx, string reg) {
+    int offset = ctx.latestOffset;
+    ctx.out << "sw " << reg << ", " << offset << "($29)" << endl;
+    ctx.latestOffset -= 4;
+    return offset;
 }
 
-// Used to pop all registers in procedures
-void popAllRegisters() {
-    pop("$7");
-    pop("$6");
-    pop("$5");
+// Moves $30 past every slot handed out so far, in one step
+void allocateFrame(CodegenContext& ctx) {
+    int bottom = ctx.latestOffset + 4;  // the last slot
+    ctx.out << "; Frame takes " << -bottom + 4 << " bytes" << endl;
+    if (bottom == 4) {
+        ctx.out << "add $30, $29, $4" << endl;
+    } else if (bottom == 0) {
+        ctx.out << "add $30, $29, $0" << endl;
+    } else if (bottom == -4) {
+        ctx.out << "sub $30, $29, $4" << endl;
+    } else {
+        ctx.out << "lis $3" << endl;
+        ctx.out << ".word " << bottom << endl;
+        ctx.out << "add $30, $29, $3" << endl;
+    }
+}
+
+// Procedures share registers with their callers, so before a procedure's local takes a register
+// the caller's value is stored in the next frame slot. The procedure restores it from there on exit
+void saveCallerRegister(CodegenContext& ctx, string reg) {
+    if (ctx.procedureName == "wain") {  // nothing calls wain
+        return;
+    }
+    ctx.savedRegisters.emplace_back(reg, storeInFrame(ctx, reg));
 }
 
-void code(ParseTreeNode* node) {
+void code(CodegenContext& ctx, ParseTreeNode* node) {
     // start -> BOF procedures EOF
     if (node->prodRuleLHS == "start") {
         // Codegen procedures
-        code(node->children[1]);
+        code(ctx, node->children[1]);
     }
     // procedures → main
     else if (node->prodRuleLHS == "procedures" && node->prodRuleRHS[0] == "main") {
         // Codegen main
-        code(node->children[0]);
+        code(ctx, node->children[0]);
     }
     // procedures -> procedure procedures
     else if (node->prodRuleLHS == "procedures" && node->prodRuleRHS[0] == "procedure") {
         // codegen procedure and procedures
-        code(node->children[0]);
-        code(node->children[1]);
+        code(ctx, node->children[0]);
+        code(ctx, node->children[1]);
     }
     // procedure → INT ID LPAREN params RPAREN LBRACE dcls statements RETURN expr SEMI RBRACE
     else if (node->prodRuleLHS == "procedure") {
-        cout << "; Symbol table cleared" << endl;
-        symbol_table.clear();
+        ctx.out << "; Symbol table cleared" << endl;
+        ctx.symbol_table.clear();
         // clearRegTable();
-        latestOffset = 0;
-        cout << "F" << node->children[1]->token.lexeme << ":" << endl;  // prepend ID with F
-        cout << "sub $29, $30, $4" << endl;
-        code(node->children[3]);  // code(params)
-        code(node->children[6]);  // code(dcls)
-        cout << "; Push All Registers" << endl;
-        pushAllRegisters();
-
-        printSymbolTable();
-
-        // params
+        ctx.latestOffset = 0;
+        ctx.out << "F" << node->children[1]->token.lexeme << ":" << endl;  // prepend ID with F
+        ctx.out << "sub $29, $30, $4" << endl;
+        countProfileEvent(ctx, 0);
+        countInstrumentEvent(ctx, "F" + ctx.procedureName);
+        code(ctx, node->children[3]);  // code(params)
+
+        // The caller stored the arguments just above our frame, so the first slot of our own is 0($29)
         int numParams = getNumParams(node->children[3]);
-        incrementSymbolTable(4 * numParams);
+        incrementSymbolTable(ctx, 4 * numParams);
+        ctx.latestOffset += 4 * numParams;
 
-        cout << "; Add 4 * # params to symbol table???" << endl;
-        printSymbolTable();
-
-        code(node->children[7]);  // code(stmts)
-        code(node->children[9]);  // code(expr)
-        cout << "; Pop All Registers" << endl;
-        popAllRegisters();
-        cout << "add $30, $29, $4" << endl;
+        code(ctx, node->children[6]);  // code(dcls)
+        ctx.out << "; Save $5, $6 and $7" << endl;
+        for (string reg : {"$5", "$6", "$7"}) {
+            ctx.savedRegisters.emplace_back(reg, storeInFrame(ctx, reg));
+        }
+        allocateFrame(ctx);
+        printSymbolTable(ctx);
 
-        // for (int i = 0; i < numInits; i++) {
-        //     cout << "add $30, $30, $4 ; resetting stack)" << endl;
-        // }
+        code(ctx, node->children[7]);  // code(stmts)
+        code(ctx, node->children[9]);  // code(expr)
 
-        cout << "jr $31" << endl;
+        // Give the caller back $5, $6, $7 and the registers our locals took, then drop the whole frame
+        for (const auto& saved : ctx.savedRegisters) {
+            ctx.out << "lw " << saved.first << ", " << saved.second << "($29)" << endl;
+        }
+        ctx.out << "add $30, $29, $4" << endl;
+        ctx.out << "jr $31" << endl;
     }
     // main -> INT WAIN LPAREN dcl COMMA dcl RPAREN LBRACE dcls statements RETURN expr SEMI RBRACE
     else if (node->prodRuleLHS == "main") {
-        symbol_table.clear();
+        ctx.symbol_table.clear();
         // clearRegTable();
-        latestOffset = 0;
+        ctx.latestOffset = 0;
         // print label for wain
-        cout << "wain:" << endl;
+        ctx.out << "wain:" << endl;
+        countProfileEvent(ctx, 0);
+        countInstrumentEvent(ctx, "wain");
 
         // check if dereferenced. If not, add to regTable. Else, add to symbol_table (codegen)
 
-        if (!inDereferencedVars(node->children[3]->children[1]->token.lexeme)) {
+        if (!inDereferencedVars(ctx, node->children[3]->children[1]->token.lexeme)) {
             // Add register to regTable
             string reg = "$1";
-            regTable[node->children[3]->children[1]->token.lexeme] = reg;
-            cout << "; Variable " << node->children[3]->children[1]->token.lexeme << " assigned to register "
+            ctx.regTable[node->children[3]->children[1]->token.lexeme] = reg;
+            ctx.out << "; Variable " << node->children[3]->children[1]->token.lexeme << " assigned to register "
                  << "$1" << endl;
         } else {
             // code dcl1
-            code(node->children[3]);
+            code(ctx, node->children[3]);
         }
 
-        if (!inDereferencedVars(node->children[5]->children[1]->token.lexeme)) {
+        if (!inDereferencedVars(ctx, node->children[5]->children[1]->token.lexeme)) {
             // Add register to regTable
             string reg = "$2";
-            regTable[node->children[5]->children[1]->token.lexeme] = reg;
-            cout << "; Variable " << node->children[5]->children[1]->token.lexeme << " assigned to register "
+            ctx.regTable[node->children[5]->children[1]->token.lexeme] = reg;
+            ctx.out << "; Variable " << node->children[5]->children[1]->token.lexeme << " assigned to register "
                  << "$2" << endl;
         } else {
             // code dcl2
-            code(node->children[5]);
+            code(ctx, node->children[5]);
         }
 
         // initHeap(dcl1);
-        initHeap(node->children[3]);
-        // code dcls
-        code(node->children[8]);
+        initHeap(ctx, node->children[3]);
+        // code dcls. The prologue already pushed the parameters' slots, so $30 only moves for stack locals
+        int paramsOffset = ctx.latestOffset;
+        code(ctx, node->children[8]);
+        if (ctx.latestOffset != paramsOffset) {
+            allocateFrame(ctx);
+        }
         // code stmts
-        code(node->children[9]);
+        code(ctx, node->children[9]);
         // code expr for return expression
-        code(node->children[11]);
+        code(ctx, node->children[11]);
     }
     // params → paramlist
     else if (node->prodRuleLHS == "params" && node->prodRuleRHS[0] == "paramlist") {
-        code(node->children[0]);
+        code(ctx, node->children[0]);
     }
 
     // paramlist → dcl
     // paramlist → dcl COMMA paramlist
     else if (node->prodRuleLHS == "paramlist") {
-        code(node->children[0]);  // code dcl
+        code(ctx, node->children[0]);  // code dcl
         // paramlist -> dcl COMMA paramlist
         if (node->prodRuleRHS.size() == 3) {
-            code(node->children[2]);  // code paramlist
+            code(ctx, node->children[2]);  // code paramlist
         }
     }
 
     // dcls -> dcls dcl BECOMES NUM SEMI
-    else if (node->prodRuleLHS == "dcls" && node->prodRuleRHS.size() == 5 && node->prodRuleRHS[3] == "NUM") {
-        // code for dcls
-        code(node->children[0]);
-
-        // get the value of NUM and assign it to the variable in dcl
-        string numValue = node->children[3]->token.lexeme;
-        string variableName = node->children[1]->children[1]->token.lexeme;  // Get variable name of dcl
-
-        // Check if there is space in regTable.
-        // If there is, put it in regTable (registers).
-        // Otherwise, put it on symbolTable (stack)
-
-        // Check if we have free registers and the variable is not dereferenced
-        if (freeRegisters.size() != 0 && !inDereferencedVars(variableName)) {
-            // Add register to regTable
-            string reg = freeRegisters.back();
-            regTable[variableName] = reg;
-            freeRegisters.pop_back();
-
-            cout << "; Variable " << variableName << " assigned to register " << reg << endl;
-
-            cout << "lis " << reg << endl;
-            cout << ".word " << numValue << endl;
-
-        } else {  // no free registers, use conventional method
-            // code for dcl
-            code(node->children[1]);  // Adds variable to symbol table
-
-            string offset = symbol_table[variableName].second;
-
-            cout << "lis $3" << endl;
-            cout << ".word " << numValue << endl;
-            push("$3");
-        }
-    }
-
     // dcls -> dcls dcl BECOMES NULL SEMI
-    else if (node->prodRuleLHS == "dcls" && node->prodRuleRHS.size() == 5 && node->prodRuleRHS[3] == "NULL") {
-        // code for dcls
-        code(node->children[0]);
-
-        string variableName = node->children[1]->children[1]->token.lexeme;  // Get variable name of dcl
-
-        // Check if there is space in regTable.
-        // If there is, put it in regTable (registers).
-        // Otherwise, put it on symbolTable (stack)
-
-        // Check if we have free registers and the variable is not dereferenced
-        if (freeRegisters.size() != 0 && !inDereferencedVars(variableName)) {
-            // Add register to regTable
-            string reg = freeRegisters.back();
-            regTable[variableName] = reg;
-            freeRegisters.pop_back();
-
-            cout << "; Variable " << variableName << " assigned to register " << reg << endl;
-
-            cout << "lis " << reg << endl;
-            cout << ".word 1" << endl;
-        } else {  // no free registers, use conventional method
-            // code for dcl
-            code(node->children[1]);  // Adds variable to symbol table
-
-            string offset = symbol_table[variableName].second;
-
-            cout << "lis $3" << endl;
-            cout << ".word 1" << endl;
-            push("$3");
+    else if (node->prodRuleLHS == "dcls" && node->prodRuleRHS.size() == 5) {
+        // Loop over the whole declaration list instead of recursing into dcls
+        for (ParseTreeNode* dcls : flattenLeftChain(node)) {
+            // get the value of NUM (NULL is 1) and assign it to the variable in dcl
+            string value = dcls->prodRuleRHS[3] == "NUM" ? dcls->children[3]->token.lexeme : "1";
+            string variableName = dcls->children[1]->children[1]->token.lexeme;  // Get variable name of dcl
+
+            // Check if there is space in regTable.
+            // If there is, put it in regTable (registers).
+            // Otherwise, put it on symbolTable (stack)
+
+            // Only the most used locals get free registers, and never dereferenced ones
+            if (ctx.freeRegisters.size() != 0 && ctx.registerVariables.count(variableName)) {
+                // Add register to regTable
+                string reg = ctx.freeRegisters.back();
+                ctx.regTable[variableName] = reg;
+                ctx.freeRegisters.pop_back();
+
+                ctx.out << "; Variable " << variableName << " assigned to register " << reg << endl;
+                saveCallerRegister(ctx, reg);
+
+                ctx.out << "lis " << reg << endl;
+                ctx.out << ".word " << value << endl;
+            } else {  // no free registers, use conventional method
+                // code for dcl
+                code(ctx, dcls->children[1]);  // Adds variable to symbol table
+
+                ctx.out << "lis $3" << endl;
+                ctx.out << ".word " << value << endl;
+                ctx.out << "sw $3, " << ctx.symbol_table[variableName].second << "($29)" << endl;
+            }
         }
     }
 
@@ -1015,15 +2043,17 @@ void code(ParseTreeNode* node) {
             variableType = "int";
         }
         // Add variable to the symbol table
-        cout << "; Variable " << variableName << " added to symbol table with offset " << latestOffset << endl;
-        symbol_table[variableName] = make_pair(variableType, to_string(latestOffset));
-        latestOffset -= 4;
+        ctx.out << "; Variable " << variableName << " added to symbol table with offset " << ctx.latestOffset << endl;
+        ctx.symbol_table[variableName] = make_pair(variableType, to_string(ctx.latestOffset));
+        ctx.latestOffset -= 4;
     }
 
     // statements → statements statement
     else if (node->prodRuleLHS == "statements" && node->prodRuleRHS[0] == "statements") {
-        code(node->children[0]);
-        code(node->children[1]);
+        // Loop over the whole statement list instead of recursing into statements
+        for (ParseTreeNode* statements : flattenLeftChain(node)) {
+            code(ctx, statements->children[1]);
+        }
     }
     // statement → lvalue BECOMES expr SEMI
     else if (node->prodRuleLHS == "statement" && node->prodRuleRHS[0] == "lvalue") {
@@ -1037,43 +2067,43 @@ void code(ParseTreeNode* node) {
                 // lvalue -> ID
                 if (node->prodRuleRHS[0] == "ID") {
                     // code(expr)
-                    code(expr);
+                    code(ctx, expr);
                     string varName = node->children[0]->token.lexeme;
 
                     // check if variable is in register or symbol_table
-                    if (regTable.find(varName) != regTable.end()) {  // in regTable
-                        cout << "add " << regTable.find(varName)->second << ", $0, $3" << endl;
+                    if (ctx.regTable.find(varName) != ctx.regTable.end()) {  // in regTable
+                        ctx.out << "add " << ctx.regTable.find(varName)->second << ", $0, $3" << endl;
                     } else {
-                        cout << "sw $3, " << symbol_table[varName].second << "($29)" << endl;
+                        ctx.out << "sw $3, " << ctx.symbol_table[varName].second << "($29)" << endl;
                     }
                 }
                 // lvalue -> STAR factor
                 else if (node->prodRuleRHS.size() == 2) {
-                    string exprReg = resolveToID(expr);
-                    string factorReg = resolveToID(node->children[1]);
+                    string exprReg = resolveToID(ctx, expr);
+                    string factorReg = resolveToID(ctx, node->children[1]);
 
                     // if not in register. Load code like normal
                     if (exprReg == "" && factorReg == "") {
                         // code(expr)
-                        code(expr);
-                        push("$3");
+                        code(ctx, expr);
+                        push(ctx.out, "$3");
                         // code(factor)
-                        code(node->children[1]);
-                        pop("$5");
+                        code(ctx, node->children[1]);
+                        pop(ctx.out, "$5");
 
                         exprReg = "$5";
                         factorReg = "$3";
                     } else if (factorReg == "") {
                         // code(factor)
-                        code(node->children[1]);
+                        code(ctx, node->children[1]);
                         factorReg = "$3";
                     } else if (exprReg == "") {
                         // code(expr)
-                        code(expr);
+                        code(ctx, expr);
                         exprReg = "$3";
                     }
 
-                    cout << "sw " << exprReg << ", 0(" << factorReg << ")" << endl;
+                    ctx.out << "sw " << exprReg << ", 0(" << factorReg << ")" << endl;
                 }
                 break;
             } else {  // lvalue -> LPAREN lvalue RPAREN
@@ -1084,288 +2114,363 @@ void code(ParseTreeNode* node) {
     }
     // statement → IF LPAREN test RPAREN LBRACE statements RBRACE ELSE LBRACE statements RBRACE
     else if (node->prodRuleLHS == "statement" && node->prodRuleRHS[0] == "IF") {
-        int currentLabelCounterValue = labelCounter;
-        labelCounter++;
-        cout << "; If" << endl;
-        code(node->children[2]);  // code(test)
-        cout << "beq $3, $0, else" << currentLabelCounterValue << endl;
-        code(node->children[5]);  // code(statements1)
-        cout << "beq $0, $0, endif" << currentLabelCounterValue << endl;
-        cout << "else" << currentLabelCounterValue << ":" << endl;
-        code(node->children[9]);  // code(statements2)
-        cout << "endif" << currentLabelCounterValue << ":" << endl;
+        int currentLabelCounterValue = ctx.labelCounter;
+        ctx.labelCounter++;
+        auto counter = ctx.profileCounters.find(node);
+        int thenCounter = counter != ctx.profileCounters.end() ? counter->second : -1;
+        ctx.out << "; If" << endl;
+
+        // Above -O0, only the arm that always runs is generated
+        bool always;
+        if (optimizationLevel > 0 && constantTest(node->children[2], always)) {
+            countProfileEvent(ctx, always ? thenCounter : thenCounter + 1);
+            code(ctx, node->children[always ? 5 : 9]);
+            return;
+        }
+
+        code(ctx, node->children[2]);  // code(test)
+
+        // The arm laid out second runs into endif without a jump. That's the else arm,
+        // unless the profile says the then arm runs more often
+        if (thenCounter >= 0 && profileCount(ctx, thenCounter) > profileCount(ctx, thenCounter + 1)) {
+            ctx.out << "bne $3, $0, then" << currentLabelCounterValue << ctx.procedureName << endl;
+            countProfileEvent(ctx, thenCounter + 1);
+            code(ctx, node->children[9]);  // code(statements2)
+            ctx.out << "beq $0, $0, endif" << currentLabelCounterValue << ctx.procedureName << endl;
+            ctx.out << "then" << currentLabelCounterValue << ctx.procedureName << ":" << endl;
+            countProfileEvent(ctx, thenCounter);
+            code(ctx, node->children[5]);  // code(statements1)
+            ctx.out << "endif" << currentLabelCounterValue << ctx.procedureName << ":" << endl;
+            return;
+        }
+
+        ctx.out << "beq $3, $0, else" << currentLabelCounterValue << ctx.procedureName << endl;
+        countProfileEvent(ctx, thenCounter);
+        code(ctx, node->children[5]);  // code(statements1)
+        ctx.out << "beq $0, $0, endif" << currentLabelCounterValue << ctx.procedureName << endl;
+        ctx.out << "else" << currentLabelCounterValue << ctx.procedureName << ":" << endl;
+        countProfileEvent(ctx, thenCounter + 1);
+        code(ctx, node->children[9]);  // code(statements2)
+        ctx.out << "endif" << currentLabelCounterValue << ctx.procedureName << ":" << endl;
     }
     // statement → WHILE LPAREN test RPAREN LBRACE statements RBRACE
     else if (node->prodRuleLHS == "statement" && node->prodRuleRHS[0] == "WHILE") {
-        int currentLabelCounterValue = labelCounter;
-        labelCounter++;
-        cout << "; While" << endl;
-        cout << "loop" << currentLabelCounterValue << ":" << endl;
-        code(node->children[2]);  // code(test)
-        cout << "beq $3, $0, endWhile" << currentLabelCounterValue << endl;
-        code(node->children[5]);  // code(statements)
-        cout << "beq $0, $0, loop" << currentLabelCounterValue << endl;
-        cout << "endWhile" << currentLabelCounterValue << ":" << endl;
+        int currentLabelCounterValue = ctx.labelCounter;
+        ctx.labelCounter++;
+        ctx.out << "; While" << endl;
+
+        // Above -O0, a loop that never runs is left out and one that never stops doesn't test
+        bool always;
+        bool constant = optimizationLevel > 0 && constantTest(node->children[2], always);
+        if (constant && !always) {
+            return;
+        }
+        string label = to_string(currentLabelCounterValue) + ctx.procedureName;
+        int bodyCounter = ctx.profileCounters.count(node) ? ctx.profileCounters[node] : -1;
+
+        // Tested at the bottom: one jump to the test on the way in, then one branch per iteration
+        if (!constant && optimizationLevel > 0) {
+            ctx.out << "beq $0, $0, loop" << label << endl;
+            ctx.out << "body" << label << ":" << endl;
+            countProfileEvent(ctx, bodyCounter);
+            code(ctx, node->children[5]);  // code(statements)
+            ctx.out << "loop" << label << ":" << endl;
+            countInstrumentEvent(ctx, "loop" + label);
+            code(ctx, node->children[2]);  // code(test)
+            ctx.out << "bne $3, $0, body" << label << endl;
+            return;
+        }
+
+        ctx.out << "loop" << label << ":" << endl;
+        countInstrumentEvent(ctx, "loop" + label);
+        if (!constant) {
+            code(ctx, node->children[2]);  // code(test)
+            ctx.out << "beq $3, $0, endWhile" << label << endl;
+        }
+        countProfileEvent(ctx, bodyCounter);
+        code(ctx, node->children[5]);  // code(statements)
+        ctx.out << "beq $0, $0, loop" << label << endl;
+        ctx.out << "endWhile" << label << ":" << endl;
     }
     // statement → PRINTLN LPAREN expr RPAREN SEMI
     else if (node->prodRuleLHS == "statement" && node->prodRuleRHS[0] == "PRINTLN") {
-        push("$1");
-        code(node->children[2]);  // code(expr)
-        cout << "add $1, $3, $0" << endl;
-        push("$31");
-        cout << "lis $5" << endl;
-        cout << ".word print" << endl;
-        cout << "jalr $5" << endl;
-        pop("$31");
-        pop("$1");
+        if (inlinePrint) {
+            code(ctx, node->children[2]);  // code(expr)
+            // printInt leaves $12 alone, so it can hold our return address for the call
+            ctx.out << "add $12, $31, $0" << endl;
+            ctx.out << "jalr $10" << endl;
+            ctx.out << "add $31, $12, $0" << endl;
+            return;
+        }
+        push(ctx.out, "$1");
+        code(ctx, node->children[2]);  // code(expr)
+        ctx.out << "add $1, $3, $0" << endl;
+        push(ctx.out, "$31");
+        ctx.out << "lis $5" << endl;
+        ctx.out << ".word print" << endl;
+        ctx.out << "jalr $5" << endl;
+        pop(ctx.out, "$31");
+        pop(ctx.out, "$1");
     }
     // statement → DELETE LBRACK RBRACK expr SEMI
     else if (node->prodRuleLHS == "statement" && node->prodRuleRHS[0] == "DELETE") {
         // code(expr)
-        code(node->children[3]);
-        push("$1");
-        cout << "beq $3, $11, skipDelete" << numDeletes << endl;
-        cout << "add $1, $3, $0" << endl;
-        push("$31");
-        cout << "lis $5" << endl;
-        cout << ".word delete" << endl;
-        cout << "jalr $5" << endl;
-        pop("$31");
-        pop("$1");
-        cout << "skipDelete" << numDeletes << ":" << endl;
-        numDeletes++;
+        code(ctx, node->children[3]);
+        if (inlineAllocator) {
+            ctx.out << "beq $3, $11, skipDelete" << ctx.numDeletes << ctx.procedureName << endl;
+            generateInlineDelete(ctx);
+        } else {
+            push(ctx.out, "$1");
+            ctx.out << "beq $3, $11, skipDelete" << ctx.numDeletes << ctx.procedureName << endl;
+            ctx.out << "add $1, $3, $0" << endl;
+            push(ctx.out, "$31");
+            ctx.out << "lis $5" << endl;
+            ctx.out << ".word delete" << endl;
+            ctx.out << "jalr $5" << endl;
+            pop(ctx.out, "$31");
+            pop(ctx.out, "$1");
+        }
+        ctx.out << "skipDelete" << ctx.numDeletes << ctx.procedureName << ":" << endl;
+        ctx.numDeletes++;
     }
     // expr -> term
     else if (node->prodRuleLHS == "expr" && node->prodRuleRHS[0] == "term") {
         // Check if term is a constant
         if (node->children[0]->children[0]->prodRuleRHS[0] == "NUM") {
-            cout << "lis $3" << endl;
-            cout << ".word " << node->children[0]->children[0]->children[0]->token.lexeme << endl;
+            ctx.out << "lis $3" << endl;
+            ctx.out << ".word " << node->children[0]->children[0]->children[0]->token.lexeme << endl;
             return;
         }
 
         // code(term);
-        code(node->children[0]);
+        code(ctx, node->children[0]);
     }
     // expr -> expr PLUS term
     // expr -> expr MINUS term
     else if (node->prodRuleLHS == "expr" && node->prodRuleRHS.size() == 3) {
         // if term and expr are both ints
         if (node->children[0]->type == "int" && node->children[2]->type == "int") {
-            string exprReg = resolveToID(node->children[0]);
-            string termReg = resolveToID(node->children[2]);
+            string exprReg = resolveToID(ctx, node->children[0]);
+            string termReg = resolveToID(ctx, node->children[2]);
 
             // if not in register. Load code like normal
             if (exprReg == "" && termReg == "") {
                 // code(expr)
-                code(node->children[0]);
-                push("$3");
+                code(ctx, node->children[0]);
+                push(ctx.out, "$3");
                 // code(term)
-                code(node->children[2]);
-                pop("$5");
+                code(ctx, node->children[2]);
+                pop(ctx.out, "$5");
 
                 // $3 = term, $5 = expr
                 exprReg = "$5";
                 termReg = "$3";
             } else if (termReg == "") {
                 // code(term)
-                code(node->children[2]);
+                code(ctx, node->children[2]);
                 termReg = "$3";
             } else if (exprReg == "") {
                 // code(factor)
-                code(node->children[0]);
+                code(ctx, node->children[0]);
                 exprReg = "$3";
             }
 
             // If PLUS
             if (node->prodRuleRHS[1] == "PLUS") {
                 // cout << "add $3, $5, $3" << endl;
-                cout << "add $3, " << exprReg << ", " << termReg << endl;
+                ctx.out << "add $3, " << exprReg << ", " << termReg << endl;
             } else {  // MINUS
                 // cout << "sub $3, $5, $3" << endl;
-                cout << "sub $3, " << exprReg << ", " << termReg << endl;
+                ctx.out << "sub $3, " << exprReg << ", " << termReg << endl;
             }
         }
 
         // expr -> expr PLUS term; expr : int* and term = int
         else if (node->prodRuleRHS[1] == "PLUS" && node->children[0]->type == "int*" && node->children[2]->type == "int") {
-            string exprReg = resolveToID(node->children[0]);
-            string termReg = resolveToID(node->children[2]);
+            string exprReg = resolveToID(ctx, node->children[0]);
+            string termReg = resolveToID(ctx, node->children[2]);
 
             // if not in register. Load code like normal
             if (exprReg == "" && termReg == "") {
-                code(node->children[0]);  // code(expr)
-                push("$3");
-                code(node->children[2]);  // code(term)
-                cout << "mult $3, $4" << endl;
-                cout << "mflo $3" << endl;
-                pop("$5");
-                cout << "add $3, $5, $3" << endl;
+                code(ctx, node->children[0]);  // code(expr)
+                push(ctx.out, "$3");
+                code(ctx, node->children[2]);  // code(term)
+                ctx.out << "mult $3, $4" << endl;
+                ctx.out << "mflo $3" << endl;
+                pop(ctx.out, "$5");
+                ctx.out << "add $3, $5, $3" << endl;
             } else if (termReg == "") {
-                code(node->children[2]);  // code(term)
-                cout << "mult $3, $4" << endl;
-                cout << "mflo $3" << endl;
-                cout << "add $3, " << exprReg << ", $3" << endl;
+                code(ctx, node->children[2]);  // code(term)
+                ctx.out << "mult $3, $4" << endl;
+                ctx.out << "mflo $3" << endl;
+                ctx.out << "add $3, " << exprReg << ", $3" << endl;
             } else if (exprReg == "") {
-                cout << "mult " << termReg << ", $4" << endl;
-                cout << "mflo $5" << endl;
-                code(node->children[0]);  // code(expr)
-                cout << "add $3, $5, $3" << endl;
+                ctx.out << "mult " << termReg << ", $4" << endl;
+                ctx.out << "mflo $5" << endl;
+                code(ctx, node->children[0]);  // code(expr)
+                ctx.out << "add $3, $5, $3" << endl;
             } else {  // BOTH in registers
-                cout << "mult " << termReg << ", $4" << endl;
-                cout << "mflo $3" << endl;
-                cout << "add $3, " << exprReg << ", $3" << endl;
+                ctx.out << "mult " << termReg << ", $4" << endl;
+                ctx.out << "mflo $3" << endl;
+                ctx.out << "add $3, " << exprReg << ", $3" << endl;
             }
         }
         // expr -> expr PLUS term; expr : int and term = int*
         else if (node->prodRuleRHS[1] == "PLUS" && node->children[0]->type == "int" && node->children[2]->type == "int*") {
-            string exprReg = resolveToID(node->children[0]);
-            string termReg = resolveToID(node->children[2]);
+            string exprReg = resolveToID(ctx, node->children[0]);
+            string termReg = resolveToID(ctx, node->children[2]);
 
             // if not in register. Load code like normal
             if (exprReg == "" && termReg == "") {
-                code(node->children[2]);  // code(term)
-                push("$3");
-                code(node->children[0]);  // code(expr)
-                cout << "mult $3, $4" << endl;
-                cout << "mflo $3" << endl;
-                pop("$5");
-                cout << "add $3, $5, $3" << endl;
+                code(ctx, node->children[2]);  // code(term)
+                push(ctx.out, "$3");
+                code(ctx, node->children[0]);  // code(expr)
+                ctx.out << "mult $3, $4" << endl;
+                ctx.out << "mflo $3" << endl;
+                pop(ctx.out, "$5");
+                ctx.out << "add $3, $5, $3" << endl;
             } else if (termReg == "") {
-                cout << "mult " << exprReg << ", $4" << endl;
-                cout << "mflo $5" << endl;
-                code(node->children[2]);  // code(term)
-                cout << "add $3, $5, $3" << endl;
+                ctx.out << "mult " << exprReg << ", $4" << endl;
+                ctx.out << "mflo $5" << endl;
+                code(ctx, node->children[2]);  // code(term)
+                ctx.out << "add $3, $5, $3" << endl;
             } else if (exprReg == "") {
-                code(node->children[0]);  // code(expr)
-                cout << "mult $3, $4" << endl;
-                cout << "mflo $3" << endl;
-                cout << "add $3, " << termReg << ", $3" << endl;
+                code(ctx, node->children[0]);  // code(expr)
+                ctx.out << "mult $3, $4" << endl;
+                ctx.out << "mflo $3" << endl;
+                ctx.out << "add $3, " << termReg << ", $3" << endl;
             } else {  // BOTH in registers
-                cout << "mult " << exprReg << ", $4" << endl;
-                cout << "mflo $3" << endl;
-                cout << "add $3, " << termReg << ", $3" << endl;
+                ctx.out << "mult " << exprReg << ", $4" << endl;
+                ctx.out << "mflo $3" << endl;
+                ctx.out << "add $3, " << termReg << ", $3" << endl;
             }
         }
         // expr -> expr MINUS term; expr : int* and term = int
         else if (node->prodRuleRHS[1] == "MINUS" && node->children[0]->type == "int*" && node->children[2]->type == "int") {
-            string exprReg = resolveToID(node->children[0]);
-            string termReg = resolveToID(node->children[2]);
+            string exprReg = resolveToID(ctx, node->children[0]);
+            string termReg = resolveToID(ctx, node->children[2]);
 
-            cout << "; expr MINUS term. ER: " << exprReg << " TR:" << termReg << endl;
+            ctx.out << "; expr MINUS term. ER: " << exprReg << " TR:" << termReg << endl;
             // if not in register. Load code like normal
             if (exprReg == "" && termReg == "") {
-                code(node->children[0]);  // code(expr)
-                push("$3");
-                code(node->children[2]);  // code(term)
-                cout << "mult $3, $4" << endl;
-                cout << "mflo $3" << endl;
-                pop("$5");
-                cout << "sub $3, $5, $3" << endl;
+                code(ctx, node->children[0]);  // code(expr)
+                push(ctx.out, "$3");
+                code(ctx, node->children[2]);  // code(term)
+                ctx.out << "mult $3, $4" << endl;
+                ctx.out << "mflo $3" << endl;
+                pop(ctx.out, "$5");
+                ctx.out << "sub $3, $5, $3" << endl;
             } else if (termReg == "") {
-                code(node->children[2]);  // code(term)
-                cout << "mult $3, $4" << endl;
-                cout << "mflo $3" << endl;
-                cout << "sub $3, " << exprReg << ", $3" << endl;
+                code(ctx, node->children[2]);  // code(term)
+                ctx.out << "mult $3, $4" << endl;
+                ctx.out << "mflo $3" << endl;
+                ctx.out << "sub $3, " << exprReg << ", $3" << endl;
             } else if (exprReg == "") {
-                cout << "mult " << termReg << ", $4" << endl;
-                cout << "mflo $5" << endl;
-                code(node->children[0]);  // code(expr)
-                cout << "sub $3, $5, $3" << endl;
+                ctx.out << "mult " << termReg << ", $4" << endl;
+                ctx.out << "mflo $5" << endl;
+                code(ctx, node->children[0]);  // code(expr)
+                ctx.out << "sub $3, $5, $3" << endl;
             } else {  // BOTH in registers
-                cout << "mult " << termReg << ", $4" << endl;
-                cout << "mflo $3" << endl;
-                cout << "sub $3, " << exprReg << ", $3" << endl;
+                ctx.out << "mult " << termReg << ", $4" << endl;
+                ctx.out << "mflo $3" << endl;
+                ctx.out << "sub $3, " << exprReg << ", $3" << endl;
             }
         }
         // expr -> expr MINUS term; expr : int* and term = int*
         else if (node->prodRuleRHS[1] == "MINUS" && node->children[0]->type == "int*" && node->children[2]->type == "int*") {
-            string exprReg = resolveToID(node->children[0]);
-            string termReg = resolveToID(node->children[2]);
+            string exprReg = resolveToID(ctx, node->children[0]);
+            string termReg = resolveToID(ctx, node->children[2]);
 
             // if not in register. Load code like normal
             if (exprReg == "" && termReg == "") {
-                code(node->children[0]);  // code(expr)
-                push("$3");
-                code(node->children[2]);  // code(term)
-                pop("$5");
-                cout << "sub $3, $5, $3" << endl;
-                cout << "div $3, $4" << endl;
-                cout << "mflo $3" << endl;
+                code(ctx, node->children[0]);  // code(expr)
+                push(ctx.out, "$3");
+                code(ctx, node->children[2]);  // code(term)
+                pop(ctx.out, "$5");
+                ctx.out << "sub $3, $5, $3" << endl;
+                generateWordsBetween(ctx);
             } else if (termReg == "") {
-                code(node->children[2]);  // code(term)
-                cout << "sub $3, " << exprReg << ", $3" << endl;
-                cout << "div $3, $4" << endl;
-                cout << "mflo $3" << endl;
+                code(ctx, node->children[2]);  // code(term)
+                ctx.out << "sub $3, " << exprReg << ", $3" << endl;
+                generateWordsBetween(ctx);
             } else if (exprReg == "") {
-                code(node->children[0]);  // code(expr)
-                cout << "sub $3, $3, " << termReg << endl;
-                cout << "div $3, $4" << endl;
-                cout << "mflo $3" << endl;
+                code(ctx, node->children[0]);  // code(expr)
+                ctx.out << "sub $3, $3, " << termReg << endl;
+                generateWordsBetween(ctx);
             } else {  // BOTH in registers
-                cout << "sub $3, " << exprReg << ", " << termReg << endl;
-                cout << "div $3, $4" << endl;
-                cout << "mflo $3" << endl;
+                ctx.out << "sub $3, " << exprReg << ", " << termReg << endl;
+                generateWordsBetween(ctx);
             }
         }
     }
     // term -> factor
     else if (node->prodRuleLHS == "term" && node->prodRuleRHS[0] == "factor") {
         // code(factor);
-        code(node->children[0]);
+        code(ctx, node->children[0]);
     }
     // term → term STAR factor
     // term → term SLASH factor
     // term → term PCT factor
     else if (node->prodRuleLHS == "term" && node->prodRuleRHS.size() == 3) {
-        string termReg = resolveToID(node->children[0]);
-        string factorReg = resolveToID(node->children[2]);
+        int32_t divisor;
+        if (node->prodRuleRHS[1] != "STAR" && constantValue(node->children[2], divisor) && lowersDivision(divisor)) {
+            string termReg = resolveToID(ctx, node->children[0]);
+            if (termReg == "") {
+                code(ctx, node->children[0]);
+                termReg = "$3";
+            }
+            generateConstantDivision(ctx, termReg, divisor, node->prodRuleRHS[1] == "PCT");
+            return;
+        }
+
+        string termReg = resolveToID(ctx, node->children[0]);
+        string factorReg = resolveToID(ctx, node->children[2]);
 
         // if not in register. Load code like normal
         if (termReg == "" && factorReg == "") {
             // code(term)
-            code(node->children[0]);
-            push("$3");
+            code(ctx, node->children[0]);
+            push(ctx.out, "$3");
             // code(factor)
-            code(node->children[2]);
-            pop("$5");
+            code(ctx, node->children[2]);
+            pop(ctx.out, "$5");
 
             termReg = "$5";
             factorReg = "$3";
         } else if (termReg == "") {
             // code(term)
-            code(node->children[0]);
+            code(ctx, node->children[0]);
             termReg = "$3";
         } else if (factorReg == "") {
             // code(factor)
-            code(node->children[2]);
+            code(ctx, node->children[2]);
             factorReg = "$3";
         }
 
         // If MULT
         if (node->prodRuleRHS[1] == "STAR") {
             // cout << "mult $5, $3" << endl;
-            cout << "mult " << termReg << ", " << factorReg << endl;
-            cout << "mflo $3" << endl;
+            ctx.out << "mult " << termReg << ", " << factorReg << endl;
+            ctx.out << "mflo $3" << endl;
         } else if (node->prodRuleRHS[1] == "SLASH") {
             // cout << "div $5, $3" << endl;
-            cout << "div " << termReg << ", " << factorReg << endl;
-            cout << "mflo $3" << endl;
+            ctx.out << "div " << termReg << ", " << factorReg << endl;
+            ctx.out << "mflo $3" << endl;
         } else {  // PCT
                   // cout << "div $5, $3" << endl;
-            cout << "div " << termReg << ", " << factorReg << endl;
-            cout << "mfhi $3" << endl;
+            ctx.out << "div " << termReg << ", " << factorReg << endl;
+            ctx.out << "mfhi $3" << endl;
         }
     }
     // factor -> NUM
     else if (node->prodRuleLHS == "factor" && node->prodRuleRHS[0] == "NUM") {
         string value = node->children[0]->token.lexeme;
-        cout << "lis $3" << endl;
-        cout << ".word " << value << endl;
+        ctx.out << "lis $3" << endl;
+        ctx.out << ".word " << value << endl;
     }
     // factor -> NULL
     else if (node->prodRuleLHS == "factor" && node->prodRuleRHS[0] == "NULL") {
-        cout << "add $3, $0, $11 ;" << endl;
+        ctx.out << "add $3, $0, $11 ;" << endl;
     }
     // factor -> ID
     // need to check prodRuleRHS.size() == 1 because factor has factor ID LPAREN RPAREN
@@ -1373,12 +2478,12 @@ void code(ParseTreeNode* node) {
         string variableName = node->children[0]->token.lexeme;
 
         // Check if var is stored in register or symbol table
-        if (regTable.find(variableName) != regTable.end()) {
-            cout << "add $3, $0, " << regTable.find(variableName)->second << endl;
+        if (ctx.regTable.find(variableName) != ctx.regTable.end()) {
+            ctx.out << "add $3, $0, " << ctx.regTable.find(variableName)->second << endl;
         } else {
             // Get the offset from symbol table
-            string offset = symbol_table[variableName].second;
-            cout << "lw $3, " << offset << "($29)" << endl;
+            string offset = ctx.symbol_table[variableName].second;
+            ctx.out << "lw $3, " << offset << "($29)" << endl;
         }
     }
     // factor -> LPAREN expr RPAREN
@@ -1387,7 +2492,7 @@ void code(ParseTreeNode* node) {
         // cout << "; LPAREN expr RPAREN" << endl;
         // printSymbolTable();
         // printRegTable();
-        code(node->children[1]);
+        code(ctx, node->children[1]);
         // cout << "; end LPAREN expr RPAREN" << endl;
     }
     // factor -> AMP lvalue
@@ -1404,20 +2509,20 @@ void code(ParseTreeNode* node) {
                     // dump the value of lvalue -> ID into $3
 
                     // Check if var is stored in register or symbol table
-                    if (regTable.find(variableName) != regTable.end()) {
-                        cout << "add $3, $0, " << regTable.find(variableName)->second << endl;
+                    if (ctx.regTable.find(variableName) != ctx.regTable.end()) {
+                        ctx.out << "add $3, $0, " << ctx.regTable.find(variableName)->second << endl;
                     } else {
-                        cout << "lis $3" << endl;
-                        string offset = symbol_table[variableName].second;
-                        cout << ".word " << offset << endl;
-                        cout << "add $3, $3, $29" << endl;
+                        ctx.out << "lis $3" << endl;
+                        string offset = ctx.symbol_table[variableName].second;
+                        ctx.out << ".word " << offset << endl;
+                        ctx.out << "add $3, $3, $29" << endl;
                     }
 
                 }
                 // lvalue -> STAR factor
                 else if (node->prodRuleRHS.size() == 2) {
                     // code(factor)
-                    code(node->children[1]);
+                    code(ctx, node->children[1]);
                 }
                 break;
             } else {  // lvalue -> LPAREN lvalue RPAREN
@@ -1427,63 +2532,63 @@ void code(ParseTreeNode* node) {
 
     }
     // factor → ID LPAREN RPAREN
-    else if (node->prodRuleLHS == "factor" && node->prodRuleRHS[0] == "ID" && node->prodRuleRHS.size() == 3) {
-        push("$29");
-        push("$31");
-
-        cout << "lis $5" << endl;
-        cout << ".word F" << node->children[0]->token.lexeme << endl;
-        cout << "jalr $5" << endl;
-
-        pop("$31");
-        pop("$29");
-    }
-
     // factor → ID LPAREN arglist RPAREN
-    else if (node->prodRuleLHS == "factor" && node->prodRuleRHS[0] == "ID" && node->prodRuleRHS.size() == 4) {
-        push("$29");
-        push("$31");
-
-        cout << "; Push Args" << endl;
-        int numArgsPushed = pushArgs(node->children[2]);
-
-        cout << "lis $5" << endl;
-        cout << ".word F" << node->children[0]->token.lexeme << endl;
-        cout << "jalr $5" << endl;
+    else if (node->prodRuleLHS == "factor" && node->prodRuleRHS[0] == "ID" && node->prodRuleRHS.size() > 1) {
+        vector<ParseTreeNode*> args;
+        if (node->prodRuleRHS.size() == 4) {
+            args = getArgs(node->children[2]);
+        }
 
-        for (int i = 0; i < numArgsPushed; i++) {
-            pop("$31");
+        // $29, $31 and the arguments share one block: $30 moves once each way
+        int bytes = 4 * (2 + args.size());
+        moveStackPointer(ctx, -bytes, "$3");
+        ctx.out << "sw $29, " << bytes - 4 << "($30)" << endl;
+        ctx.out << "sw $31, " << bytes - 8 << "($30)" << endl;
+        ctx.out << "; Store Args" << endl;
+        for (size_t i = 0; i < args.size(); i++) {
+            code(ctx, args[i]);  // code(expr)
+            ctx.out << "sw $3, " << bytes - 12 - 4 * int(i) << "($30)" << endl;
         }
 
-        pop("$31");
-        pop("$29");
+        ctx.out << "lis $5" << endl;
+        ctx.out << ".word F" << node->children[0]->token.lexeme << endl;
+        ctx.out << "jalr $5" << endl;
+
+        // $31 is reloaded last, so it can hold the size of the block
+        moveStackPointer(ctx, bytes, "$31");
+        ctx.out << "lw $31, -8($30)" << endl;
+        ctx.out << "lw $29, -4($30)" << endl;
     }
 
     // factor -> STAR factor
     else if (node->prodRuleLHS == "factor" && node->prodRuleRHS[0] == "STAR") {
-        code(node->children[1]);  // code(factor2)
-        cout << "lw $3, 0($3)" << endl;
+        code(ctx, node->children[1]);  // code(factor2)
+        ctx.out << "lw $3, 0($3)" << endl;
     }
 
     // factor → NEW INT LBRACK expr RBRACK
     else if (node->prodRuleLHS == "factor" && node->prodRuleRHS[0] == "NEW") {
         // code(expr)
-        code(node->children[3]);
-        push("$1");
-        cout << "add $1, $3, $0" << endl;
-        push("$31");
-        cout << "lis $5" << endl;
-        cout << ".word new" << endl;
-        cout << "jalr $5" << endl;
-        pop("$31");
-        cout << "bne $3, $0, 1" << endl;
-        cout << "add $3, $11, $0" << endl;
-        pop("$1");
+        code(ctx, node->children[3]);
+        if (inlineAllocator) {
+            generateInlineNew(ctx);
+        } else {
+            push(ctx.out, "$1");
+            ctx.out << "add $1, $3, $0" << endl;
+            push(ctx.out, "$31");
+            ctx.out << "lis $5" << endl;
+            ctx.out << ".word new" << endl;
+            ctx.out << "jalr $5" << endl;
+            pop(ctx.out, "$31");
+            ctx.out << "bne $3, $0, 1" << endl;
+            ctx.out << "add $3, $11, $0" << endl;
+            pop(ctx.out, "$1");
+        }
     }
 
     // lvalue → LPAREN lvalue RPAREN
     else if (node->prodRuleLHS == "lvalue" && node->prodRuleRHS.size() == 3) {
-        code(node->children[1]);
+        code(ctx, node->children[1]);
     }
     // test → expr EQ expr
     // test → expr NE expr
@@ -1492,23 +2597,23 @@ void code(ParseTreeNode* node) {
     // test → expr GE expr
     // test → expr GT expr
     else if (node->prodRuleLHS == "test") {
-        string expr1Reg = resolveToID(node->children[0]);
-        string expr2Reg = resolveToID(node->children[2]);
+        string expr1Reg = resolveToID(ctx, node->children[0]);
+        string expr2Reg = resolveToID(ctx, node->children[2]);
 
         // if not in register. Load code like normal
         if (expr1Reg == "" && expr2Reg == "") {
-            code(node->children[0]);  // code(expr1)
-            push("$3");
-            code(node->children[2]);  // code(expr2)
-            pop("$5");
+            code(ctx, node->children[0]);  // code(expr1)
+            push(ctx.out, "$3");
+            code(ctx, node->children[2]);  // code(expr2)
+            pop(ctx.out, "$5");
 
             expr1Reg = "$5";
             expr2Reg = "$3";
         } else if (expr1Reg == "") {
-            code(node->children[0]);  // code(expr1)
+            code(ctx, node->children[0]);  // code(expr1)
             expr1Reg = "$3";
         } else if (expr2Reg == "") {
-            code(node->children[2]);  // code(expr2)
+            code(ctx, node->children[2]);  // code(expr2)
             expr2Reg = "$3";
         }
 
@@ -1516,98 +2621,655 @@ void code(ParseTreeNode* node) {
         if (node->children[0]->type == "int") {
             if (node->prodRuleRHS[1] == "LT") {
                 // cout << "slt $3, $5, $3" << endl;
-                cout << "slt $3, " << expr1Reg << ", " << expr2Reg << endl;
+                ctx.out << "slt $3, " << expr1Reg << ", " << expr2Reg << endl;
             } else if (node->prodRuleRHS[1] == "GT") {
                 // cout << "slt $3, $3, $5" << endl;
-                cout << "slt $3, " << expr2Reg << ", " << expr1Reg << endl;
+                ctx.out << "slt $3, " << expr2Reg << ", " << expr1Reg << endl;
             } else if (node->prodRuleRHS[1] == "NE") {
                 // cout << "slt $6, $3, $5" << endl;  // $6 = $3 < $5
-                cout << "slt $6, " << expr2Reg << ", " << expr1Reg << endl;
+                ctx.out << "slt $6, " << expr2Reg << ", " << expr1Reg << endl;
                 // cout << "slt $7, $5, $3" << endl;  // $7 = $5 < $3
-                cout << "slt $7, " << expr1Reg << ", " << expr2Reg << endl;
-                cout << "add $3, $6, $7" << endl;
+                ctx.out << "slt $7, " << expr1Reg << ", " << expr2Reg << endl;
+                ctx.out << "add $3, $6, $7" << endl;
             } else if (node->prodRuleRHS[1] == "EQ") {
                 // cout << "slt $6, $3, $5" << endl;  // $6 = $3 < $5
-                cout << "slt $6, " << expr2Reg << ", " << expr1Reg << endl;
+                ctx.out << "slt $6, " << expr2Reg << ", " << expr1Reg << endl;
                 // cout << "slt $7, $5, $3" << endl;  // $7 = $5 < $3
-                cout << "slt $7, " << expr1Reg << ", " << expr2Reg << endl;
-                cout << "add $3, $6, $7" << endl;
-                cout << "sub $3, $11, $3" << endl;
+                ctx.out << "slt $7, " << expr1Reg << ", " << expr2Reg << endl;
+                ctx.out << "add $3, $6, $7" << endl;
+                ctx.out << "sub $3, $11, $3" << endl;
             } else if (node->prodRuleRHS[1] == "LE") {
                 // cout << "slt $6, $3, $5" << endl;   // $6 = $3 < $5 : expr2 < expr1 : expr1 > expr2
-                cout << "slt $6, " << expr2Reg << ", " << expr1Reg << endl;
-                cout << "sub $3, $11, $6" << endl;  // !(expr1 > expr2) : expr1 <= expr2
+                ctx.out << "slt $6, " << expr2Reg << ", " << expr1Reg << endl;
+                ctx.out << "sub $3, $11, $6" << endl;  // !(expr1 > expr2) : expr1 <= expr2
             } else if (node->prodRuleRHS[1] == "GE") {
                 // cout << "slt $6, $5, $3" << endl;   // $6 = $5 < $3 : $3 > $5 : expr2 > expr1 : expr1 < expr2
-                cout << "slt $6, " << expr1Reg << ", " << expr2Reg << endl;
-                cout << "sub $3, $11, $6" << endl;  // !(expr1 < expr2) : expr1 >= expr2
+                ctx.out << "slt $6, " << expr1Reg << ", " << expr2Reg << endl;
+                ctx.out << "sub $3, $11, $6" << endl;  // !(expr1 < expr2) : expr1 >= expr2
             }
         }
         // both exprs are int*
         else {
             if (node->prodRuleRHS[1] == "LT") {
                 // cout << "slt $3, $5, $3" << endl;
-                cout << "sltu $3, " << expr1Reg << ", " << expr2Reg << endl;
+                ctx.out << "sltu $3, " << expr1Reg << ", " << expr2Reg << endl;
             } else if (node->prodRuleRHS[1] == "GT") {
                 // cout << "slt $3, $3, $5" << endl;
-                cout << "sltu $3, " << expr2Reg << ", " << expr1Reg << endl;
+                ctx.out << "sltu $3, " << expr2Reg << ", " << expr1Reg << endl;
             } else if (node->prodRuleRHS[1] == "NE") {
                 // cout << "slt $6, $3, $5" << endl;  // $6 = $3 < $5
-                cout << "sltu $6, " << expr2Reg << ", " << expr1Reg << endl;
+                ctx.out << "sltu $6, " << expr2Reg << ", " << expr1Reg << endl;
                 // cout << "slt $7, $5, $3" << endl;  // $7 = $5 < $3
-                cout << "sltu $7, " << expr1Reg << ", " << expr2Reg << endl;
-                cout << "add $3, $6, $7" << endl;
+                ctx.out << "sltu $7, " << expr1Reg << ", " << expr2Reg << endl;
+                ctx.out << "add $3, $6, $7" << endl;
             } else if (node->prodRuleRHS[1] == "EQ") {
                 // cout << "slt $6, $3, $5" << endl;  // $6 = $3 < $5
-                cout << "sltu $6, " << expr2Reg << ", " << expr1Reg << endl;
+                ctx.out << "sltu $6, " << expr2Reg << ", " << expr1Reg << endl;
                 // cout << "slt $7, $5, $3" << endl;  // $7 = $5 < $3
-                cout << "sltu $7, " << expr1Reg << ", " << expr2Reg << endl;
-                cout << "add $3, $6, $7" << endl;
-                cout << "sub $3, $11, $3" << endl;
+                ctx.out << "sltu $7, " << expr1Reg << ", " << expr2Reg << endl;
+                ctx.out << "add $3, $6, $7" << endl;
+                ctx.out << "sub $3, $11, $3" << endl;
             } else if (node->prodRuleRHS[1] == "LE") {
                 // cout << "slt $6, $3, $5" << endl;   // $6 = $3 < $5 : expr2 < expr1 : expr1 > expr2
-                cout << "sltu $6, " << expr2Reg << ", " << expr1Reg << endl;
-                cout << "sub $3, $11, $6" << endl;  // !(expr1 > expr2) : expr1 <= expr2
+                ctx.out << "sltu $6, " << expr2Reg << ", " << expr1Reg << endl;
+                ctx.out << "sub $3, $11, $6" << endl;  // !(expr1 > expr2) : expr1 <= expr2
             } else if (node->prodRuleRHS[1] == "GE") {
                 // cout << "slt $6, $5, $3" << endl;   // $6 = $5 < $3 : $3 > $5 : expr2 > expr1 : expr1 < expr2
-                cout << "sltu $6, " << expr1Reg << ", " << expr2Reg << endl;
-                cout << "sub $3, $11, $6" << endl;  // !(expr1 < expr2) : expr1 >= expr2
+                ctx.out << "sltu $6, " << expr1Reg << ", " << expr2Reg << endl;
+                ctx.out << "sub $3, $11, $6" << endl;  // !(expr1 < expr2) : expr1 >= expr2
+            }
+        }
+    }
+}
+
+// Branch threading
+// Works on a procedure's generated assembly, one line per entry. Branches with numeric offsets only ever skip
+// straight-line code, which this never changes, so only branches to labels move or go away
+
+// Labels made for if and while statements, which nothing outside the procedure refers to
+bool isControlFlowLabel(const string& label) {
+    static const string prefixes[] = {"then", "else", "endif", "endWhile", "body"};
+    for (const string& prefix : prefixes) {
+        if (label.compare(0, prefix.size(), prefix) == 0 && label.size() > prefix.size() &&
+            isdigit((unsigned char)label[prefix.size()])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+struct AsmLine {
+    string text;
+    // A label ("name:"), the four words of a beq or bne, the first word of any other instruction or .word,
+    // or nothing for a comment
+    vector<string> tokens;
+};
+
+AsmLine parseAsmLine(string text) {
+    AsmLine line;
+    size_t end = min(text.find(';'), text.size());
+    for (size_t i = 0; i < end;) {
+        while (i < end && (isspace((unsigned char)text[i]) || text[i] == ',')) {
+            i++;
+        }
+        size_t start = i;
+        while (i < end && !isspace((unsigned char)text[i]) && text[i] != ',') {
+            i++;
+        }
+        if (i > start) {
+            line.tokens.emplace_back(text, start, i - start);
+        }
+        if (line.tokens.size() == 1 && line.tokens[0] != "beq" && line.tokens[0] != "bne") {
+            break;
+        }
+    }
+    line.text = move(text);
+    return line;
+}
+
+bool isLabel(const AsmLine& line) {
+    return line.tokens.size() == 1 && line.tokens[0].back() == ':';
+}
+
+// An instruction or .word
+bool isWord(const AsmLine& line) {
+    return !line.tokens.empty() && !isLabel(line);
+}
+
+// beq or bne to a label: its target, otherwise ""
+string branchTarget(const AsmLine& line) {
+    const vector<string>& tokens = line.tokens;
+    if (tokens.size() == 4 && (tokens[0] == "beq" || tokens[0] == "bne") && isalpha((unsigned char)tokens[3][0])) {
+        return tokens[3];
+    }
+    return "";
+}
+
+bool isJump(const AsmLine& line) {
+    return line.tokens.size() == 4 && line.tokens[0] == "beq" && line.tokens[1] == "$0" && line.tokens[2] == "$0" &&
+           !branchTarget(line).empty();
+}
+
+// Points a beq or bne somewhere else, and turns it into the opposite branch if invert
+void retarget(AsmLine& line, const string& target, bool invert) {
+    string op = invert ? (line.tokens[0] == "beq" ? "bne" : "beq") : line.tokens[0];
+    line = parseAsmLine(op + " " + line.tokens[1] + ", " + line.tokens[2] + ", " + target);
+}
+
+// One round of threading. Returns whether anything changed:
+// - a branch to a jump goes straight to where the jump goes, and to the first of the labels there
+// - a jump to the next word, or right after another jump, is dropped
+// - a branch over a jump becomes the opposite branch to where the jump goes
+// - labels of if and while statements that nothing branches to any more are dropped
+bool threadBranchesOnce(vector<AsmLine>& lines) {
+    // The line of the word each label stands for, and the first label standing for each word
+    unordered_map<string, size_t> wordAt;
+    unordered_map<size_t, string> firstLabel;
+    vector<string> pending;
+    for (size_t i = 0; i <= lines.size(); i++) {
+        if (i < lines.size() && isLabel(lines[i])) {
+            pending.push_back(lines[i].tokens[0].substr(0, lines[i].tokens[0].size() - 1));
+        } else if (i == lines.size() || isWord(lines[i])) {
+            for (const string& label : pending) {
+                wordAt[label] = i;
+            }
+            if (!pending.empty()) {
+                firstLabel[i] = pending[0];
+            }
+            pending.clear();
+        }
+    }
+
+    // Where a branch to label really ends up, following jumps to jumps
+    auto resolve = [&](string label) {
+        unordered_set<string> seen;
+        while (wordAt.count(label) && seen.insert(label).second) {
+            size_t word = wordAt[label];
+            if (word < lines.size() && isJump(lines[word])) {
+                label = lines[word].tokens[3];
+            } else {
+                return firstLabel[word];
+            }
+        }
+        return label;
+    };
+    // The next word after line i
+    auto nextWord = [&](size_t i) {
+        for (i++; i < lines.size() && !isWord(lines[i]); i++) {
+        }
+        return i;
+    };
+
+    bool changed = false;
+    vector<bool> removed(lines.size(), false);
+    bool afterJump = false;  // Whether the last word was a jump, with no label since
+    for (size_t i = 0; i < lines.size(); i++) {
+        if (isLabel(lines[i])) {
+            afterJump = false;
+            continue;
+        }
+        if (!isWord(lines[i])) {
+            continue;
+        }
+        string target = branchTarget(lines[i]);
+        if (isJump(lines[i]) && afterJump) {
+            // Nothing can get here
+            removed[i] = changed = true;
+            continue;
+        }
+        if (target.empty() || !wordAt.count(target)) {
+            afterJump = isJump(lines[i]);
+            continue;
+        }
+        size_t next = nextWord(i);
+        if (isJump(lines[i]) && wordAt[target] == next) {
+            removed[i] = changed = true;
+            continue;
+        }
+        string resolved = resolve(target);
+        if (resolved != target) {
+            retarget(lines[i], resolved, false);
+            changed = true;
+        }
+        afterJump = isJump(lines[i]);
+        if (afterJump && wordAt[resolved] == next) {
+            removed[i] = changed = true;
+            afterJump = false;
+        } else if (!afterJump && next < lines.size() && isJump(lines[next]) && wordAt[resolved] == nextWord(next)) {
+            // Only if nothing else runs into the jump: no label between the two
+            bool labelBetween = false;
+            for (size_t j = i + 1; j < next; j++) {
+                labelBetween = labelBetween || isLabel(lines[j]);
+            }
+            if (!labelBetween) {
+                retarget(lines[i], lines[next].tokens[3], true);
+                removed[next] = changed = true;
+                i = next;
+            }
+        }
+    }
+
+    unordered_set<string> referenced;
+    for (size_t i = 0; i < lines.size(); i++) {
+        if (!removed[i] && !branchTarget(lines[i]).empty()) {
+            referenced.insert(lines[i].tokens[3]);
+        }
+    }
+    for (size_t i = 0; i < lines.size(); i++) {
+        if (isLabel(lines[i])) {
+            string label = lines[i].tokens[0].substr(0, lines[i].tokens[0].size() - 1);
+            if (isControlFlowLabel(label) && !referenced.count(label)) {
+                removed[i] = changed = true;
+            }
+        }
+    }
+
+    size_t kept = 0;
+    for (size_t i = 0; i < lines.size(); i++) {
+        if (!removed[i]) {
+            if (kept != i) {
+                lines[kept] = move(lines[i]);
+            }
+            kept++;
+        }
+    }
+    lines.resize(kept);
+    return changed;
+}
+
+// Threads the branches of a procedure's code until nothing changes
+string threadBranches(const string& code) {
+    vector<AsmLine> lines;
+    istringstream input(code);
+    for (string text; getline(input, text);) {
+        lines.push_back(parseAsmLine(move(text)));
+    }
+    while (threadBranchesOnce(lines)) {
+    }
+    string output;
+    output.reserve(code.size());
+    for (const AsmLine& line : lines) {
+        output += line.text;
+        output += '\n';
+    }
+    return output;
+}
+
+// Optimizes and generates code for one procedure (or main) into ctx.out
+void generateProcedure(CodegenContext& ctx, ParseTreeNode* node) {
+    if (node->prodRuleLHS == "main") {
+        ctx.procedureName = "wain";
+        // The prologue spills these if their address is taken, at every optimization level
+        // main -> INT WAIN LPAREN dcl COMMA dcl RPAREN LBRACE dcls statements RETURN expr SEMI RBRACE
+        ctx.wainParam1Name = node->children[3]->children[1]->token.lexeme;
+        ctx.wainParam2Name = node->children[5]->children[1]->token.lexeme;
+    } else {
+        ctx.procedureName = node->children[1]->token.lexeme;
+    }
+
+    if (optimizationLevel == 0) {
+        ctx.freeRegisters.clear();
+    }
+    if (instrument) {
+        // $28 holds the counter table's address for the whole run
+        ctx.freeRegisters.erase(remove(ctx.freeRegisters.begin(), ctx.freeRegisters.end(), "$28"), ctx.freeRegisters.end());
+        ctx.numInstrumentCounters = countInstrumentCounters(node);
+    }
+
+    bool didOptimize = optimizationLevel > 0 && optimizeTree(ctx, node);
+    int optimizeCounter = 0;
+    while (didOptimize) {
+        ctx.varTable.clear();
+        didOptimize = optimizeTree(ctx, node);
+        optimizeCounter++;
+    }
+    ctx.out << "; Optimizations: " << optimizeCounter << endl;
+
+    checkForDereferences(ctx, node);
+    if (profileGenerate || !profile.empty()) {
+        numberProfileCounters(ctx, node);
+    }
+    if (optimizationLevel > 0) {
+        chooseRegisterVariables(ctx, node);
+    }
+    code(ctx, node);
+
+    if (optimizationLevel > 0) {
+        string generated = ctx.out.str();
+        ctx.out.str("");
+        ctx.out << threadBranches(generated);
+    }
+}
+
+// 64-bit FNV-1a, used to name objects by their content
+const uint64_t FNV_OFFSET = 0xcbf29ce484222325ULL;
+const uint64_t FNV_PRIME = 0x100000001b3ULL;
+
+uint64_t fnv1a(uint64_t hash, const string& text) {
+    for (unsigned char c : text) {
+        hash = (hash ^ c) * FNV_PRIME;
+    }
+    // End every field with a byte that can't appear in it, so "ab" + "c" and "a" + "bc" differ
+    return (hash ^ 0xff) * FNV_PRIME;
+}
+
+// Hashes everything code() looks at in the annotated subtree: rules, tokens and types
+uint64_t hashTree(const ParseTreeNode* root, uint64_t hash) {
+    vector<const ParseTreeNode*> stack = {root};
+    while (!stack.empty()) {
+        const ParseTreeNode* node = stack.back();
+        stack.pop_back();
+        if (node->isTerminal()) {
+            hash = fnv1a(hash, node->token.kind);
+            hash = fnv1a(hash, node->token.lexeme);
+        } else {
+            hash = fnv1a(hash, node->prodRuleLHS);
+            for (const auto& rhs : node->prodRuleRHS) {
+                hash = fnv1a(hash, rhs);
+            }
+        }
+        hash = fnv1a(hash, node->type);
+        for (auto it = node->children.rbegin(); it != node->children.rend(); ++it) {
+            stack.push_back(*it);
+        }
+    }
+    return hash;
+}
+
+// Names of the procedures called anywhere in the subtree
+set<string> collectCallees(const ParseTreeNode* root) {
+    set<string> callees;
+    vector<const ParseTreeNode*> stack = {root};
+    while (!stack.empty()) {
+        const ParseTreeNode* node = stack.back();
+        stack.pop_back();
+        // factor → ID LPAREN RPAREN | ID LPAREN arglist RPAREN
+        if (node->prodRuleLHS == "factor" && node->prodRuleRHS[0] == "ID" && node->prodRuleRHS.size() > 1) {
+            callees.insert(node->children[0]->token.lexeme);
+        }
+        stack.insert(stack.end(), node->children.begin(), node->children.end());
+    }
+    return callees;
+}
+
+// Returns whether any rule in the procedures starts with first, e.g. statement → PRINTLN ... for "PRINTLN"
+bool usesRule(const vector<ParseTreeNode*>& procedures, const string& first) {
+    vector<const ParseTreeNode*> stack(procedures.begin(), procedures.end());
+    while (!stack.empty()) {
+        const ParseTreeNode* node = stack.back();
+        stack.pop_back();
+        if (!node->prodRuleRHS.empty() && node->prodRuleRHS[0] == first) {
+            return true;
+        }
+        stack.insert(stack.end(), node->children.begin(), node->children.end());
+    }
+    return false;
+}
+
+// Wraps generated code in an assembly module for asm --merl: every label it uses but doesn't define is imported
+string toObjectModule(const string& code, const vector<string>& exports) {
+    set<string> defined, used, imported;
+    istringstream lines(code);
+    string line;
+    while (getline(lines, line)) {
+        istringstream tokens(line.substr(0, line.find(';')));
+        string token;
+        while (tokens >> token) {
+            if (token.back() == ':') {
+                defined.insert(token.substr(0, token.size() - 1));
+            } else if (token == ".import" && tokens >> token) {
+                imported.insert(token);
+            } else if (token == ".word" && tokens >> token && isalpha((unsigned char)token[0])) {
+                used.insert(token);
+            } else {
+                break;  // instructions only refer to labels in their own procedure
+            }
+        }
+    }
+
+    ostringstream module;
+    for (const auto& label : used) {
+        if (!defined.count(label) && !imported.count(label)) {
+            module << ".import " << label << endl;
+        }
+    }
+    for (const auto& label : exports) {
+        module << ".export " << label << endl;
+    }
+    module << code;
+    return module.str();
+}
+
+bool fileExists(const string& path) {
+    return ifstream(path).good();
+}
+
+// Writes through a temporary file, so a reader never sees half an object
+void writeFileAtomically(const string& path, const string& contents) {
+    string temporary = path + ".tmp" + to_string(getpid()) + "." + to_string(hash<thread::id>()(this_thread::get_id()));
+    {
+        ofstream file(temporary, ios::binary);
+        file << contents;
+        if (!file.flush()) {
+            throw runtime_error("ERROR: Cannot write " + temporary);
+        }
+    }
+    if (rename(temporary.c_str(), path.c_str()) != 0) {
+        remove(temporary.c_str());
+        throw runtime_error("ERROR: Cannot write " + path);
+    }
+}
+
+// --objects DIR: generates every procedure as its own module DIR/<key>.asm and prints the keys in link order
+// (wain's module first, since the program starts with its prologue).
+// A key hashes the procedure's annotated subtree, the signatures of the procedures it calls and the options,
+// so a procedure whose assembled object DIR/<key>.merl is already there is skipped entirely.
+void generateObjects(const vector<ParseTreeNode*>& procedures) {
+    // name -> hash of its params. Calls are checked against these, so a caller's key changes with them
+    unordered_map<string, uint64_t> signatures;
+    for (const auto* procedure : procedures) {
+        if (procedure->prodRuleLHS == "procedure") {
+            signatures[procedure->children[1]->token.lexeme] = hashTree(procedure->children[3], FNV_OFFSET);
+        }
+    }
+
+    size_t n = procedures.size();
+    vector<int> instrumentBases = assignInstrumentBases(procedures);
+    vector<string> keys(n);
+    for (size_t i = 0; i < n; i++) {
+        uint64_t hash = fnv1a(fnv1a(FNV_OFFSET, CODEGEN_VERSION), keySalt);
+        hash = fnv1a(hash, string(inlineAllocator ? "a" : "") + (inlinePrint ? "p" : "") + (profileGenerate ? "g" : "") +
+                               to_string(optimizationLevel));
+        if (instrument) {
+            // A procedure's counters move with the loops before it, and wain's module holds the whole table
+            hash = fnv1a(hash, "i" + to_string(instrumentBases[i]) + (i + 1 == n ? "/" + to_string(instrumentBases[n]) : ""));
+        }
+        hash = hashTree(procedures[i], hash);
+        // The profile decides the layout and the registers. Inlined calls are already part of the tree
+        string name = procedures[i]->prodRuleLHS == "main" ? "wain" : procedures[i]->children[1]->token.lexeme;
+        auto counts = profile.find(name);
+        if (counts != profile.end()) {
+            for (uint64_t count : counts->second) {
+                hash = fnv1a(hash, to_string(count));
+            }
+        }
+        for (const auto& callee : collectCallees(procedures[i])) {
+            hash = fnv1a(hash, callee);
+            hash = fnv1a(hash, to_string(signatures[callee]));
+        }
+        char key[17];
+        snprintf(key, sizeof(key), "%016llx", (unsigned long long)hash);
+        keys[i] = key;
+    }
+
+    vector<exception_ptr> errors(n);
+    parallelFor(n, numJobs, [&](size_t i) {
+        string path = objectDir + "/" + keys[i];
+        if (fileExists(path + ".merl")) {
+            return;
+        }
+        try {
+            CodegenContext ctx;
+            ctx.instrumentBase = instrumentBases[i];
+            generateProcedure(ctx, procedures[i]);
+            string object;
+            if (procedures[i]->prodRuleLHS == "main") {
+                ostringstream code;
+                generatePrologue(code, ctx);
+                code << ctx.out.str();
+                generateEpilogue(code, ctx);
+                vector<string> exports;
+                if (inlineAllocator) {
+                    generateAllocatorData(code);
+                    exports = {"allocBumpPtr", "allocFreeLists"};
+                }
+                if (inlinePrint) {
+                    generatePrintRoutine(code);
+                }
+                generateProfileTable(code, ctx);
+                generateInstrumentDescriptor(code, ctx);
+                generateInstrumentCounters(code, instrumentBases[n]);
+                object = toObjectModule(code.str(), exports);
+            } else {
+                generateProfileTable(ctx.out, ctx);
+                generateInstrumentDescriptor(ctx.out, ctx);
+                object = toObjectModule(ctx.out.str(), {"F" + ctx.procedureName});
             }
+            writeFileAtomically(path + ".asm", object);
+        } catch (...) {
+            errors[i] = current_exception();
         }
+    });
+    for (const auto& error : errors) {
+        if (error) {
+            rethrow_exception(error);
+        }
+    }
+
+    cout << keys[n - 1] << endl;
+    for (size_t i = 0; i + 1 < n; i++) {
+        cout << keys[i] << endl;
     }
 }
 
-int main() {
-    ParseTreeNode* root;
+int main(int argc, char* argv[]) {
+    ParseTreeNode* root = nullptr;
+    string profilePath;
+
+    for (int i = 1; i < argc; i++) {
+        string option = argv[i];
+        if (option == "--inline-alloc") {
+            inlineAllocator = true;
+        } else if (option == "--inline-print") {
+            inlinePrint = true;
+        } else if (option == "-j" && i + 1 < argc) {
+            try {
+                numJobs = stoi(argv[++i]);
+            } catch (const logic_error&) {
+                cerr << "ERROR: Bad option value" << endl;
+                return 1;
+            }
+        } else if (option == "-O0" || option == "-O1" || option == "-O2") {
+            optimizationLevel = option[2] - '0';
+            if (optimizationLevel == 2) {
+                inlineAllocator = true;
+                inlinePrint = true;
+            }
+        } else if (option == "--objects" && i + 1 < argc) {
+            objectDir = argv[++i];
+        } else if (option == "--key-salt" && i + 1 < argc) {
+            keySalt = argv[++i];
+        } else if (option == "--profile-generate") {
+            profileGenerate = true;
+        } else if (option == "--profile-use" && i + 1 < argc) {
+            profilePath = argv[++i];
+        } else if (option == "--instrument") {
+            instrument = true;
+        } else {
+            cerr << "ERROR: Unknown option " << option << endl;
+            return 1;
+        }
+    }
 
     try {
+        if (!profilePath.empty()) {
+            readProfile(profilePath);
+        }
         root = buildParseTree();
+        if (root == nullptr) {  // empty input
+            return 0;
+        }
 
-        bool didOptimize = optimizeTree(root);
-        int optimizeCounter = 0;
-        while (didOptimize) {
-            varTable.clear();
-            didOptimize = optimizeTree(root);
-            optimizeCounter++;
+        // start -> BOF procedures EOF
+        // procedures -> procedure procedures
+        // procedures -> main
+        vector<ParseTreeNode*> procedures;
+        ParseTreeNode* node = root->children[1];
+        while (node->prodRuleRHS[0] == "procedure") {
+            procedures.emplace_back(node->children[0]);
+            node = node->children[1];
         }
-        cout << "; Optimizations: " << optimizeCounter << endl;
-        // printParseTree(root, 0, true);
+        procedures.emplace_back(node->children[0]);  // main is always last
 
-        checkForDereferences(root);
+        if (!profile.empty()) {
+            inlineHotCalls(procedures);
+        }
 
-        generatePrologue();
-        code(root);  // Generates code for the body
+        // The built-in allocator and printInt only pay for their space in programs that use them
+        if (inlineAllocator && !usesRule(procedures, "NEW") && !usesRule(procedures, "DELETE")) {
+            inlineAllocator = false;
+        }
+        if (inlinePrint && !usesRule(procedures, "PRINTLN")) {
+            inlinePrint = false;
+        }
+
+        if (!objectDir.empty()) {
+            generateObjects(procedures);
+            delete root;
+            return 0;
+        }
+
+        // Procedures don't share any state, so generate them in parallel and print them in source order
+        vector<CodegenContext> contexts(procedures.size());
+        vector<exception_ptr> errors(procedures.size());
+        vector<int> instrumentBases = assignInstrumentBases(procedures);
+        parallelFor(procedures.size(), numJobs, [&](size_t i) {
+            try {
+                contexts[i].instrumentBase = instrumentBases[i];
+                generateProcedure(contexts[i], procedures[i]);
+            } catch (...) {
+                errors[i] = current_exception();
+            }
+        });
+        for (const auto& error : errors) {
+            if (error) {
+                rethrow_exception(error);
+            }
+        }
+
+        CodegenContext& mainCtx = contexts.back();
+        generatePrologue(cout, mainCtx);
+        for (const auto& ctx : contexts) {
+            cout << ctx.out.str();
+        }
+        generateEpilogue(cout, mainCtx);
+        if (inlineAllocator) {
+            generateAllocatorData(cout);
+        }
+        if (inlinePrint) {
+            generatePrintRoutine(cout);
+        }
+        for (const auto& ctx : contexts) {
+            generateProfileTable(cout, ctx);
+            generateInstrumentDescriptor(cout, ctx);
+        }
+        generateInstrumentCounters(cout, instrumentBases.back());
 
-        // printSymbolTable();  // Print the contents of the symbol table
-        // printParseTree(root, 0, false);
-        generateEpilogue();
         // printSymbolTable();  // Print the contents of the symbol table
 
         delete root;  // Ensure we still clean up memory if no exception was thrown
 
     } catch (const std::runtime_error& e) {
-        printSymbolTable();  // Print the contents of the symbol table
-
         std::cerr << e.what() << std::endl;
         delete root;
         return 1;  // Return a non-zero value to signal an error
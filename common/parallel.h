@@ -0,0 +1,36 @@
+#ifndef WLP4_PARALLEL_H
+#define WLP4_PARALLEL_H
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <thread>
+#include <vector>
+
+// Shared by the tools that split their work over threads (-j N).
+// Header only, so each tool still builds from its own source files
+
+// Calls fn(0) .. fn(n - 1) on numThreads threads. 0 => one per core.
+// Indices are handed out one at a time, so a thread that finishes early picks up the remaining work
+inline void parallelFor(size_t n, int numThreads, const std::function<void(size_t)>& fn) {
+    size_t threadsToUse = numThreads > 0 ? numThreads : std::max(1u, std::thread::hardware_concurrency());
+    threadsToUse = std::min(threadsToUse, n);
+
+    std::atomic<size_t> next(0);
+    auto worker = [&]() {
+        for (size_t i = next++; i < n; i = next++) {
+            fn(i);
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < threadsToUse; i++) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (auto& t : threads) {
+        t.join();
+    }
+}
+
+#endif
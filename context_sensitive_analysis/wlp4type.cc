@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <iostream>
 #include <queue>
 #include <sstream>
@@ -5,6 +6,8 @@
 #include <unordered_map>
 #include <vector>
 
+#include "../common/parallel.h"
+
 // #include "wlp4data.h"
 
 using namespace std;
@@ -37,10 +40,16 @@ struct ParseTreeNode {
         return !token.kind.empty();
     }
 
-    // Destructor to clean up memory used by children
+    // Destructor to clean up memory used by children.
+    // Each child's children are taken over before it is deleted, so deep trees don't recurse
     ~ParseTreeNode() {
-        for (auto child : children) {
-            delete child;  // Delete each child
+        vector<ParseTreeNode*> pending = std::move(children);
+        while (!pending.empty()) {
+            ParseTreeNode* child = pending.back();
+            pending.pop_back();
+            pending.insert(pending.end(), child->children.begin(), child->children.end());
+            child->children.clear();
+            delete child;
         }
     }
 
@@ -75,51 +84,72 @@ ostream& operator<<(ostream& os, const ParseTreeNode& node) {
 // procedure_signature is a vector of types
 unordered_map<string, pair<vector<string>, unordered_map<string, string>>> symbol_table;
 
+// procedure name -> position in the source (main is last)
+unordered_map<string, int> procedure_index;
+
+int numJobs = 0;  // 0 => one thread per hardware thread
+
+// State for checking one procedure body. Every procedure gets its own, so bodies can be checked in parallel
+struct ProcedureContext {
+    string name;
+    int index;                                // a procedure can only call itself and the ones before it
+    unordered_map<string, string>* variables;  // this procedure's entry in symbol_table
+};
+
 // indentations = true => indent each level of the tree
-void printParseTree(const ParseTreeNode* node, int level, bool indentations) {
-    if (node == nullptr) return;
+// Uses an explicit stack since statements -> statements statement makes trees as deep as the program is long
+void printParseTree(const ParseTreeNode* root, int rootLevel, bool indentations) {
+    if (root == nullptr) return;
 
-    if (indentations) {
-        // Print indentation based on the level in the tree
-        for (int i = 0; i < level; ++i) {
-            cout << "  ";
-        }
-    }
+    vector<pair<const ParseTreeNode*, int>> stack = {{root, rootLevel}};
+    while (!stack.empty()) {
+        const ParseTreeNode* node = stack.back().first;
+        int level = stack.back().second;
+        stack.pop_back();
 
-    if (node->isTerminal()) {
-        // Print token details if it's a token node, along with its type if available
-        cout << node->token.kind << " " << node->token.lexeme;
-        if (!node->type.empty()) {        // Check if type information is available and not empty
-            cout << " : " << node->type;  // Append type information
+        if (indentations) {
+            // Print indentation based on the level in the tree
+            for (int i = 0; i < level; ++i) {
+                cout << "  ";
+            }
         }
-        cout << endl;
-    } else {
-        // Print production rule
-        cout << node->prodRuleLHS;
 
-        if (indentations) {
-            cout << " -> ";
+        if (node->isTerminal()) {
+            // Print token details if it's a token node, along with its type if available
+            cout << node->token.kind << " " << node->token.lexeme;
+            if (!node->type.empty()) {        // Check if type information is available and not empty
+                cout << " : " << node->type;  // Append type information
+            }
+            cout << '\n';
         } else {
-            cout << " ";
-        }
+            // Print production rule
+            cout << node->prodRuleLHS;
 
-        for (const auto& rhs : node->prodRuleRHS) {
-            cout << rhs << " ";
-        }
+            if (indentations) {
+                cout << " -> ";
+            } else {
+                cout << " ";
+            }
 
-        // Check if type information is available and not empty
-        // Don't want types for arglist
-        if (!node->type.empty() && node->prodRuleLHS != "arglist") {
-            cout << ": " << node->type;  // Append type information
-        }
+            for (const auto& rhs : node->prodRuleRHS) {
+                cout << rhs << " ";
+            }
 
-        cout << endl;
+            // Check if type information is available and not empty
+            // Don't want types for arglist
+            if (!node->type.empty() && node->prodRuleLHS != "arglist") {
+                cout << ": " << node->type;  // Append type information
+            }
+
+            cout << '\n';
 
-        // Recursively print children, including their types if available
-        for (const auto& child : node->children) {
-            printParseTree(child, level + 1, indentations);
+            // Print children next, in order, including their types if available
+            for (auto it = node->children.rbegin(); it != node->children.rend(); ++it) {
+                stack.emplace_back(*it, level + 1);
+            }
         }
     }
+    cout << flush;
 }
 
 void printSymbolTable() {
@@ -139,43 +169,81 @@ void printSymbolTable() {
     }
 }
 
+// Reads a pre-order parse tree from standard input.
+// Uses an explicit stack of unfinished nodes so deep trees don't recurse
 ParseTreeNode* buildParseTree() {
-    string s;
-    getline(std::cin, s);
-    std::istringstream iss(s);  // Use istringstream to treat the string as a stream
+    ParseTreeNode* root = nullptr;
+    vector<ParseTreeNode*> unfinished;  // production rules still waiting on children
 
-    if (isupper(s[0])) {  // Is a terminal
-        std::string kind, lexeme;
-        iss >> kind;
-        iss >> lexeme;
+    string s;
+    do {
+        if (!getline(std::cin, s) && unfinished.empty()) {
+            return nullptr;  // empty input
+        }
+        std::istringstream iss(s);  // Use istringstream to treat the string as a stream
+        ParseTreeNode* node;
+
+        if (isupper(s[0])) {  // Is a terminal
+            std::string kind, lexeme;
+            iss >> kind;
+            iss >> lexeme;
+
+            Token t = Token(kind, lexeme);
+            node = new ParseTreeNode(t);
+        } else {  // Is a production rule
+            std::string prodRuleLHS, prodRuleRHSToken;
+            vector<string> prodRuleRHS;
+            bool isEmpty = false;
+            iss >> prodRuleLHS;
+            while (iss >> prodRuleRHSToken) {
+                if (prodRuleRHSToken == ".EMPTY") {  // Empty terminates the production rule
+                    isEmpty = true;
+                    break;
+                }
 
-        Token t = Token(kind, lexeme);
-        return new ParseTreeNode(t);
-    } else {  // Is a production rule
-        vector<ParseTreeNode*> children;
+                prodRuleRHS.emplace_back(prodRuleRHSToken);
+            }
 
-        std::string prodRuleLHS, prodRuleRHSToken;
-        vector<string> prodRuleRHS;
-        iss >> prodRuleLHS;
-        while (iss >> prodRuleRHSToken) {
-            if (prodRuleRHSToken == ".EMPTY") {  // Empty terminates the production rule
-                Token t = Token(prodRuleLHS, prodRuleRHSToken);
-                return new ParseTreeNode(t);
+            if (isEmpty) {
+                Token t = Token(prodRuleLHS, ".EMPTY");
+                node = new ParseTreeNode(t);
+            } else {
+                node = new ParseTreeNode(prodRuleLHS, prodRuleRHS, {});
+                node->children.reserve(prodRuleRHS.size());
             }
+        }
 
-            prodRuleRHS.emplace_back(prodRuleRHSToken);
+        if (unfinished.empty()) {
+            root = node;
+        } else {
+            unfinished.back()->children.emplace_back(node);
+        }
+        if (!node->isTerminal() && !node->prodRuleRHS.empty()) {
+            unfinished.emplace_back(node);
         }
 
-        for (string prodRuleToken : prodRuleRHS) {
-            children.emplace_back(buildParseTree());
+        // Pop every rule whose children are all read
+        while (!unfinished.empty() && unfinished.back()->children.size() == unfinished.back()->prodRuleRHS.size()) {
+            unfinished.pop_back();
         }
+    } while (!unfinished.empty());
 
-        ParseTreeNode* ptn = new ParseTreeNode(prodRuleLHS, prodRuleRHS, children);
-        return ptn;
+    return root;
+}
+
+// Left-recursive rules like statements -> statements statement build trees as deep as the list is long.
+// Returns the nodes of such a chain in source order (innermost first) so passes can loop instead of recursing
+vector<ParseTreeNode*> flattenLeftChain(ParseTreeNode* node) {
+    vector<ParseTreeNode*> chain;
+    while (!node->isTerminal() && node->prodRuleRHS[0] == node->prodRuleLHS) {
+        chain.emplace_back(node);
+        node = node->children[0];
     }
+    reverse(chain.begin(), chain.end());
+    return chain;
 }
 
-void annotateTypes(ParseTreeNode* node, string function_name, string variable_context) {
+void annotateTypes(ProcedureContext& ctx, ParseTreeNode* node, string function_name) {
     // cout << *node << endl;
     if (node->isTerminal()) {
         // NUM 123
@@ -194,18 +262,18 @@ void annotateTypes(ParseTreeNode* node, string function_name, string variable_co
         // start -> BOF procedures EOF
         if (node->prodRuleLHS == "start") {
             // Annotate procedures
-            annotateTypes(node->children[1], function_name, variable_context);
+            annotateTypes(ctx, node->children[1], function_name);
         }
         // procedures → main
         else if (node->prodRuleLHS == "procedures" && node->prodRuleRHS[0] == "main") {
             // Annotate main
-            annotateTypes(node->children[0], function_name, variable_context);
+            annotateTypes(ctx, node->children[0], function_name);
         }
         // procedures -> procedure procedures
         else if (node->prodRuleLHS == "procedures" && node->prodRuleRHS[0] == "procedure") {
             // Annotate procedure and procedures
-            annotateTypes(node->children[0], function_name, variable_context);
-            annotateTypes(node->children[1], function_name, variable_context);
+            annotateTypes(ctx, node->children[0], function_name);
+            annotateTypes(ctx, node->children[1], function_name);
         }
         // main -> INT WAIN LPAREN dcl COMMA dcl RPAREN LBRACE dcls statements RETURN expr SEMI RBRACE
         else if (node->prodRuleLHS == "main") {
@@ -215,8 +283,8 @@ void annotateTypes(ParseTreeNode* node, string function_name, string variable_co
             ParseTreeNode* secondParam = node->children[5];
 
             // Add to symbol table and check for duplicate param names
-            annotateTypes(firstParam, new_function_name, new_function_name);   // dcl1
-            annotateTypes(secondParam, new_function_name, new_function_name);  // dcl2
+            annotateTypes(ctx, firstParam, new_function_name);   // dcl1
+            annotateTypes(ctx, secondParam, new_function_name);  // dcl2
 
             string secondParamType = secondParam->children[1]->type;  // ID : type
 
@@ -226,12 +294,12 @@ void annotateTypes(ParseTreeNode* node, string function_name, string variable_co
             }
 
             // Annotate the rest of the stuff in main before return
-            annotateTypes(node->children[8], new_function_name, new_function_name);  // dcls
-            annotateTypes(node->children[9], new_function_name, new_function_name);  // statements
+            annotateTypes(ctx, node->children[8], new_function_name);  // dcls
+            annotateTypes(ctx, node->children[9], new_function_name);  // statements
 
             // Check if the return expression of wain is not int type
-            ParseTreeNode* returnExpr = node->children[11];                   // the expr after RETURN
-            annotateTypes(returnExpr, new_function_name, new_function_name);  // Evaluate the type of returnExpr
+            ParseTreeNode* returnExpr = node->children[11];     // the expr after RETURN
+            annotateTypes(ctx, returnExpr, new_function_name);  // Evaluate the type of returnExpr
 
             if (returnExpr && returnExpr->type != "int") {
                 throw std::runtime_error("ERROR: The return expression of wain is not int type.");
@@ -247,19 +315,15 @@ void annotateTypes(ParseTreeNode* node, string function_name, string variable_co
         else if (node->prodRuleLHS == "procedure") {
             // Set the global variable function_name
             string new_function_name = node->children[1]->token.lexeme;
-            // Check if function is already defined
-            if (symbol_table.find(new_function_name) != symbol_table.end()) {
-                throw std::runtime_error("ERROR: Function " + new_function_name + " already declared.");
-            }
-            symbol_table[new_function_name] = make_pair(vector<string>(), unordered_map<string, string>());
+            // The signature was recorded by collectSignatures, which also rejects duplicate names
 
             // Annotate the rest of the stuff in procedure
-            annotateTypes(node->children[3], new_function_name, new_function_name);  // params
-            annotateTypes(node->children[6], new_function_name, new_function_name);  // dcls
-            annotateTypes(node->children[7], new_function_name, new_function_name);  // statements
-                                                                                     // Check if the return expression of wain is not int type
-            ParseTreeNode* returnExpr = node->children[9];                           // the expr after RETURN
-            annotateTypes(returnExpr, new_function_name, new_function_name);         // Evaluate the type of returnExpr
+            annotateTypes(ctx, node->children[3], new_function_name);  // params
+            annotateTypes(ctx, node->children[6], new_function_name);  // dcls
+            annotateTypes(ctx, node->children[7], new_function_name);  // statements
+                                                                       // Check if the return expression of wain is not int type
+            ParseTreeNode* returnExpr = node->children[9];             // the expr after RETURN
+            annotateTypes(ctx, returnExpr, new_function_name);         // Evaluate the type of returnExpr
 
             if (returnExpr && returnExpr->type != "int") {
                 throw std::runtime_error("ERROR: The return expression of function " + new_function_name + " is not int type.");
@@ -272,31 +336,17 @@ void annotateTypes(ParseTreeNode* node, string function_name, string variable_co
 
         // params → paramlist
         else if (node->prodRuleLHS == "params" && node->prodRuleRHS[0] == "paramlist") {
-            // Get the dcl type and add it to the function signature vector
-            annotateTypes(node->children[0], function_name, variable_context);
+            // Add the parameters to the procedure's variables
+            annotateTypes(ctx, node->children[0], function_name);
         }
 
         // paramlist → dcl
         // paramlist → dcl COMMA paramlist
         else if (node->prodRuleLHS == "paramlist") {
-            // Get the dcl type and add it to the function signature vector
-            annotateTypes(node->children[0], function_name, variable_context);
-            ParseTreeNode* dclNode = node->children[0];  // dcl -> type ID
-            string dclType;
-
-            // Determine the type
-            if (dclNode->children[0]->prodRuleRHS.size() > 1 &&  // INT STAR
-                dclNode->children[0]->prodRuleRHS[0] == "INT" &&
-                dclNode->children[0]->prodRuleRHS[1] == "STAR") {
-                dclType = "int*";
-            } else if (dclNode->children[0]->prodRuleRHS.size() > 0 &&
-                       dclNode->children[0]->prodRuleRHS[0] == "INT") {  // INT
-                dclType = "int";
-            }
-
-            symbol_table[variable_context].first.emplace_back(dclType);
+            // Add the parameter to the procedure's variables (its type is already in the signature)
+            annotateTypes(ctx, node->children[0], function_name);
             if (node->prodRuleRHS.size() == 3) {
-                annotateTypes(node->children[2], function_name, variable_context);
+                annotateTypes(ctx, node->children[2], function_name);
             }
         }
 
@@ -316,10 +366,10 @@ void annotateTypes(ParseTreeNode* node, string function_name, string variable_co
             }
 
             // Check if variable already exists
-            if (symbol_table[variable_context].second.find(variableName) != symbol_table[variable_context].second.end()) {
+            if ((*ctx.variables).find(variableName) != (*ctx.variables).end()) {
                 throw std::runtime_error("ERROR: Duplicate variable " + variableName + " found in function " + function_name);
             } else {
-                symbol_table[variable_context].second[variableName] = variableType;
+                (*ctx.variables)[variableName] = variableType;
                 node->children[1]->type = variableType;
             }
         }
@@ -327,29 +377,29 @@ void annotateTypes(ParseTreeNode* node, string function_name, string variable_co
         // dcls -> dcls dcl BECOMES NUM SEMI
         // dcls -> dcls dcl BECOMES NULL SEMI
         else if (node->prodRuleLHS == "dcls" && node->prodRuleRHS.size() == 5) {
-            // annotateTypes for dcls and dcl
-            annotateTypes(node->children[0], function_name, variable_context);
-            annotateTypes(node->children[1], function_name, variable_context);
-
-            // Get the type of dcls and check if it matches NUM or NULL
-
-            string variableName = node->children[1]->children[1]->token.lexeme;
-
-            // Lookup type from symbol table
-            string variableType = symbol_table[variable_context].second[variableName];
-
-            if (node->prodRuleRHS[3] == "NUM") {
-                if (variableType != "int") {
-                    throw std::runtime_error("ERROR: Variable " + variableName + " assigned wrong type (Expected int), got: " + variableType);
-                }
-                node->children[3]->type = "int";
-            } else if (node->prodRuleRHS[3] == "NULL") {
-                if (variableType != "int*") {
-                    throw std::runtime_error("ERROR: Variable " + variableName + " assigned wrong type (Expected int*), got: " + variableType);
+            // Loop over the whole declaration list instead of recursing into dcls
+            for (ParseTreeNode* dcls : flattenLeftChain(node)) {
+                annotateTypes(ctx, dcls->children[1], function_name);  // dcl
+
+                // Get the type of dcls and check if it matches NUM or NULL
+
+                string variableName = dcls->children[1]->children[1]->token.lexeme;
+
+                // Lookup type from symbol table
+                string variableType = (*ctx.variables)[variableName];
+
+                if (dcls->prodRuleRHS[3] == "NUM") {
+                    if (variableType != "int") {
+                        throw std::runtime_error("ERROR: Variable " + variableName + " assigned wrong type (Expected int), got: " + variableType);
+                    }
+                    dcls->children[3]->type = "int";
+                } else if (dcls->prodRuleRHS[3] == "NULL") {
+                    if (variableType != "int*") {
+                        throw std::runtime_error("ERROR: Variable " + variableName + " assigned wrong type (Expected int*), got: " + variableType);
+                    }
+                    dcls->children[3]->type = "int*";
                 }
-                node->children[3]->type = "int*";
             }
-
         }
 
         // Check for variable usage
@@ -360,12 +410,12 @@ void annotateTypes(ParseTreeNode* node, string function_name, string variable_co
             string variableName = node->children[0]->token.lexeme;
 
             // Check if ID (varaible name) has been declared in synbol table
-            if (symbol_table[variable_context].second.find(variableName) == symbol_table[variable_context].second.end()) {
+            if ((*ctx.variables).find(variableName) == (*ctx.variables).end()) {
                 throw std::runtime_error("ERROR: Variable " + variableName + " used without declaration in function " + function_name);
             }
 
             // If it exists in symbol table, check it's type, and annotate
-            string variableType = symbol_table[variable_context].second[variableName];
+            string variableType = (*ctx.variables)[variableName];
             node->type = variableType;               // factor (or lvalue) ID : type
             node->children[0]->type = variableType;  // ID a : type
         }
@@ -374,8 +424,8 @@ void annotateTypes(ParseTreeNode* node, string function_name, string variable_co
         // expr -> expr MINUS term
         else if (node->prodRuleLHS == "expr" && node->prodRuleRHS.size() == 3) {
             // Get the type of expr and term
-            annotateTypes(node->children[0], function_name, variable_context);
-            annotateTypes(node->children[2], function_name, variable_context);
+            annotateTypes(ctx, node->children[0], function_name);
+            annotateTypes(ctx, node->children[2], function_name);
 
             string exprType = node->children[0]->type;
             string termType = node->children[2]->type;
@@ -410,8 +460,8 @@ void annotateTypes(ParseTreeNode* node, string function_name, string variable_co
         // term → term PCT factor
         else if (node->prodRuleLHS == "term" && node->prodRuleRHS.size() == 3) {
             // Get the type of expr and term
-            annotateTypes(node->children[0], function_name, variable_context);
-            annotateTypes(node->children[2], function_name, variable_context);
+            annotateTypes(ctx, node->children[0], function_name);
+            annotateTypes(ctx, node->children[2], function_name);
 
             string termType = node->children[0]->type;
             string factorType = node->children[2]->type;
@@ -425,7 +475,7 @@ void annotateTypes(ParseTreeNode* node, string function_name, string variable_co
 
         // factor -> AMP lvalue
         else if (node->prodRuleLHS == "factor" && node->prodRuleRHS[0] == "AMP") {
-            annotateTypes(node->children[1], function_name, variable_context);
+            annotateTypes(ctx, node->children[1], function_name);
             string lvalueType = node->children[1]->type;
             if (lvalueType != "int") {
                 throw std::runtime_error("ERROR: Attempting to get an address of a non-integer");
@@ -436,7 +486,7 @@ void annotateTypes(ParseTreeNode* node, string function_name, string variable_co
         // factor -> STAR factor
         // lvalue → STAR factor
         else if ((node->prodRuleLHS == "factor" || node->prodRuleLHS == "lvalue") && node->prodRuleRHS[0] == "STAR") {
-            annotateTypes(node->children[1], function_name, variable_context);
+            annotateTypes(ctx, node->children[1], function_name);
             string factorType = node->children[1]->type;
             if (factorType != "int*") {
                 throw std::runtime_error("ERROR: Attempting to dereference a non-pointer");
@@ -446,7 +496,7 @@ void annotateTypes(ParseTreeNode* node, string function_name, string variable_co
 
         // factor → NEW INT LBRACK expr RBRACK
         else if (node->prodRuleLHS == "factor" && node->prodRuleRHS[0] == "NEW") {
-            annotateTypes(node->children[3], function_name, variable_context);
+            annotateTypes(ctx, node->children[3], function_name);
             string exprType = node->children[3]->type;
             if (exprType != "int") {
                 throw std::runtime_error("ERROR: Attempting to allocate array with non-int size");
@@ -456,7 +506,7 @@ void annotateTypes(ParseTreeNode* node, string function_name, string variable_co
 
         // lvalue → LPAREN lvalue RPAREN
         else if (node->prodRuleLHS == "lvalue" && node->prodRuleRHS.size() == 3) {
-            annotateTypes(node->children[1], function_name, variable_context);
+            annotateTypes(ctx, node->children[1], function_name);
             string lvalueType = node->children[1]->type;
             node->type = lvalueType;
         }
@@ -467,15 +517,16 @@ void annotateTypes(ParseTreeNode* node, string function_name, string variable_co
             // Get function (ID) name for the function being called
             string called_function_name = node->children[0]->token.lexeme;
 
-            // Check if the called function has been declared in the symbol table
-            if (symbol_table.find(called_function_name) == symbol_table.end()) {
+            // Check if the called function has been declared before this point in the source
+            auto calledIndex = procedure_index.find(called_function_name);
+            if (calledIndex == procedure_index.end() || calledIndex->second > ctx.index) {
                 throw std::runtime_error("ERROR: Function " + called_function_name + " used without declaration.");
             }
 
             // factor → ID LPAREN RPAREN
             if (node->prodRuleRHS.size() == 3) {
                 // Check function accepts 0 arguments
-                if (symbol_table[called_function_name].first.size() != 0) {
+                if (symbol_table.at(called_function_name).first.size() != 0) {
                     throw std::runtime_error("ERROR: Function " + called_function_name + " called with wrong number of arguments.");
                 }
             }
@@ -485,7 +536,7 @@ void annotateTypes(ParseTreeNode* node, string function_name, string variable_co
 
             // Validate the function call, including its arguments if any
             if (node->prodRuleRHS.size() == 4) {
-                annotateTypes(node->children[2], function_name, variable_context);  // annotate arglist
+                annotateTypes(ctx, node->children[2], function_name);  // annotate arglist
             }
             // Since a function call is being processed, assume its return type is int
             node->type = "int";  // factor (or lvalue) ID : type
@@ -494,16 +545,16 @@ void annotateTypes(ParseTreeNode* node, string function_name, string variable_co
         // only runs when there is only 1 argument
         // arglist → expr
         else if (node->prodRuleLHS == "arglist" && node->prodRuleRHS.size() == 1) {
-            annotateTypes(node->children[0], function_name, variable_context);
+            annotateTypes(ctx, node->children[0], function_name);
 
             node->type = node->children[0]->type;
 
             // Go through argvector and compare it with the function signature
-            if (symbol_table[function_name].first.size() != 1) {  // only 1 arg
+            if (symbol_table.at(function_name).first.size() != 1) {  // only 1 arg
                 throw std::runtime_error("ERROR: Function " + function_name + " called with wrong number of arguments.");
             }
 
-            if (node->type != symbol_table[function_name].first[0]) {
+            if (node->type != symbol_table.at(function_name).first[0]) {
                 throw std::runtime_error("ERROR: Function " + function_name + " called with wrong argument types.");
             }
         }
@@ -518,7 +569,7 @@ void annotateTypes(ParseTreeNode* node, string function_name, string variable_co
 
             // arglist → expr COMMA arglist
             while (argNode->prodRuleRHS.size() == 3) {
-                annotateTypes(argNode->children[0], function_name, variable_context);  // get the type for expr
+                annotateTypes(ctx, argNode->children[0], function_name);  // get the type for expr
                                                                                        // annotateTypes(argNode->children[2]);  // annotate arglist
 
                 string argType = argNode->children[0]->type;
@@ -528,17 +579,17 @@ void annotateTypes(ParseTreeNode* node, string function_name, string variable_co
             }
 
             // arglist → expr
-            annotateTypes(argNode->children[0], function_name, variable_context);  // get the type for expr
+            annotateTypes(ctx, argNode->children[0], function_name);  // get the type for expr
             string argType = argNode->children[0]->type;
             argVector.emplace_back(argType);
 
             // Go through argvector and compare it with the function signature
-            if (argVector.size() != symbol_table[function_name].first.size()) {
+            if (argVector.size() != symbol_table.at(function_name).first.size()) {
                 throw std::runtime_error("ERROR: Function " + function_name + " called with wrong number of arguments.");
             }
 
-            for (int i = 0; i < symbol_table[function_name].first.size(); i++) {
-                if (argVector[i] != symbol_table[function_name].first[i]) {
+            for (int i = 0; i < symbol_table.at(function_name).first.size(); i++) {
+                if (argVector[i] != symbol_table.at(function_name).first[i]) {
                     throw std::runtime_error("ERROR: Function " + function_name + " called with wrong argument types.");
                 }
             }
@@ -547,14 +598,14 @@ void annotateTypes(ParseTreeNode* node, string function_name, string variable_co
         // expr -> term
         else if (node->prodRuleLHS == "expr" && node->prodRuleRHS[0] == "term") {
             // Get the type of term and assign it to the type of expr
-            annotateTypes(node->children[0], function_name, variable_context);
+            annotateTypes(ctx, node->children[0], function_name);
             node->type = node->children[0]->type;
             node->wellTyped = true;
         }
         // term -> factor
         else if (node->prodRuleLHS == "term" && node->prodRuleRHS[0] == "factor") {
             // Get the type of factor and assign it to the type of term
-            annotateTypes(node->children[0], function_name, variable_context);
+            annotateTypes(ctx, node->children[0], function_name);
             node->type = node->children[0]->type;
         }
         // factor -> NUM
@@ -570,7 +621,7 @@ void annotateTypes(ParseTreeNode* node, string function_name, string variable_co
         // factor -> LPAREN expr RPAREN
         else if (node->prodRuleLHS == "factor" && node->prodRuleRHS[0] == "LPAREN") {
             // Get the type of expr and assign it to the type of factor
-            annotateTypes(node->children[1], function_name, variable_context);
+            annotateTypes(ctx, node->children[1], function_name);
             node->type = node->children[1]->type;
         }
         // statements → .EMPTY
@@ -579,19 +630,22 @@ void annotateTypes(ParseTreeNode* node, string function_name, string variable_co
         }
         // statements → statements statement
         else if (node->prodRuleLHS == "statements" && node->prodRuleRHS[0] == "statements") {
-            // Make sure lvalue and expr have the same type
-            annotateTypes(node->children[0], function_name, variable_context);
-            annotateTypes(node->children[1], function_name, variable_context);
-
-            if (node->children[0]->wellTyped && node->children[2]->wellTyped) {
-                node->wellTyped = true;
+            // Loop over the whole statement list instead of recursing into statements
+            for (ParseTreeNode* statements : flattenLeftChain(node)) {
+                annotateTypes(ctx, statements->children[1], function_name);
+
+                // statements → .EMPTY is a terminal, so it is well typed without being annotated
+                ParseTreeNode* previous = statements->children[0];
+                if ((previous->isTerminal() || previous->wellTyped) && statements->children[1]->wellTyped) {
+                    statements->wellTyped = true;
+                }
             }
         }
         // statement → lvalue BECOMES expr SEMI
         else if (node->prodRuleLHS == "statement" && node->prodRuleRHS[0] == "lvalue") {
             // Make sure lvalue and expr have the same type
-            annotateTypes(node->children[0], function_name, variable_context);
-            annotateTypes(node->children[2], function_name, variable_context);
+            annotateTypes(ctx, node->children[0], function_name);
+            annotateTypes(ctx, node->children[2], function_name);
 
             if (node->children[0]->type == node->children[2]->type) {
                 node->wellTyped = true;
@@ -602,9 +656,9 @@ void annotateTypes(ParseTreeNode* node, string function_name, string variable_co
         // statement → IF LPAREN test RPAREN LBRACE statements RBRACE ELSE LBRACE statements RBRACE
         else if (node->prodRuleLHS == "statement" && node->prodRuleRHS[0] == "IF") {
             // Make sure test is well typed and statements are well typed
-            annotateTypes(node->children[2], function_name, variable_context);
-            annotateTypes(node->children[5], function_name, variable_context);
-            annotateTypes(node->children[9], function_name, variable_context);
+            annotateTypes(ctx, node->children[2], function_name);
+            annotateTypes(ctx, node->children[5], function_name);
+            annotateTypes(ctx, node->children[9], function_name);
 
             if (node->children[2]->wellTyped && node->children[5]->wellTyped && node->children[9]->wellTyped) {
                 node->wellTyped = true;
@@ -613,8 +667,8 @@ void annotateTypes(ParseTreeNode* node, string function_name, string variable_co
         // statement → WHILE LPAREN test RPAREN LBRACE statements RBRACE
         else if (node->prodRuleLHS == "statement" && node->prodRuleRHS[0] == "WHILE") {
             // Make sure test is well typed and statements are well typed
-            annotateTypes(node->children[2], function_name, variable_context);
-            annotateTypes(node->children[5], function_name, variable_context);
+            annotateTypes(ctx, node->children[2], function_name);
+            annotateTypes(ctx, node->children[5], function_name);
 
             if (node->children[2]->wellTyped && node->children[5]->wellTyped) {
                 node->wellTyped = true;
@@ -623,7 +677,7 @@ void annotateTypes(ParseTreeNode* node, string function_name, string variable_co
         // statement → PRINTLN LPAREN expr RPAREN SEMI
         else if (node->prodRuleLHS == "statement" && node->prodRuleRHS[0] == "PRINTLN") {
             // Get the type of expr and assign it to the type of factor
-            annotateTypes(node->children[2], function_name, variable_context);
+            annotateTypes(ctx, node->children[2], function_name);
             if (node->children[2]->type == "int") {
                 node->wellTyped = true;
             } else {
@@ -633,7 +687,7 @@ void annotateTypes(ParseTreeNode* node, string function_name, string variable_co
         // statement → DELETE LBRACK RBRACK expr SEMI
         else if (node->prodRuleLHS == "statement" && node->prodRuleRHS[0] == "DELETE") {
             // Get the type of expr and check its type
-            annotateTypes(node->children[3], function_name, variable_context);
+            annotateTypes(ctx, node->children[3], function_name);
             if (node->children[3]->type == "int*") {
                 node->wellTyped = true;
             } else {
@@ -648,8 +702,8 @@ void annotateTypes(ParseTreeNode* node, string function_name, string variable_co
         // test → expr GT expr
         else if (node->prodRuleLHS == "test") {
             // Get the type of expr1 and expr 2
-            annotateTypes(node->children[0], function_name, variable_context);
-            annotateTypes(node->children[2], function_name, variable_context);
+            annotateTypes(ctx, node->children[0], function_name);
+            annotateTypes(ctx, node->children[2], function_name);
             if (node->children[0]->type == node->children[2]->type) {
                 node->wellTyped = true;
             } else {
@@ -659,12 +713,115 @@ void annotateTypes(ParseTreeNode* node, string function_name, string variable_co
     }
 }
 
-int main() {
+// type -> INT
+// type -> INT STAR
+string getDclType(ParseTreeNode* dclNode) {
+    if (dclNode->children[0]->prodRuleRHS.size() > 1) {
+        return "int*";
+    }
+    return "int";
+}
+
+// Returns every procedure in source order, main last
+// start -> BOF procedures EOF
+vector<ParseTreeNode*> collectProcedures(ParseTreeNode* root) {
+    vector<ParseTreeNode*> procedures;
+    ParseTreeNode* node = root->children[1];
+    while (node->prodRuleRHS[0] == "procedure") {  // procedures -> procedure procedures
+        procedures.emplace_back(node->children[0]);
+        node = node->children[1];
+    }
+    procedures.emplace_back(node->children[0]);  // procedures -> main
+    return procedures;
+}
+
+// Pass 1: record every procedure's signature so bodies can be checked independently.
+// Duplicate names are reported in errors at the index of the second definition
+void collectSignatures(const vector<ParseTreeNode*>& procedures, vector<string>& errors) {
+    for (size_t i = 0; i < procedures.size(); i++) {
+        ParseTreeNode* node = procedures[i];
+        if (node->prodRuleLHS == "main") {
+            symbol_table["wain"];
+            procedure_index["wain"] = i;
+            continue;
+        }
+
+        // procedure → INT ID LPAREN params RPAREN LBRACE dcls statements RETURN expr SEMI RBRACE
+        string name = node->children[1]->token.lexeme;
+        if (procedure_index.find(name) != procedure_index.end()) {
+            errors[i] = "ERROR: Function " + name + " already declared.";
+            continue;
+        }
+        procedure_index[name] = i;
+
+        vector<string>& signature = symbol_table[name].first;
+        ParseTreeNode* params = node->children[3];
+        if (params->isTerminal()) {  // params → .EMPTY
+            continue;
+        }
+        // paramlist → dcl
+        // paramlist → dcl COMMA paramlist
+        for (ParseTreeNode* paramlist = params->children[0];; paramlist = paramlist->children[2]) {
+            signature.emplace_back(getDclType(paramlist->children[0]));
+            if (paramlist->prodRuleRHS.size() != 3) {
+                break;
+            }
+        }
+    }
+}
+
+int main(int argc, char* argv[]) {
     ParseTreeNode* root;
 
+    for (int i = 1; i < argc; i++) {
+        string option = argv[i];
+        if (option == "-j" && i + 1 < argc) {
+            try {
+                numJobs = stoi(argv[++i]);
+            } catch (const logic_error&) {
+                cerr << "ERROR: Bad option value" << endl;
+                return 1;
+            }
+        } else {
+            cerr << "ERROR: Unknown option " << option << endl;
+            return 1;
+        }
+    }
+
     try {
         root = buildParseTree();
-        annotateTypes(root, "", "");
+        if (root == nullptr) {  // empty input
+            return 0;
+        }
+
+        vector<ParseTreeNode*> procedures = collectProcedures(root);
+        vector<string> errors(procedures.size());
+        collectSignatures(procedures, errors);
+
+        // Pass 2: check the bodies in parallel. Each one only writes to its own subtree and variables
+        vector<ProcedureContext> contexts(procedures.size());
+        for (size_t i = 0; i < procedures.size(); i++) {
+            string name = procedures[i]->prodRuleLHS == "main" ? "wain" : procedures[i]->children[1]->token.lexeme;
+            contexts[i] = {name, int(i), &symbol_table.at(name).second};
+        }
+        parallelFor(procedures.size(), numJobs, [&](size_t i) {
+            if (!errors[i].empty()) {  // duplicate definition
+                return;
+            }
+            try {
+                annotateTypes(contexts[i], procedures[i], "");
+            } catch (const std::runtime_error& e) {
+                errors[i] = e.what();
+            }
+        });
+
+        // Report the earliest error in the source, regardless of which thread found it first
+        for (const string& error : errors) {
+            if (!error.empty()) {
+                throw std::runtime_error(error);
+            }
+        }
+
         // printSymbolTable();  // Print the contents of the symbol table
         printParseTree(root, 0, false);
         delete root;  // Ensure we still clean up memory if no exception was thrown
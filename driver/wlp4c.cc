@@ -0,0 +1,798 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "../common/parallel.h"
+
+using namespace std;
+namespace fs = std::filesystem;
+
+// Compiles a WLP4 program on stdin to a linked program, running each stage as its own process.
+// wlp4gen writes one object per procedure into the cache, named by a hash of its content, so only
+// procedures that changed since the last build are generated and assembled again before relinking.
+
+// Everything one compilation depends on. Each compilation gets its own copy, so a server can run many at once
+struct CompileOptions {
+    // Directory holding the stage tools. Empty => look them up on PATH
+    string binDir;
+    // Directory of cached objects
+    string cacheDir = ".wlp4c-cache";
+    // Directory holding print.asm and alloc.asm. Empty => leave the runtime imports for a later link
+    string runtimeDir;
+    // Options passed through to wlp4gen
+    vector<string> genOptions;
+    // The ones among them that change the output, for the result cache key
+    string outputOptions;
+    // Directory of whole compiled programs (--result-cache). Empty => don't cache results
+    string resultCacheDir;
+    // Also keep each stage's output (tokens, parse tree, typed tree) in the result cache
+    bool cacheStages = false;
+    // Size the result cache is trimmed to after every store
+    uintmax_t resultCacheLimit = 256 << 20;
+    // Number of objects assembled at the same time. 0 => one per core
+    int numJobs = 0;
+    // Where to write the linked program's symbol map (--symbols). Empty => don't
+    string symbolsPath;
+};
+
+const uint64_t FNV_OFFSET = 0xcbf29ce484222325ULL;
+const uint64_t FNV_PRIME = 0x100000001b3ULL;
+
+uint64_t fnv1a(uint64_t hash, const string& text) {
+    for (unsigned char c : text) {
+        hash = (hash ^ c) * FNV_PRIME;
+    }
+    return (hash ^ 0xff) * FNV_PRIME;
+}
+
+string toHex(uint64_t hash) {
+    char key[17];
+    snprintf(key, sizeof(key), "%016llx", (unsigned long long)hash);
+    return key;
+}
+
+string readFile(const string& path) {
+    ifstream file(path, ios::binary);
+    if (!file) {
+        throw runtime_error("ERROR: Cannot open " + path);
+    }
+    ostringstream contents;
+    contents << file.rdbuf();
+    return contents.str();
+}
+
+// Suffix for temporary files, unique across threads and processes sharing the cache
+string uniqueSuffix() {
+    return ".tmp" + to_string(getpid()) + "." + to_string(hash<thread::id>()(this_thread::get_id()));
+}
+
+string shellQuote(const string& text) {
+    string quoted = "'";
+    for (char c : text) {
+        if (c == '\'') {
+            quoted += "'\\''";
+        } else {
+            quoted += c;
+        }
+    }
+    return quoted + "'";
+}
+
+string findTool(const CompileOptions& options, const string& name) {
+    if (!options.binDir.empty()) {
+        return options.binDir + "/" + name;
+    }
+    const char* path = getenv("PATH");
+    istringstream dirs(path ? path : "");
+    for (string dir; getline(dirs, dir, ':');) {
+        if (!dir.empty() && fs::exists(dir + "/" + name)) {
+            return dir + "/" + name;
+        }
+    }
+    throw runtime_error("ERROR: Cannot find " + name);
+}
+
+string tool(const CompileOptions& options, const string& name) {
+    return shellQuote(options.binDir.empty() ? name : options.binDir + "/" + name);
+}
+
+// Runs a shell command with its stderr going to errorPath.
+// If it fails, the tool's own error message is thrown, so it reaches whoever asked for the compilation
+void run(const string& name, const string& command, const string& errorPath) {
+    int status = system((command + " 2> " + shellQuote(errorPath)).c_str());
+    if (status == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        string message = readFile(errorPath);
+        while (!message.empty() && message.back() == '\n') {
+            message.pop_back();
+        }
+        throw runtime_error(message.empty() ? "ERROR: " + name + " failed" : message);
+    }
+}
+
+// Identifies the tools that would run. A rebuilt tool has a new size or modification time,
+// which changes every object and result key without having to read the binaries.
+// Worked out once per tool directory, so a server has to be restarted after the tools are rebuilt
+uint64_t buildId(const CompileOptions& options) {
+    static mutex buildIdsMutex;
+    static map<string, uint64_t> buildIds;
+    lock_guard<mutex> lock(buildIdsMutex);
+    auto known = buildIds.find(options.binDir);
+    if (known != buildIds.end()) {
+        return known->second;
+    }
+
+    uint64_t hash = FNV_OFFSET;
+    for (const char* name : {"wlp4scan", "wlp4parse", "wlp4type", "wlp4gen", "asm", "linker"}) {
+        string path = findTool(options, name);
+        hash = fnv1a(hash, name);
+        hash = fnv1a(hash, to_string(fs::file_size(path)));
+        hash = fnv1a(hash, to_string(fs::last_write_time(path).time_since_epoch().count()));
+    }
+    buildIds[options.binDir] = hash;
+    return hash;
+}
+
+// Assembles cacheDir/<key>.asm into cacheDir/<key>.merl, with its symbol map in cacheDir/<key>.sym for
+// the linker, unless they're already there
+void assembleObject(const CompileOptions& options, const string& key) {
+    string object = options.cacheDir + "/" + key;
+    if (fs::exists(object + ".merl") && fs::exists(object + ".sym")) {
+        return;
+    }
+    // Another build sharing the cache may be assembling the same object, so write it under a unique name first
+    string temporary = object + ".merl" + uniqueSuffix();
+    string temporarySymbols = object + ".sym" + uniqueSuffix();
+    try {
+        run("asm", tool(options, "asm") + " --merl --symbols " + shellQuote(temporarySymbols) + " < " +
+                       shellQuote(object + ".asm") + " > " + shellQuote(temporary),
+            temporary + ".err");
+    } catch (...) {
+        fs::remove(temporary);
+        fs::remove(temporarySymbols);
+        fs::remove(temporary + ".err");
+        throw;
+    }
+    fs::remove(temporary + ".err");
+    // The map goes first, so an object whose .merl is there always has one
+    fs::rename(temporarySymbols, object + ".sym");
+    fs::rename(temporary, object + ".merl");
+}
+
+// Copies a runtime module into the cache under the hash of its source and the tools, and returns its key
+string cacheRuntimeModule(const CompileOptions& options, const string& name) {
+    string source = readFile(options.runtimeDir + "/" + name);
+    string key = toHex(fnv1a(fnv1a(fnv1a(FNV_OFFSET, toHex(buildId(options))), name), source));
+    string path = options.cacheDir + "/" + key + ".asm";
+    if (!fs::exists(path)) {
+        string temporary = path + uniqueSuffix();
+        ofstream(temporary, ios::binary) << source;
+        fs::rename(temporary, path);
+    }
+    return key;
+}
+
+void writeOutput(const string& contents, const string& outputPath) {
+    if (outputPath.empty()) {
+        cout.write(contents.data(), contents.size());
+        cout.flush();
+        return;
+    }
+    ofstream file(outputPath, ios::binary);
+    if (!(file << contents)) {
+        throw runtime_error("ERROR: Cannot write " + outputPath);
+    }
+}
+
+// Key of a whole compiled program: the source, the tools, and everything that changes the output
+string resultKey(const CompileOptions& options, const string& source) {
+    uint64_t hash = fnv1a(FNV_OFFSET, "wlp4c-result-1");
+    hash = fnv1a(hash, toHex(buildId(options)));
+    hash = fnv1a(hash, options.outputOptions);
+    if (!options.runtimeDir.empty()) {
+        hash = fnv1a(hash, readFile(options.runtimeDir + "/print.asm"));
+        hash = fnv1a(hash, readFile(options.runtimeDir + "/alloc.asm"));
+    }
+    return toHex(fnv1a(hash, source));
+}
+
+// Holds an exclusive lock on the result cache, so concurrent builds update its stats and evict one at a time
+class ResultCacheLock {
+    int fd;
+
+  public:
+    ResultCacheLock(const string& dir) {
+        fd = open((dir + "/lock").c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd < 0 || flock(fd, LOCK_EX) != 0) {
+            throw runtime_error("ERROR: Cannot lock " + dir);
+        }
+    }
+    ~ResultCacheLock() {
+        close(fd);
+    }
+};
+
+struct ResultCacheStats {
+    uint64_t hits = 0, misses = 0, bytesSaved = 0;
+};
+
+ResultCacheStats readStats(const string& dir) {
+    ResultCacheStats stats;
+    ifstream(dir + "/stats") >> stats.hits >> stats.misses >> stats.bytesSaved;
+    return stats;
+}
+
+void recordResult(const string& dir, bool hit, uint64_t bytes) {
+    ResultCacheLock lock(dir);
+    ResultCacheStats stats = readStats(dir);
+    if (hit) {
+        stats.hits++;
+        stats.bytesSaved += bytes;
+    } else {
+        stats.misses++;
+    }
+    ofstream(dir + "/stats") << stats.hits << " " << stats.misses << " " << stats.bytesSaved << endl;
+}
+
+// An entry is every file named <key>.*, dated by its program, which is touched on every hit
+struct ResultCacheEntry {
+    fs::file_time_type lastUsed;
+    uintmax_t size = 0;
+    vector<fs::path> files;
+};
+
+map<string, ResultCacheEntry> resultCacheEntries(const string& dir) {
+    map<string, ResultCacheEntry> entries;
+    for (const auto& file : fs::directory_iterator(dir)) {
+        string name = file.path().filename().string();
+        size_t dot = name.find('.');
+        if (dot == string::npos || !file.is_regular_file()) {
+            continue;  // lock, stats
+        }
+        ResultCacheEntry& entry = entries[name.substr(0, dot)];
+        entry.size += file.file_size();
+        entry.files.push_back(file.path());
+        if (file.path().extension() == ".out") {
+            entry.lastUsed = file.last_write_time();
+        }
+    }
+    return entries;
+}
+
+// Removes the least recently used entries until the cache fits in resultCacheLimit
+void evictResults(const CompileOptions& options) {
+    ResultCacheLock lock(options.resultCacheDir);
+    map<string, ResultCacheEntry> entries = resultCacheEntries(options.resultCacheDir);
+    uintmax_t total = 0;
+    vector<const ResultCacheEntry*> byAge;
+    for (const auto& [key, entry] : entries) {
+        total += entry.size;
+        byAge.push_back(&entry);
+    }
+    sort(byAge.begin(), byAge.end(), [](const ResultCacheEntry* a, const ResultCacheEntry* b) {
+        return a->lastUsed < b->lastUsed;
+    });
+    for (const ResultCacheEntry* entry : byAge) {
+        if (total <= options.resultCacheLimit) {
+            break;
+        }
+        for (const auto& file : entry->files) {
+            fs::remove(file);
+        }
+        total -= entry->size;
+    }
+}
+
+void printResultCacheStats(const CompileOptions& options) {
+    fs::create_directories(options.resultCacheDir);
+    ResultCacheLock lock(options.resultCacheDir);
+    ResultCacheStats stats = readStats(options.resultCacheDir);
+    uintmax_t size = 0;
+    map<string, ResultCacheEntry> entries = resultCacheEntries(options.resultCacheDir);
+    for (const auto& [key, entry] : entries) {
+        size += entry.size;
+    }
+    cout << "hits: " << stats.hits << endl;
+    cout << "misses: " << stats.misses << endl;
+    cout << "bytes saved: " << stats.bytesSaved << endl;
+    cout << "entries: " << entries.size() << endl;
+    cout << "size: " << size << " / " << options.resultCacheLimit << endl;
+}
+
+// Counts lines, which for the scanner's output is the number of tokens
+uint64_t countLines(const string& path) {
+    string text = readFile(path);
+    return count(text.begin(), text.end(), '\n');
+}
+
+// Compiles source and returns the linked program.
+// If tokens isn't null, it is set to the number of tokens scanned (0 when the result came from the cache)
+string compile(const CompileOptions& options, const string& source, uint64_t* tokens = nullptr) {
+    if (tokens) {
+        *tokens = 0;
+    }
+    string key;
+    if (!options.resultCacheDir.empty()) {
+        fs::create_directories(options.resultCacheDir);
+        key = resultKey(options, source);
+        string cached = options.resultCacheDir + "/" + key + ".out";
+        string cachedSymbols = options.resultCacheDir + "/" + key + ".sym";
+        // Entries stored without --symbols have no map, so they only count as a hit without it
+        if (fs::exists(cached) && (options.symbolsPath.empty() || fs::exists(cachedSymbols))) {
+            if (!options.symbolsPath.empty()) {
+                fs::copy_file(cachedSymbols, options.symbolsPath, fs::copy_options::overwrite_existing);
+            }
+            string program = readFile(cached);
+            fs::last_write_time(cached, fs::file_time_type::clock::now());
+            recordResult(options.resultCacheDir, true, program.size());
+            return program;
+        }
+    }
+
+    fs::create_directories(options.cacheDir);
+    // Scratch space for the stage outputs of this build
+    string workTemplate = options.cacheDir + "/build.XXXXXX";
+    if (!mkdtemp(workTemplate.data())) {
+        throw runtime_error("ERROR: Cannot create a directory in " + options.cacheDir);
+    }
+    string workDir = workTemplate;
+    string errors = workDir + "/errors";
+
+    try {
+        string input = workDir + "/input.wlp4";
+        ofstream(input, ios::binary) << source;
+
+        // Objects are keyed by the tools that made them as well as by what wlp4gen knows
+        string genCommand = tool(options, "wlp4gen") + " --objects " + shellQuote(options.cacheDir) + " --key-salt " +
+                            toHex(buildId(options));
+        for (const auto& option : options.genOptions) {
+            genCommand += " " + shellQuote(option);
+        }
+
+        // Every stage goes through a file, so a failing stage stops the build right there
+        run("wlp4scan", tool(options, "wlp4scan") + " < " + shellQuote(input) + " > " + shellQuote(workDir + "/tokens"), errors);
+        if (tokens) {
+            *tokens = countLines(workDir + "/tokens");
+        }
+        run("wlp4parse", tool(options, "wlp4parse") + " < " + shellQuote(workDir + "/tokens") + " > " + shellQuote(workDir + "/tree"), errors);
+        run("wlp4type", tool(options, "wlp4type") + " < " + shellQuote(workDir + "/tree") + " > " + shellQuote(workDir + "/typed"), errors);
+        run("wlp4gen", genCommand + " < " + shellQuote(workDir + "/typed") + " > " + shellQuote(workDir + "/objects"), errors);
+
+        vector<string> keys;
+        istringstream manifest(readFile(workDir + "/objects"));
+        for (string key; manifest >> key;) {
+            keys.push_back(key);
+        }
+        if (!options.runtimeDir.empty()) {
+            // alloc goes last: its heap starts where it ends
+            keys.push_back(cacheRuntimeModule(options, "print.asm"));
+            keys.push_back(cacheRuntimeModule(options, "alloc.asm"));
+        }
+
+        vector<exception_ptr> assembleErrors(keys.size());
+        parallelFor(keys.size(), options.numJobs, [&](size_t i) {
+            try {
+                assembleObject(options, keys[i]);
+            } catch (...) {
+                assembleErrors[i] = current_exception();
+            }
+        });
+        for (const auto& error : assembleErrors) {
+            if (error) {
+                rethrow_exception(error);
+            }
+        }
+
+        string linkedPath = workDir + "/program";
+        string linkCommand = tool(options, "linker");
+        if (!options.runtimeDir.empty()) {
+            linkCommand += " --raw";
+        }
+        if (!options.symbolsPath.empty()) {
+            linkCommand += " --symbols " + shellQuote(workDir + "/symbols");
+        }
+        linkCommand += " -o " + shellQuote(linkedPath);
+        for (const auto& key : keys) {
+            linkCommand += " " + shellQuote(options.cacheDir + "/" + key + ".merl");
+        }
+        run("linker", linkCommand, errors);
+        string program = readFile(linkedPath);
+        if (!options.symbolsPath.empty()) {
+            fs::copy_file(workDir + "/symbols", options.symbolsPath, fs::copy_options::overwrite_existing);
+        }
+
+        if (!key.empty()) {
+            // Stage outputs first, so an entry whose program is there is always complete
+            string entry = options.resultCacheDir + "/" + key;
+            if (options.cacheStages) {
+                for (const char* stage : {"tokens", "tree", "typed"}) {
+                    fs::copy_file(workDir + "/" + stage, entry + uniqueSuffix(), fs::copy_options::overwrite_existing);
+                    fs::rename(entry + uniqueSuffix(), entry + "." + stage);
+                }
+            }
+            if (!options.symbolsPath.empty()) {
+                fs::rename(workDir + "/symbols", entry + uniqueSuffix());
+                fs::rename(entry + uniqueSuffix(), entry + ".sym");
+            }
+            fs::rename(linkedPath, entry + uniqueSuffix());
+            fs::rename(entry + uniqueSuffix(), entry + ".out");
+            recordResult(options.resultCacheDir, false, 0);
+            evictResults(options);
+        }
+        fs::remove_all(workDir);
+        return program;
+    } catch (...) {
+        fs::remove_all(workDir);
+        throw;
+    }
+}
+
+// Finds the WLP4 sources to compile: every file given, and every .wlp4 file under every directory given.
+// Each comes with the name of its output relative to the output directory
+vector<pair<fs::path, fs::path>> collectBatchInputs(const vector<string>& inputs) {
+    vector<pair<fs::path, fs::path>> files;
+    for (const auto& input : inputs) {
+        if (!fs::is_directory(input)) {
+            files.emplace_back(input, fs::path(input).filename());
+            continue;
+        }
+        vector<pair<fs::path, fs::path>> found;
+        for (const auto& entry : fs::recursive_directory_iterator(input)) {
+            if (entry.is_regular_file() && entry.path().extension() == ".wlp4") {
+                found.emplace_back(entry.path(), fs::relative(entry.path(), input));
+            }
+        }
+        sort(found.begin(), found.end());
+        files.insert(files.end(), found.begin(), found.end());
+    }
+    return files;
+}
+
+// Compiles every input on numJobs threads, one file per task. Each file gets <name>.mips (<name>.merl without
+// --runtime) or, if it fails, <name>.err with the error, in outputDir or else next to the source.
+// Prints the failures and a summary line. Returns the number of files that failed.
+// Every file still runs each stage tool as its own process; only the driver is shared. That is also what keeps
+// the tools' global state (wlp4type's symbol table, wlp4gen's options and counters) apart between files
+size_t runBatch(const CompileOptions& options, const vector<string>& inputs, const string& outputDir) {
+    vector<pair<fs::path, fs::path>> files = collectBatchInputs(inputs);
+
+    // Files are compiled in parallel already, so each compilation runs on one thread
+    CompileOptions fileOptions = options;
+    fileOptions.numJobs = 1;
+    fileOptions.genOptions.clear();
+    for (size_t i = 0; i < options.genOptions.size(); i++) {
+        if (options.genOptions[i] == "-j") {
+            i++;
+        } else {
+            fileOptions.genOptions.push_back(options.genOptions[i]);
+        }
+    }
+    fileOptions.genOptions.push_back("-j");
+    fileOptions.genOptions.push_back("1");
+
+    vector<string> errors(files.size());
+    atomic<uint64_t> totalTokens(0);
+    auto start = chrono::steady_clock::now();
+
+    parallelFor(files.size(), options.numJobs, [&](size_t i) {
+        fs::path output = outputDir.empty() ? files[i].first : fs::path(outputDir) / files[i].second;
+        output.replace_extension(options.runtimeDir.empty() ? ".merl" : ".mips");
+        fs::path errorPath = fs::path(output).replace_extension(".err");
+        try {
+            uint64_t tokens = 0;
+            string program = compile(fileOptions, readFile(files[i].first.string()), &tokens);
+            totalTokens += tokens;
+            fs::create_directories(output.parent_path().empty() ? "." : output.parent_path());
+            writeOutput(program, output.string());
+            fs::remove(errorPath);
+        } catch (const exception& e) {
+            errors[i] = e.what();
+            try {
+                fs::create_directories(errorPath.parent_path().empty() ? "." : errorPath.parent_path());
+                ofstream(errorPath) << errors[i] << endl;
+            } catch (const exception&) {
+                // Still reported below
+            }
+        }
+    });
+
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    size_t failed = 0;
+    for (size_t i = 0; i < files.size(); i++) {
+        if (!errors[i].empty()) {
+            cerr << files[i].first.string() << ": " << errors[i] << endl;
+            failed++;
+        }
+    }
+    cerr << "batch: " << files.size() << " files, " << failed << " failed, " << seconds << " s, "
+         << (seconds > 0 ? files.size() / seconds : 0) << " files/sec, "
+         << (seconds > 0 ? totalTokens / seconds : 0) << " tokens/sec" << endl;
+    return failed;
+}
+
+// Parses the compile option at args[i] (and its value) into options. Returns false if it isn't one.
+// Directories are made absolute, so the same options work from a server with another working directory
+bool parseCompileOption(const vector<string>& args, size_t& i, CompileOptions& options) {
+    const string& option = args[i];
+    bool hasValue = i + 1 < args.size();
+    if (option == "--cache" && hasValue) {
+        options.cacheDir = fs::absolute(args[++i]).string();
+    } else if (option == "--bin" && hasValue) {
+        options.binDir = fs::absolute(args[++i]).string();
+    } else if (option == "--runtime" && hasValue) {
+        options.runtimeDir = fs::absolute(args[++i]).string();
+    } else if (option == "-j" && hasValue) {
+        options.numJobs = stoi(args[++i]);
+        options.genOptions.push_back("-j");
+        options.genOptions.push_back(args[i]);
+    } else if (option == "--inline-alloc" || option == "--inline-print" || option == "-O0" || option == "-O1" ||
+               option == "-O2" || option == "--profile-generate" || option == "--instrument") {
+        options.genOptions.push_back(option);
+        options.outputOptions += option + " ";
+    } else if (option == "--profile-use" && hasValue) {
+        // The output depends on the counts, not on where the file is
+        string path = fs::absolute(args[++i]).string();
+        options.genOptions.push_back(option);
+        options.genOptions.push_back(path);
+        options.outputOptions += option + " " + toHex(fnv1a(FNV_OFFSET, readFile(path))) + " ";
+    } else if (option == "--symbols" && hasValue) {
+        options.symbolsPath = fs::absolute(args[++i]).string();
+    } else if (option == "--result-cache" && hasValue) {
+        options.resultCacheDir = fs::absolute(args[++i]).string();
+    } else if (option == "--cache-stages") {
+        options.cacheStages = true;
+    } else if (option == "--result-cache-size" && hasValue) {
+        options.resultCacheLimit = stoull(args[++i]);
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Client/server protocol (--server, --connect). Strings are sent as a 64-bit length followed by the bytes.
+// Request: the number of arguments, the arguments, then the source.
+// Reply: the exit status, the program, then the error message.
+
+void sendAll(int fd, const void* data, size_t size) {
+    const char* bytes = static_cast<const char*>(data);
+    while (size > 0) {
+        ssize_t sent = write(fd, bytes, size);
+        if (sent <= 0) {
+            throw runtime_error("ERROR: Connection lost");
+        }
+        bytes += sent;
+        size -= sent;
+    }
+}
+
+void receiveAll(int fd, void* data, size_t size) {
+    char* bytes = static_cast<char*>(data);
+    while (size > 0) {
+        ssize_t received = read(fd, bytes, size);
+        if (received <= 0) {
+            throw runtime_error("ERROR: Connection lost");
+        }
+        bytes += received;
+        size -= received;
+    }
+}
+
+void sendNumber(int fd, uint64_t number) {
+    sendAll(fd, &number, sizeof(number));
+}
+
+uint64_t receiveNumber(int fd) {
+    uint64_t number;
+    receiveAll(fd, &number, sizeof(number));
+    return number;
+}
+
+void sendString(int fd, const string& text) {
+    sendNumber(fd, text.size());
+    sendAll(fd, text.data(), text.size());
+}
+
+string receiveString(int fd) {
+    string text(receiveNumber(fd), '\0');
+    receiveAll(fd, text.data(), text.size());
+    return text;
+}
+
+sockaddr_un socketAddress(const string& path) {
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+        throw runtime_error("ERROR: Socket path too long: " + path);
+    }
+    strcpy(address.sun_path, path.c_str());
+    return address;
+}
+
+// Handles one client: compiles its source with the server's options plus its own
+void serveClient(int fd, const CompileOptions& serverOptions) {
+    try {
+        vector<string> args(receiveNumber(fd));
+        for (auto& arg : args) {
+            arg = receiveString(fd);
+        }
+        string source = receiveString(fd);
+
+        CompileOptions options = serverOptions;
+        uint64_t status = 0;
+        string program, error;
+        try {
+            for (size_t i = 0; i < args.size(); i++) {
+                if (!parseCompileOption(args, i, options)) {
+                    throw runtime_error("ERROR: Unknown option " + args[i]);
+                }
+            }
+            program = compile(options, source);
+        } catch (const logic_error&) {
+            status = 1;
+            error = "ERROR: Bad option value";
+        } catch (const exception& e) {
+            status = 1;
+            error = e.what();
+        }
+        sendNumber(fd, status);
+        sendString(fd, program);
+        sendString(fd, error);
+    } catch (const exception&) {
+        // The client went away, so there's no one to tell
+    }
+    close(fd);
+}
+
+// Accepts clients on a Unix domain socket until killed, compiling for each one on its own thread.
+// Only a front-end: each request runs the stage tools as separate processes, just like a local compilation,
+// so wlp4parse still builds its tables every time. Only the tools' build ID is worked out once
+void runServer(const string& socketPath, const CompileOptions& options) {
+    signal(SIGPIPE, SIG_IGN);
+    sockaddr_un address = socketAddress(socketPath);
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(socketPath.c_str());
+    if (listener < 0 || bind(listener, (sockaddr*)&address, sizeof(address)) != 0 || listen(listener, SOMAXCONN) != 0) {
+        throw runtime_error("ERROR: Cannot listen on " + socketPath);
+    }
+
+    for (;;) {
+        int client = accept(listener, nullptr, nullptr);
+        if (client >= 0) {
+            thread(serveClient, client, cref(options)).detach();
+        }
+    }
+}
+
+// Sends the compilation to a server and passes on what comes back, as if it had been compiled here
+int runClient(const string& socketPath, const vector<string>& compileArgs, const string& outputPath) {
+    sockaddr_un address = socketAddress(socketPath);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (sockaddr*)&address, sizeof(address)) != 0) {
+        throw runtime_error("ERROR: Cannot connect to " + socketPath);
+    }
+
+    ostringstream source;
+    source << cin.rdbuf();
+    sendNumber(fd, compileArgs.size());
+    for (const auto& arg : compileArgs) {
+        sendString(fd, arg);
+    }
+    sendString(fd, source.str());
+
+    uint64_t status = receiveNumber(fd);
+    string program = receiveString(fd);
+    string error = receiveString(fd);
+    close(fd);
+
+    if (status != 0) {
+        cerr << error << endl;
+        return status;
+    }
+    writeOutput(program, outputPath);
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    CompileOptions options;
+    string outputPath;
+    string serverSocket, clientSocket;
+    bool showStats = false;
+    bool batch = false;
+    vector<string> batchInputs;
+
+    string self = argv[0];
+    if (self.find('/') != string::npos) {
+        options.binDir = fs::absolute(self.substr(0, self.rfind('/'))).string();
+    }
+
+    vector<string> args(argv + 1, argv + argc);
+    vector<string> compileArgs;  // What --connect sends to the server
+    try {
+        for (size_t i = 0; i < args.size(); i++) {
+            size_t first = i;
+            if (args[i] == "-o" && i + 1 < args.size()) {
+                outputPath = args[++i];
+            } else if (args[i] == "--result-cache-stats") {
+                showStats = true;
+            } else if (args[i] == "--server" && i + 1 < args.size()) {
+                serverSocket = args[++i];
+            } else if (args[i] == "--connect" && i + 1 < args.size()) {
+                clientSocket = args[++i];
+            } else if (args[i] == "--batch") {
+                batch = true;
+            } else if (parseCompileOption(args, i, options)) {
+                compileArgs.push_back(args[first]);
+                if (i > first) {
+                    // Directories and files go over as absolute paths
+                    bool isPath = args[first] != "-j" && args[first] != "--result-cache-size";
+                    compileArgs.push_back(isPath ? fs::absolute(args[i]).string() : args[i]);
+                }
+            } else if (batch && args[i][0] != '-') {
+                batchInputs.push_back(args[i]);
+            } else {
+                cerr << "ERROR: Unknown option " << args[i] << endl;
+                return 1;
+            }
+        }
+    } catch (const logic_error&) {
+        cerr << "ERROR: Bad option value" << endl;
+        return 1;
+    } catch (const runtime_error& e) {
+        cerr << e.what() << endl;
+        return 1;
+    }
+
+    try {
+        if (batch) {
+            if (!options.symbolsPath.empty()) {
+                throw runtime_error("ERROR: --symbols can't be used with --batch");
+            }
+            return runBatch(options, batchInputs, outputPath) == 0 ? 0 : 1;
+        }
+        if (showStats) {
+            if (options.resultCacheDir.empty()) {
+                throw runtime_error("ERROR: --result-cache-stats needs --result-cache DIR");
+            }
+            printResultCacheStats(options);
+            return 0;
+        }
+        if (!serverSocket.empty()) {
+            runServer(serverSocket, options);
+            return 0;
+        }
+        if (!clientSocket.empty()) {
+            return runClient(clientSocket, compileArgs, outputPath);
+        }
+
+        ostringstream source;
+        source << cin.rdbuf();
+        writeOutput(compile(options, source.str()), outputPath);
+    } catch (const exception& e) {
+        cerr << e.what() << endl;
+        return 1;
+    }
+    return 0;
+}
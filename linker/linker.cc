@@ -0,0 +1,306 @@
+#include <cstdint>
+#include <algorithm>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+namespace fs = std::filesystem;
+
+// Links MERL modules produced by asm --merl into one.
+// Modules are laid out in the order given; each one's code is shifted by the length of the code before it.
+// Usage: linker [-o FILE] [--raw] [--symbols FILE] a.merl b.merl ...
+// --symbols writes the output's symbol map. Each module's labels come from the map asm --symbols wrote next to
+// it (a.sym for a.merl), or are just its exports if there isn't one
+
+const uint32_t MERL_COOKIE = 0x10000002;
+const uint32_t MERL_REL = 0x01;
+const uint32_t MERL_ESR = 0x11;
+const uint32_t MERL_ESD = 0x05;
+const uint32_t HEADER_BYTES = 12;
+
+// An ESR (a use of an imported label) or an ESD (an exported label)
+struct ExternalSymbol {
+    uint32_t address;  // ESR: location of the word to fill in; ESD: the label's address
+    string name;
+};
+
+struct MerlModule {
+    vector<uint32_t> code;  // Everything between the header and the table
+    vector<uint32_t> relocations;  // Locations of words that hold addresses
+    vector<ExternalSymbol> imports;
+    vector<ExternalSymbol> exports;
+    vector<ExternalSymbol> labels;  // For --symbols: every label with its address
+};
+
+vector<uint32_t> readWords(const string& path) {
+    ifstream in(path, ios::binary);
+    if (!in) {
+        throw runtime_error("ERROR: Cannot open " + path);
+    }
+    vector<unsigned char> bytes((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+    if (bytes.size() % 4 != 0) {
+        throw runtime_error("ERROR: " + path + " is not a whole number of words");
+    }
+
+    vector<uint32_t> words(bytes.size() / 4);
+    for (size_t i = 0; i < words.size(); i++) {
+        words[i] = (uint32_t)bytes[4 * i] << 24 | (uint32_t)bytes[4 * i + 1] << 16 |
+                   (uint32_t)bytes[4 * i + 2] << 8 | bytes[4 * i + 3];
+    }
+    return words;
+}
+
+MerlModule parseModule(const string& path) {
+    vector<uint32_t> words = readWords(path);
+    if (words.size() < 3 || words[0] != MERL_COOKIE) {
+        throw runtime_error("ERROR: " + path + " is not a MERL module");
+    }
+    uint32_t endModule = words[1];
+    uint32_t endCode = words[2];
+    if (endModule != words.size() * 4 || endCode < HEADER_BYTES || endCode > endModule || endCode % 4 != 0) {
+        throw runtime_error("ERROR: " + path + " has a bad MERL header");
+    }
+
+    MerlModule module;
+    module.code.assign(words.begin() + 3, words.begin() + endCode / 4);
+
+    // Reads the word at i, checking it is still inside the table
+    size_t i = endCode / 4;
+    auto next = [&]() {
+        if (i >= words.size()) {
+            throw runtime_error("ERROR: " + path + " has a truncated MERL table");
+        }
+        return words[i++];
+    };
+    auto nextName = [&]() {
+        uint32_t length = next();
+        string name;
+        for (uint32_t j = 0; j < length; j++) {
+            name += (char)next();
+        }
+        return name;
+    };
+    // Locations are checked here so linking can index the code without checking again
+    auto nextLocation = [&]() {
+        uint32_t location = next();
+        if (location < HEADER_BYTES || location >= endCode || location % 4 != 0) {
+            throw runtime_error("ERROR: " + path + " has a MERL entry outside its code");
+        }
+        return location;
+    };
+
+    while (i < words.size()) {
+        uint32_t type = next();
+        if (type == MERL_REL) {
+            module.relocations.push_back(nextLocation());
+        } else if (type == MERL_ESR) {
+            uint32_t location = nextLocation();
+            module.imports.push_back({location, nextName()});
+        } else if (type == MERL_ESD) {
+            uint32_t address = next();
+            module.exports.push_back({address, nextName()});
+        } else {
+            throw runtime_error("ERROR: " + path + " has an unknown MERL entry type " + to_string(type));
+        }
+    }
+    return module;
+}
+
+// The labels of a module for --symbols, from the map asm --symbols wrote next to it
+void readSymbols(MerlModule& module, const string& path) {
+    string mapPath = fs::path(path).replace_extension(".sym").string();
+    ifstream in(mapPath);
+    if (!in) {
+        module.labels = module.exports;
+        return;
+    }
+    uint32_t address;
+    string name;
+    while (in >> hex >> address >> name) {
+        module.labels.push_back({address, name});
+    }
+    if (!in.eof()) {
+        throw runtime_error("ERROR: " + mapPath + " is not a symbol map");
+    }
+}
+
+// Concatenates the modules and resolves every import that one of them exports.
+// Imports nobody exports are left in the result for a later link
+MerlModule link(const vector<MerlModule>& modules) {
+    MerlModule linked;
+    unordered_map<string, uint32_t> exported;
+
+    for (const MerlModule& module : modules) {
+        uint32_t shift = linked.code.size() * 4;
+        size_t first = linked.code.size();
+        linked.code.insert(linked.code.end(), module.code.begin(), module.code.end());
+
+        for (uint32_t location : module.relocations) {
+            linked.code[first + (location - HEADER_BYTES) / 4] += shift;
+            linked.relocations.push_back(location + shift);
+        }
+        for (const ExternalSymbol& symbol : module.imports) {
+            linked.imports.push_back({symbol.address + shift, symbol.name});
+        }
+        for (const ExternalSymbol& symbol : module.exports) {
+            if (!exported.emplace(symbol.name, symbol.address + shift).second) {
+                throw runtime_error("ERROR: Label exported by more than one module: " + symbol.name);
+            }
+            linked.exports.push_back({symbol.address + shift, symbol.name});
+        }
+        for (const ExternalSymbol& symbol : module.labels) {
+            linked.labels.push_back({symbol.address + shift, symbol.name});
+        }
+    }
+
+    // A resolved import becomes an ordinary relocated address
+    vector<ExternalSymbol> unresolved;
+    for (const ExternalSymbol& symbol : linked.imports) {
+        auto it = exported.find(symbol.name);
+        if (it == exported.end()) {
+            unresolved.push_back(symbol);
+            continue;
+        }
+        linked.code[(symbol.address - HEADER_BYTES) / 4] = it->second;
+        linked.relocations.push_back(symbol.address);
+    }
+    linked.imports = unresolved;
+    return linked;
+}
+
+void pushName(vector<uint32_t>& words, const string& name) {
+    words.push_back(name.size());
+    for (char c : name) {
+        words.push_back((unsigned char)c);
+    }
+}
+
+vector<uint32_t> toMerl(const MerlModule& module) {
+    vector<uint32_t> words = {MERL_COOKIE, 0, 0};
+    words.insert(words.end(), module.code.begin(), module.code.end());
+    words[2] = words.size() * 4;
+
+    for (uint32_t location : module.relocations) {
+        words.push_back(MERL_REL);
+        words.push_back(location);
+    }
+    for (const ExternalSymbol& symbol : module.imports) {
+        words.push_back(MERL_ESR);
+        words.push_back(symbol.address);
+        pushName(words, symbol.name);
+    }
+    for (const ExternalSymbol& symbol : module.exports) {
+        words.push_back(MERL_ESD);
+        words.push_back(symbol.address);
+        pushName(words, symbol.name);
+    }
+    words[1] = words.size() * 4;
+    return words;
+}
+
+// Plain machine code to be loaded at address 0, like asm's output without --merl
+vector<uint32_t> toRaw(const MerlModule& module) {
+    if (!module.imports.empty()) {
+        throw runtime_error("ERROR: Label imported but never exported: " + module.imports.front().name);
+    }
+    vector<uint32_t> words = module.code;
+    for (uint32_t location : module.relocations) {
+        words[(location - HEADER_BYTES) / 4] -= HEADER_BYTES;
+    }
+    return words;
+}
+
+void writeWords(const vector<uint32_t>& words, FILE* out) {
+    vector<unsigned char> bytes;
+    bytes.reserve(words.size() * 4);
+    for (uint32_t word : words) {
+        bytes.push_back(word >> 24);
+        bytes.push_back(word >> 16);
+        bytes.push_back(word >> 8);
+        bytes.push_back(word);
+    }
+    if (fwrite(bytes.data(), 1, bytes.size(), out) != bytes.size() || fflush(out) != 0) {
+        throw runtime_error("ERROR: Cannot write output");
+    }
+}
+
+// Writes "address label" lines in order of address. Raw code is loaded at 0, so its addresses skip the header
+void writeSymbols(const MerlModule& module, bool raw, const string& path) {
+    vector<ExternalSymbol> labels = module.labels;
+    stable_sort(labels.begin(), labels.end(),
+                [](const ExternalSymbol& a, const ExternalSymbol& b) { return a.address < b.address; });
+    FILE* out = fopen(path.c_str(), "w");
+    if (!out) {
+        throw runtime_error("ERROR: Cannot open " + path);
+    }
+    for (const ExternalSymbol& label : labels) {
+        fprintf(out, "0x%08x %s\n", label.address - (raw ? HEADER_BYTES : 0), label.name.c_str());
+    }
+    if (fclose(out) != 0) {
+        throw runtime_error("ERROR: Cannot write " + path);
+    }
+}
+
+int main(int argc, char* argv[]) {
+    string outputPath;  // empty => stdout
+    string symbolsPath;  // empty => no symbol map
+    bool raw = false;
+    vector<string> inputs;
+
+    for (int i = 1; i < argc; i++) {
+        string option = argv[i];
+        if (option == "-o" && i + 1 < argc) {
+            outputPath = argv[++i];
+        } else if (option == "--raw") {
+            raw = true;
+        } else if (option == "--symbols" && i + 1 < argc) {
+            symbolsPath = argv[++i];
+        } else if (!option.empty() && option[0] != '-') {
+            inputs.push_back(option);
+        } else {
+            cerr << "ERROR: Unknown option " << option << endl;
+            return 1;
+        }
+    }
+
+    try {
+        if (inputs.empty()) {
+            throw runtime_error("ERROR: No input modules");
+        }
+        vector<MerlModule> modules;
+        for (const string& path : inputs) {
+            modules.push_back(parseModule(path));
+            if (!symbolsPath.empty()) {
+                readSymbols(modules.back(), path);
+            }
+        }
+
+        MerlModule linked = link(modules);
+        vector<uint32_t> words = raw ? toRaw(linked) : toMerl(linked);
+
+        if (outputPath.empty()) {
+            writeWords(words, stdout);
+        } else {
+            FILE* out = fopen(outputPath.c_str(), "wb");
+            if (!out) {
+                throw runtime_error("ERROR: Cannot open " + outputPath);
+            }
+            writeWords(words, out);
+            fclose(out);
+        }
+        if (!symbolsPath.empty()) {
+            writeSymbols(linked, raw, symbolsPath);
+        }
+    } catch (runtime_error& e) {
+        cerr << e.what() << endl;
+        return 1;
+    }
+    return 0;
+}
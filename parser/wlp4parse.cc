@@ -14,12 +14,19 @@ struct ParseTreeNode {
 
     ParseTreeNode(std::string value) : value(value) {}
 
-    // Recursive function to print the parse tree
-    void printPreOrder(int depth = 0) const {
-        std::cout << value << std::endl;
-        for (auto child : children) {
-            child->printPreOrder(depth + 1);
+    // Prints the parse tree in pre-order.
+    // Uses an explicit stack since statements -> statements statement makes trees as deep as the program is long
+    void printPreOrder() const {
+        std::vector<const ParseTreeNode*> stack = {this};
+        while (!stack.empty()) {
+            const ParseTreeNode* node = stack.back();
+            stack.pop_back();
+            std::cout << node->value << '\n';
+            for (auto it = node->children.rbegin(); it != node->children.rend(); ++it) {
+                stack.push_back(*it);
+            }
         }
+        std::cout << std::flush;
     }
 
     void printLevelOrder() const {
@@ -52,10 +59,16 @@ struct ParseTreeNode {
         }
     }
 
-    // Destructor to clean up memory used by children
+    // Destructor to clean up memory used by children.
+    // Each child's children are taken over before it is deleted, so deep trees don't recurse
     ~ParseTreeNode() {
-        for (auto child : children) {
-            delete child;  // Delete each child
+        std::vector<ParseTreeNode*> pending = std::move(children);
+        while (!pending.empty()) {
+            ParseTreeNode* child = pending.back();
+            pending.pop_back();
+            pending.insert(pending.end(), child->children.begin(), child->children.end());
+            child->children.clear();
+            delete child;
         }
     }
 };
@@ -0,0 +1,138 @@
+; init, new and delete for programs that use the heap.
+; Assemble with asm --merl and link it last: the heap starts right after this module.
+; Every block has a one word header holding its size in words (header included),
+; and the pointer handed out is just past the header. A free block's first word links to the next free block.
+.export init
+.export new
+.export delete
+
+; init: sets up the heap. Called with $1 = array address and $2 = array length,
+; or $2 = 0 when wain takes two ints. If the array ends after this module, the heap starts after the array.
+; Preserves every register.
+init:
+sw $1, -4($30)
+sw $2, -8($30)
+sw $3, -12($30)
+sw $4, -16($30)
+lis $4
+.word 16
+sub $30, $30, $4
+lis $3
+.word allocHeap      ; $3 = heap start
+beq $2, $0, initStore
+add $2, $2, $2
+add $2, $2, $2
+add $2, $1, $2       ; $2 = end of the array
+sltu $4, $3, $2
+beq $4, $0, initStore
+add $3, $2, $0
+initStore:
+lis $4
+.word allocBumpPtr
+sw $3, 0($4)
+lis $4
+.word allocFreeList
+sw $0, 0($4)
+lis $4
+.word 16
+add $30, $30, $4
+lw $1, -4($30)
+lw $2, -8($30)
+lw $3, -12($30)
+lw $4, -16($30)
+jr $31
+
+; new: allocates $1 words. Returns the address in $3, or 0 if $1 < 1 or the heap is full.
+; Preserves every other register.
+new:
+sw $1, -4($30)
+sw $2, -8($30)
+sw $4, -12($30)
+sw $5, -16($30)
+sw $6, -20($30)
+sw $7, -24($30)
+lis $4
+.word 24
+sub $30, $30, $4
+slt $2, $0, $1
+beq $2, $0, newFail
+lis $4
+.word 1
+add $2, $1, $4       ; $2 = block size with its header
+
+; First fit. $5 = address of the link to the current block
+lis $5
+.word allocFreeList
+newSearch:
+lw $6, 0($5)
+beq $6, $0, newBump
+lw $7, 0($6)
+sltu $3, $7, $2
+beq $3, $0, newTake
+lis $4
+.word 4
+add $5, $6, $4
+beq $0, $0, newSearch
+newTake:
+lw $7, 4($6)
+sw $7, 0($5)         ; unlink, keeping the block's original size in its header
+beq $0, $0, newFound
+
+; Nothing free is big enough, so take a new block from the end of the heap.
+; The heap may grow to within 1024 bytes of the stack pointer
+newBump:
+lis $5
+.word allocBumpPtr
+lw $6, 0($5)         ; $6 = the new block
+add $7, $2, $2
+add $7, $7, $7
+add $7, $6, $7       ; $7 = new end of the heap
+sltu $3, $7, $6
+bne $3, $0, newFail  ; wrapped around
+lis $4
+.word 1024
+sub $4, $30, $4
+sltu $3, $4, $7
+bne $3, $0, newFail
+sw $7, 0($5)
+sw $2, 0($6)
+newFound:
+lis $4
+.word 4
+add $3, $6, $4
+beq $0, $0, newDone
+newFail:
+add $3, $0, $0
+newDone:
+lis $4
+.word 24
+add $30, $30, $4
+lw $1, -4($30)
+lw $2, -8($30)
+lw $4, -12($30)
+lw $5, -16($30)
+lw $6, -20($30)
+lw $7, -24($30)
+jr $31
+
+; delete: frees the block at $1, which came from new. Preserves every register.
+delete:
+sw $2, -4($30)
+sw $4, -8($30)
+lis $4
+.word allocFreeList
+lw $2, 0($4)
+sw $2, 0($1)         ; the block links to the old head
+lis $2
+.word 4
+sub $2, $1, $2
+sw $2, 0($4)         ; and becomes the new head
+lw $2, -4($30)
+lw $4, -8($30)
+jr $31
+
+allocBumpPtr:
+.word 0
+allocFreeList:
+.word 0
+allocHeap:
@@ -0,0 +1,59 @@
+; print: writes $1 to standard output as a signed decimal followed by a newline.
+; Preserves every register, so callers only need to save $31.
+; Assemble with asm --merl and link it with the program.
+.export print
+print:
+sw $1, -4($30)
+sw $2, -8($30)
+sw $3, -12($30)
+sw $4, -16($30)
+sw $5, -20($30)
+sw $6, -24($30)
+lis $4
+.word 24
+sub $30, $30, $4
+lis $2
+.word 0xffff000c     ; output port
+lis $4
+.word 10
+slt $3, $1, $0
+beq $3, $0, printDigits
+lis $3
+.word 45             ; '-'
+sw $3, 0($2)
+sub $1, $0, $1       ; -2^31 stays 0x80000000, which is right as an unsigned number below
+
+; Digits are buffered below the stack pointer, least significant first
+printDigits:
+add $5, $30, $0      ; $5 = buffer cursor, grows down
+printDigit:
+divu $1, $4
+mfhi $3
+lis $6
+.word 48             ; '0'
+add $3, $3, $6
+sw $3, -4($5)
+lis $6
+.word 4
+sub $5, $5, $6
+mflo $1
+bne $1, $0, printDigit
+
+; Most significant digit is now at the cursor
+printOut:
+lw $3, 0($5)
+sw $3, 0($2)
+add $5, $5, $6
+bne $5, $30, printOut
+sw $4, 0($2)         ; newline
+
+lis $4
+.word 24
+add $30, $30, $4
+lw $1, -4($30)
+lw $2, -8($30)
+lw $3, -12($30)
+lw $4, -16($30)
+lw $5, -20($30)
+lw $6, -24($30)
+jr $31
@@ -138,7 +138,7 @@ int main() {
                         std::string tokenName = tokenNames[j];
 
                         if (i + keyword.length() - 1 < s.length()) {  // check if keyword length is possible
-                            if (s.substr(i, i + keyword.length()) == keyword) {
+                            if (s.compare(i, keyword.length(), keyword) == 0) {
                                 if (i + keyword.length() < s.length()) {  // any more chars after keyword?
                                     if (!isValidIDCharacter(s[i + keyword.length()])) {  // can the extra chars make this an ID?
                                         std::cout << tokenName << " " << keyword << std::endl;
@@ -0,0 +1,621 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// Runs machine code from asm (or linker --raw) loaded at address 0, like mips.twoints and mips.array.
+// Usage: mips-sim [OPTIONS] PROGRAM A B
+//        mips-sim [OPTIONS] --array PROGRAM V1 V2 ...
+// Options: --counts, --max-steps N, --profile FILE, --instrument FILE,
+//          --sample N, --symbols FILE, --flat FILE, --stacks FILE
+// The program returns by jumping to the address it was given in $31. Words stored to 0xffff000c are
+// written to stdout as characters, and loads from 0xffff0004 read a character from stdin (-1 at the end).
+// The registers are printed to stderr when the program returns.
+//
+// Every word of the program is decoded once, up front, into an Instruction that points straight at the code
+// that runs it, so running an instruction is one indirect jump (computed goto) with no decoding.
+
+const uint32_t MEMORY_BYTES = 1 << 24;  // $30 starts at the top
+const uint32_t RETURN_ADDRESS = 0x8123456c;
+const uint32_t OUTPUT_ADDRESS = 0xffff000c;
+const uint32_t INPUT_ADDRESS = 0xffff0004;
+// First word of each counter table wlp4gen --profile-generate puts in the program
+const uint32_t PROFILE_MAGIC = 0x57345046;
+// wlp4gen --instrument: first word of each procedure's descriptor, and the word two before the counter table
+const uint32_t INSTRUMENT_MAGIC = 0x5734494e;
+const uint32_t INSTRUMENT_TABLE_MAGIC = 0x57344943;
+// Steps between samples when --flat or --stacks is given without --sample
+const uint64_t DEFAULT_SAMPLE_INTERVAL = 1000;
+
+// Every instruction asm encodes, plus INVALID for words that aren't one
+enum Opcode { ADD, SUB, MULT, MULTU, DIV, DIVU, MFHI, MFLO, LIS, LW, SW, SLT, SLTU, BEQ, BNE, JR, JALR, INVALID, NUM_OPCODES };
+
+const char* OPCODE_NAMES[NUM_OPCODES] = {"add", "sub", "mult", "multu", "div", "divu", "mfhi", "mflo", "lis",
+                                         "lw", "sw", "slt", "sltu", "beq", "bne", "jr", "jalr", "invalid"};
+
+// Cycles each instruction costs in the estimate --counts prints, roughly those of an in-order MIPS core:
+// a multiply's result is ready after 5 cycles and a divide's after 35, and everything else takes one
+const uint64_t OPCODE_CYCLES[NUM_OPCODES] = {1, 1, 5, 5, 35, 35, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0};
+
+// Writes to $0 go to this extra register instead, so $0 stays 0 without checking on every write
+const int DISCARD = 32;
+
+struct Instruction {
+    const void* handler;  // Label of the code that runs it
+    Opcode opcode;
+    uint8_t s, t, d;
+    int32_t immediate;
+};
+
+Instruction decode(uint32_t word) {
+    Instruction instruction = {nullptr, INVALID, 0, 0, 0, 0};
+    uint32_t op = word >> 26;
+    uint8_t s = (word >> 21) & 31, t = (word >> 16) & 31, d = (word >> 11) & 31;
+    uint32_t function = word & 0x7ff;
+    instruction.s = s;
+    instruction.t = t;
+    instruction.d = d == 0 ? DISCARD : d;
+    instruction.immediate = (int16_t)(word & 0xffff);
+
+    if (op == 0) {
+        switch (function) {
+            case 0x20: instruction.opcode = ADD; break;
+            case 0x22: instruction.opcode = SUB; break;
+            case 0x2a: instruction.opcode = SLT; break;
+            case 0x2b: instruction.opcode = SLTU; break;
+            case 0x18: instruction.opcode = MULT; break;
+            case 0x19: instruction.opcode = MULTU; break;
+            case 0x1a: instruction.opcode = DIV; break;
+            case 0x1b: instruction.opcode = DIVU; break;
+            case 0x10: instruction.opcode = MFHI; break;
+            case 0x12: instruction.opcode = MFLO; break;
+            case 0x14: instruction.opcode = LIS; break;
+            case 0x08: instruction.opcode = JR; break;
+            case 0x09: instruction.opcode = JALR; break;
+        }
+    } else if (op == 0x23) {
+        instruction.opcode = LW;
+        instruction.t = t == 0 ? DISCARD : t;
+    } else if (op == 0x2b) {
+        instruction.opcode = SW;
+    } else if (op == 0x04) {
+        instruction.opcode = BEQ;
+    } else if (op == 0x05) {
+        instruction.opcode = BNE;
+    }
+    return instruction;
+}
+
+struct Machine {
+    uint32_t registers[33] = {};
+    uint32_t hi = 0, lo = 0;
+    vector<uint32_t> memory = vector<uint32_t>(MEMORY_BYTES / 4);
+    // Decoded program. Stores into the program decode the word again
+    vector<Instruction> program;
+    uint64_t counts[NUM_OPCODES] = {};
+    uint64_t maxSteps = 0;  // 0 => no limit
+
+    // --sample N: every N steps the pc and the calls in progress are recorded. 0 => never
+    uint64_t sampleInterval = 0;
+    // Calls in progress while sampling: (address called, return address), innermost last.
+    // jalr pushes one and a jr to the innermost return address pops it
+    vector<pair<uint32_t, uint32_t>> callStack;
+    // The addresses called, innermost last, then the pc -> how many samples found them
+    map<vector<uint32_t>, uint64_t> samples;
+};
+
+string hex(uint32_t value) {
+    char text[11];
+    snprintf(text, sizeof(text), "0x%08x", value);
+    return text;
+}
+
+// Loads the program at address 0 and decodes it. Returns its length in words
+uint32_t load(Machine& machine, const string& path) {
+    ifstream file(path, ios::binary);
+    if (!file) {
+        throw runtime_error("ERROR: Cannot open " + path);
+    }
+    vector<unsigned char> bytes((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+    if (bytes.size() % 4 != 0 || bytes.size() > MEMORY_BYTES / 2) {
+        throw runtime_error("ERROR: " + path + " is not a program of whole words");
+    }
+    for (size_t i = 0; i < bytes.size() / 4; i++) {
+        machine.memory[i] = (uint32_t)bytes[4 * i] << 24 | (uint32_t)bytes[4 * i + 1] << 16 |
+                            (uint32_t)bytes[4 * i + 2] << 8 | bytes[4 * i + 3];
+        machine.program.push_back(decode(machine.memory[i]));
+    }
+    return bytes.size() / 4;
+}
+
+// Writes the counter tables of a program built with wlp4gen --profile-generate as "procedure counter count"
+// lines. A table is the magic word, the number of counters, the procedure's name (length, then one word per
+// character) and the counters
+void writeProfile(const Machine& machine, uint32_t programWords, const string& path) {
+    ofstream out(path);
+    if (!out) {
+        throw runtime_error("ERROR: Cannot open " + path);
+    }
+    const vector<uint32_t>& memory = machine.memory;
+    for (uint32_t i = 0; i + 3 <= programWords; i++) {
+        if (memory[i] != PROFILE_MAGIC) {
+            continue;
+        }
+        uint64_t numCounters = memory[i + 1], nameLength = memory[i + 2];
+        if (nameLength == 0 || i + 3 + nameLength + numCounters > programWords) {
+            continue;
+        }
+        string name;
+        for (uint32_t j = 0; j < nameLength; j++) {
+            name += (char)memory[i + 3 + j];
+        }
+        uint32_t counters = i + 3 + nameLength;
+        for (uint32_t j = 0; j < numCounters; j++) {
+            out << name << " " << j << " " << memory[counters + j] << "\n";
+        }
+        i = counters + numCounters - 1;
+    }
+    if (!out.flush()) {
+        throw runtime_error("ERROR: Cannot write " + path);
+    }
+}
+
+// Writes the counters of a program built with wlp4gen --instrument as "label count" lines, hottest first.
+// The table is its magic word, the number of counters and the counters. Each procedure's descriptor is its
+// magic word, its first counter, its number of counters and their labels (length, then one word per character)
+void writeInstrumentCounts(const Machine& machine, uint32_t programWords, const string& path) {
+    const vector<uint32_t>& memory = machine.memory;
+    uint64_t table = 0, tableSize = 0;
+    for (uint32_t i = 0; i + 2 <= programWords; i++) {
+        if (memory[i] == INSTRUMENT_TABLE_MAGIC && i + 2 + (uint64_t)memory[i + 1] <= programWords) {
+            table = i + 2;
+            tableSize = memory[i + 1];
+            break;
+        }
+    }
+    if (table == 0) {
+        throw runtime_error("ERROR: No counters in the program. Build it with wlp4gen --instrument");
+    }
+
+    vector<pair<string, uint32_t>> counts;
+    for (uint32_t i = 0; i + 3 <= programWords; i++) {
+        if (memory[i] != INSTRUMENT_MAGIC) {
+            continue;
+        }
+        uint64_t first = memory[i + 1], numCounters = memory[i + 2];
+        if (first + numCounters > tableSize) {
+            continue;
+        }
+        vector<pair<string, uint32_t>> labels;
+        uint64_t at = i + 3;
+        for (uint32_t j = 0; j < numCounters && at < programWords; j++) {
+            uint64_t length = memory[at];
+            if (length == 0 || at + 1 + length > programWords) {
+                break;
+            }
+            string label;
+            for (uint32_t k = 0; k < length; k++) {
+                label += (char)memory[at + 1 + k];
+            }
+            labels.push_back({label, memory[table + first + j]});
+            at += 1 + length;
+        }
+        if (labels.size() == numCounters) {
+            counts.insert(counts.end(), labels.begin(), labels.end());
+            i = at - 1;
+        }
+    }
+    stable_sort(counts.begin(), counts.end(), [](const auto& a, const auto& b) { return a.second > b.second; });
+
+    ofstream out(path);
+    if (!out) {
+        throw runtime_error("ERROR: Cannot open " + path);
+    }
+    for (const auto& [label, count] : counts) {
+        out << label << " " << count << "\n";
+    }
+    if (!out.flush()) {
+        throw runtime_error("ERROR: Cannot write " + path);
+    }
+}
+
+void sample(Machine& machine, uint32_t pc) {
+    vector<uint32_t> stack;
+    stack.reserve(machine.callStack.size() + 1);
+    for (const auto& call : machine.callStack) {
+        stack.push_back(call.first);
+    }
+    stack.push_back(pc * 4);
+    machine.samples[stack]++;
+}
+
+// A symbol map from asm --symbols or linker --symbols: (address, label) in order of address
+vector<pair<uint32_t, string>> readSymbols(const string& path) {
+    ifstream in(path);
+    if (!in) {
+        throw runtime_error("ERROR: Cannot open " + path);
+    }
+    vector<pair<uint32_t, string>> symbols;
+    uint32_t address;
+    string label;
+    while (in >> std::hex >> address >> label) {
+        symbols.push_back({address, label});
+    }
+    if (!in.eof()) {
+        throw runtime_error("ERROR: " + path + " is not a symbol map");
+    }
+    stable_sort(symbols.begin(), symbols.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+    return symbols;
+}
+
+// The last label at or before address, or the address itself if there isn't one
+string symbolize(const vector<pair<uint32_t, string>>& symbols, uint32_t address) {
+    auto it = upper_bound(symbols.begin(), symbols.end(), address,
+                          [](uint32_t a, const pair<uint32_t, string>& symbol) { return a < symbol.first; });
+    return it == symbols.begin() ? hex(address) : prev(it)->second;
+}
+
+// Writes the samples as a flat profile, "samples percent label" lines hottest first, where the label is the
+// one the pc was under
+void writeFlatProfile(const Machine& machine, const vector<pair<uint32_t, string>>& symbols, const string& path) {
+    map<string, uint64_t> byLabel;
+    uint64_t total = 0;
+    for (const auto& [stack, count] : machine.samples) {
+        byLabel[symbolize(symbols, stack.back())] += count;
+        total += count;
+    }
+    vector<pair<string, uint64_t>> rows(byLabel.begin(), byLabel.end());
+    stable_sort(rows.begin(), rows.end(), [](const auto& a, const auto& b) { return a.second > b.second; });
+
+    FILE* out = fopen(path.c_str(), "w");
+    if (!out) {
+        throw runtime_error("ERROR: Cannot open " + path);
+    }
+    for (const auto& [label, count] : rows) {
+        fprintf(out, "%10llu %6.2f%% %s\n", (unsigned long long)count, 100.0 * count / total, label.c_str());
+    }
+    if (fclose(out) != 0) {
+        throw runtime_error("ERROR: Cannot write " + path);
+    }
+}
+
+// Writes the samples as collapsed stacks for flame graph tools: "frame;frame;...;label count" lines.
+// The outermost frame is wain (or the program's file name without a wain label), then one frame per call in
+// progress named after the label called, then the label the pc was under if it isn't the callee's own
+void writeCollapsedStacks(const Machine& machine, const vector<pair<uint32_t, string>>& symbols, const string& root,
+                          const string& path) {
+    map<string, uint64_t> byStack;
+    for (const auto& [stack, count] : machine.samples) {
+        string frames = root, innermost = root;
+        for (size_t i = 0; i + 1 < stack.size(); i++) {
+            innermost = symbolize(symbols, stack[i]);
+            frames += ";" + innermost;
+        }
+        string label = symbolize(symbols, stack.back());
+        if (label != innermost) {
+            frames += ";" + label;
+        }
+        byStack[frames] += count;
+    }
+
+    ofstream out(path);
+    if (!out) {
+        throw runtime_error("ERROR: Cannot open " + path);
+    }
+    for (const auto& [frames, count] : byStack) {
+        out << frames << " " << count << "\n";
+    }
+    if (!out.flush()) {
+        throw runtime_error("ERROR: Cannot write " + path);
+    }
+}
+
+void run(Machine& machine) {
+    static const void* HANDLERS[NUM_OPCODES] = {&&add, &&sub, &&mult, &&multu, &&div, &&divu, &&mfhi, &&mflo, &&lis,
+                                                &&lw, &&sw, &&slt, &&sltu, &&beq, &&bne, &&jr, &&jalr, &&invalid};
+    // Only sampling keeps track of calls, so without it jr and jalr cost nothing extra
+    static const void* SAMPLING_HANDLERS[NUM_OPCODES] = {&&add, &&sub, &&mult, &&multu, &&div, &&divu, &&mfhi, &&mflo,
+                                                         &&lis, &&lw, &&sw, &&slt, &&sltu, &&beq, &&bne, &&jrTracked,
+                                                         &&jalrTracked, &&invalid};
+    const void* const* handlers = machine.sampleInterval ? SAMPLING_HANDLERS : HANDLERS;
+    for (auto& instruction : machine.program) {
+        instruction.handler = handlers[instruction.opcode];
+    }
+
+    uint32_t* R = machine.registers;
+    uint32_t* memory = machine.memory.data();
+    Instruction* program = machine.program.data();
+    uint32_t programWords = machine.program.size();
+    uint64_t* counts = machine.counts;
+    // The event fires as an instruction is dispatched, so the limit is reached on the step after the last one allowed
+    uint64_t stepsLeft = machine.maxSteps && machine.maxSteps < UINT64_MAX ? machine.maxSteps + 1 : UINT64_MAX;
+    // Counts down to the next sample or to the step limit, whichever comes first, so DISPATCH checks one counter
+    uint64_t period = machine.sampleInterval ? min(stepsLeft, machine.sampleInterval) : stepsLeft;
+    uint64_t untilEvent = period;
+    uint32_t hi = machine.hi, lo = machine.lo;
+    uint32_t pc = 0;  // In words
+    const Instruction* current;
+    uint32_t address;
+
+// Fetches the instruction at pc and jumps to its handler
+#define DISPATCH()                                                                                   \
+    do {                                                                                             \
+        if (pc >= programWords) {                                                                    \
+            goto leftProgram;                                                                        \
+        }                                                                                            \
+        if (--untilEvent == 0) {                                                                     \
+            goto event;                                                                              \
+        }                                                                                            \
+        current = &program[pc];                                                                      \
+        counts[current->opcode]++;                                                                   \
+        goto* current->handler;                                                                      \
+    } while (0)
+#define NEXT() \
+    pc++;      \
+    DISPATCH()
+#define CHECK_ADDRESS(kind)                                                                             \
+    if (address % 4 != 0 || address >= MEMORY_BYTES) {                                                  \
+        throw runtime_error("ERROR: Bad " kind " address " + hex(address) + " at " + hex(pc * 4)); \
+    }
+
+    DISPATCH();
+
+add:
+    R[current->d] = R[current->s] + R[current->t];
+    NEXT();
+sub:
+    R[current->d] = R[current->s] - R[current->t];
+    NEXT();
+slt:
+    R[current->d] = (int32_t)R[current->s] < (int32_t)R[current->t];
+    NEXT();
+sltu:
+    R[current->d] = R[current->s] < R[current->t];
+    NEXT();
+mult: {
+    int64_t product = (int64_t)(int32_t)R[current->s] * (int32_t)R[current->t];
+    lo = product;
+    hi = (uint64_t)product >> 32;
+    NEXT();
+}
+multu: {
+    uint64_t product = (uint64_t)R[current->s] * R[current->t];
+    lo = product;
+    hi = product >> 32;
+    NEXT();
+}
+div:
+    if (R[current->t] == 0) {
+        throw runtime_error("ERROR: Division by zero at " + hex(pc * 4));
+    }
+    if ((int32_t)R[current->s] == INT32_MIN && (int32_t)R[current->t] == -1) {
+        lo = INT32_MIN;  // Overflows in C++, wraps on MIPS
+        hi = 0;
+    } else {
+        lo = (int32_t)R[current->s] / (int32_t)R[current->t];
+        hi = (int32_t)R[current->s] % (int32_t)R[current->t];
+    }
+    NEXT();
+divu:
+    if (R[current->t] == 0) {
+        throw runtime_error("ERROR: Division by zero at " + hex(pc * 4));
+    }
+    lo = R[current->s] / R[current->t];
+    hi = R[current->s] % R[current->t];
+    NEXT();
+mfhi:
+    R[current->d] = hi;
+    NEXT();
+mflo:
+    R[current->d] = lo;
+    NEXT();
+lis:
+    R[current->d] = pc + 1 < MEMORY_BYTES / 4 ? memory[pc + 1] : 0;
+    pc += 2;
+    DISPATCH();
+lw:
+    address = R[current->s] + current->immediate;
+    if (address == INPUT_ADDRESS) {
+        R[current->t] = getchar();
+    } else {
+        CHECK_ADDRESS("load")
+        R[current->t] = memory[address / 4];
+    }
+    NEXT();
+sw:
+    address = R[current->s] + current->immediate;
+    if (address == OUTPUT_ADDRESS) {
+        putchar(R[current->t] & 0xff);
+    } else {
+        CHECK_ADDRESS("store")
+        memory[address / 4] = R[current->t];
+        if (address / 4 < programWords) {
+            Instruction decoded = decode(R[current->t]);
+            decoded.handler = handlers[decoded.opcode];
+            program[address / 4] = decoded;
+        }
+    }
+    NEXT();
+beq:
+    pc += 1 + (R[current->s] == R[current->t] ? current->immediate : 0);
+    DISPATCH();
+bne:
+    pc += 1 + (R[current->s] != R[current->t] ? current->immediate : 0);
+    DISPATCH();
+jr:
+    address = R[current->s];
+    goto jump;
+jalr:
+    address = R[current->s];
+    R[31] = (pc + 1) * 4;
+    goto jump;
+jump:
+    if (address % 4 != 0) {
+        throw runtime_error("ERROR: Bad jump address " + hex(address) + " at " + hex(pc * 4));
+    }
+    pc = address / 4;
+    DISPATCH();
+jrTracked:
+    address = R[current->s];
+    if (!machine.callStack.empty() && machine.callStack.back().second == address) {
+        machine.callStack.pop_back();
+    }
+    goto jump;
+jalrTracked:
+    address = R[current->s];
+    R[31] = (pc + 1) * 4;
+    machine.callStack.push_back({address, R[31]});
+    goto jump;
+event:
+    stepsLeft -= period;
+    if (stepsLeft == 0) {
+        throw runtime_error("ERROR: Stopped after " + to_string(machine.maxSteps) + " steps");
+    }
+    sample(machine, pc);
+    period = untilEvent = min(stepsLeft, machine.sampleInterval);
+    current = &program[pc];
+    counts[current->opcode]++;
+    goto* current->handler;
+invalid:
+    throw runtime_error("ERROR: Invalid instruction " + hex(memory[pc]) + " at " + hex(pc * 4));
+
+leftProgram:
+    if (pc * 4 != RETURN_ADDRESS) {
+        throw runtime_error("ERROR: Jumped outside the program to " + hex(pc * 4));
+    }
+    machine.hi = hi;
+    machine.lo = lo;
+
+#undef DISPATCH
+#undef NEXT
+#undef CHECK_ADDRESS
+}
+
+int main(int argc, char* argv[]) {
+    Machine machine;
+    bool array = false;
+    bool showCounts = false;
+    string profilePath;
+    string instrumentPath;
+    string symbolsPath, flatPath, stacksPath;
+    vector<string> operands;
+
+    try {
+        for (int i = 1; i < argc; i++) {
+            string option = argv[i];
+            if (option == "--array") {
+                array = true;
+            } else if (option == "--counts") {
+                showCounts = true;
+            } else if (option == "--max-steps" && i + 1 < argc) {
+                machine.maxSteps = stoull(argv[++i]);
+            } else if (option == "--profile" && i + 1 < argc) {
+                profilePath = argv[++i];
+            } else if (option == "--instrument" && i + 1 < argc) {
+                instrumentPath = argv[++i];
+            } else if (option == "--sample" && i + 1 < argc) {
+                machine.sampleInterval = stoull(argv[++i]);
+            } else if (option == "--symbols" && i + 1 < argc) {
+                symbolsPath = argv[++i];
+            } else if (option == "--flat" && i + 1 < argc) {
+                flatPath = argv[++i];
+            } else if (option == "--stacks" && i + 1 < argc) {
+                stacksPath = argv[++i];
+            } else if (option.size() > 1 && option[0] == '-' && !isdigit((unsigned char)option[1])) {
+                cerr << "ERROR: Unknown option " << option << endl;
+                return 1;
+            } else {
+                operands.push_back(option);
+            }
+        }
+    } catch (const logic_error&) {
+        cerr << "ERROR: Bad option value" << endl;
+        return 1;
+    }
+    if (operands.empty() || (!array && operands.size() != 3)) {
+        cerr << "Usage: mips-sim [OPTIONS] PROGRAM A B" << endl;
+        cerr << "       mips-sim [OPTIONS] --array PROGRAM V1 V2 ..." << endl;
+        return 1;
+    }
+    if ((!flatPath.empty() || !stacksPath.empty()) && machine.sampleInterval == 0) {
+        machine.sampleInterval = DEFAULT_SAMPLE_INTERVAL;
+    }
+
+    try {
+        uint32_t programWords = load(machine, operands[0]);
+        vector<pair<uint32_t, string>> symbols;
+        if (!symbolsPath.empty()) {
+            symbols = readSymbols(symbolsPath);
+        }
+
+        if (array) {
+            // The array goes right after the program
+            uint32_t length = operands.size() - 1;
+            for (uint32_t i = 0; i < length; i++) {
+                machine.memory[programWords + i] = stol(operands[i + 1]);
+            }
+            machine.registers[1] = programWords * 4;
+            machine.registers[2] = length;
+        } else {
+            machine.registers[1] = stol(operands[1]);
+            machine.registers[2] = stol(operands[2]);
+        }
+        machine.registers[30] = MEMORY_BYTES;
+        machine.registers[31] = RETURN_ADDRESS;
+
+        try {
+            run(machine);
+        } catch (...) {
+            fflush(stdout);
+            throw;
+        }
+        fflush(stdout);
+        if (!profilePath.empty()) {
+            writeProfile(machine, programWords, profilePath);
+        }
+        if (!instrumentPath.empty()) {
+            writeInstrumentCounts(machine, programWords, instrumentPath);
+        }
+        if (!flatPath.empty()) {
+            writeFlatProfile(machine, symbols, flatPath);
+        }
+        if (!stacksPath.empty()) {
+            bool hasWain = any_of(symbols.begin(), symbols.end(), [](const auto& symbol) { return symbol.second == "wain"; });
+            string program = operands[0].substr(operands[0].rfind('/') + 1);
+            writeCollapsedStacks(machine, symbols, hasWain ? "wain" : program, stacksPath);
+        }
+
+        for (int r = 1; r < 32; r++) {
+            cerr << "$" << (r < 10 ? "0" : "") << r << " = " << hex(machine.registers[r]) << (r % 4 == 0 ? "\n" : "   ");
+        }
+        cerr << endl;
+
+        if (showCounts) {
+            uint64_t total = 0, cycles = 0;
+            for (int op = 0; op < INVALID; op++) {
+                total += machine.counts[op];
+                cycles += machine.counts[op] * OPCODE_CYCLES[op];
+            }
+            for (int op = 0; op < INVALID; op++) {
+                if (machine.counts[op] != 0) {
+                    fprintf(stderr, "%-6s %12llu\n", OPCODE_NAMES[op], (unsigned long long)machine.counts[op]);
+                }
+            }
+            fprintf(stderr, "%-6s %12llu\n", "total", (unsigned long long)total);
+            fprintf(stderr, "%-6s %12llu\n", "cycles", (unsigned long long)cycles);
+        }
+    } catch (const exception& e) {
+        cerr << e.what() << endl;
+        return 1;
+    }
+    return 0;
+}